@@ -0,0 +1,722 @@
+// nbody_accel.c: Force evaluation modes shared by all n-body versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// Every version computes the acceleration of a body with accel_body(i). For the
+// direct solver that is just the all-pairs kernel for body i. Solvers that need
+// work by the whole team first (tiled and symmetric pairs, building the
+// Barnes-Hut tree, the fast multipole passes, the particle-mesh FFTs, the cell
+// solver's neighbor lists) do it in accel_prepare(), which all threads of the
+// team call once per step before their first accel_body().
+//
+// The tiled solver is the direct sum blocked for the caches. The direct solver
+// streams all sources past every body, so once the bodies no longer fit in L1
+// (about 2000 of them) every pair reloads its source from L2 or memory. The
+// tiled one takes a tile of tile_i targets that fits in L2 and runs it against
+// tiles of tile_j sources that fit in L1, TILE_ROWS targets at a time in
+// registers, so each source load is shared by TILE_ROWS pairs and comes from L1.
+//
+// With --precision=single or mixed the direct solver runs the float kernels on
+// float copies of the positions (made in accel_prepare()) and masses. Only the
+// force sum changes precision; the integration in update() stays in double.
+//
+// Bodies no heavier than --tracer-mass (massless ones by default) are tracers:
+// they are moved by the sources but pull on nothing. The direct and tiled
+// solvers keep the sources in arrays of their own, gathered in accel_prepare(),
+// so a step costs numBodies x sources pairs instead of numBodies^2. Every
+// body, tracer or not, then costs the same number of pairs, so the equal blocks
+// of bodies the versions give their threads stay balanced, and the gather is
+// split evenly over the sources.
+//
+// With --reproducible a run ends in the same bits for any thread count and in
+// every version, -O0 or -O3, and prints a checksum of the final state to
+// compare runs by (the kernels differ by instruction set, so fix --isa when
+// comparing machines). The direct, tiled, Barnes-Hut, multipole and cell solvers
+// already sum each body in an order that does not depend on the team, and the
+// Makefile turns off multiply-add contraction so the -O levels round alike;
+// for them the mode costs nothing. The cost, per step, measured on one core:
+//   direct, tiled, bh, fmm   none (no contraction: within 1% at -O3)
+//   cell                     none (lists are binned in body order)
+//   pm                       2-8% for the fixed point mass deposit (100k bodies, grid 512)
+//   symmetric                not supported: its thread buffers are summed in
+//                            thread order; direct is the fallback, 12.2 ms
+//                            against 15.1 ms for symmetric at 2500 bodies
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_accel.h"
+#include "nbody_bh.h"
+#include "nbody_fmm.h"
+#include "nbody_pm.h"
+#include "nbody_cell.h"
+#include "nbody_compact.h"
+
+enum { SOLVER_DIRECT, SOLVER_TILED, SOLVER_SYMMETRIC, SOLVER_BH, SOLVER_FMM, SOLVER_PM, SOLVER_CELL };
+
+static int solver;					/* which force solver is used */
+static int team_size;				/* number of threads accel_init() was set up for */
+static AccelKernelFloat float_kernel;	/* direct solver kernel, NULL for double precision */
+static float *float_x, *float_y, *float_m;	/* float copies of the sources */
+static double *accel_x, *accel_y;	/* accelerations found by accel_prepare() */
+
+// Tracer state
+static int num_sources;				/* bodies heavier than --tracer-mass */
+static int *source_index;			/* body of each source, NULL when there are no tracers */
+static double *source_x, *source_y, *source_m;	/* gathered sources */
+
+// Tiled solver state
+static int tile_i, tile_j;			/* targets and sources per tile */
+
+// Symmetric solver state
+static double **pair_ax, **pair_ay;	/* one private acceleration buffer per thread */
+static int *pair_rows;				/* thread t does rows [pair_rows[t], pair_rows[t + 1]) */
+
+void team_barrier(Team *team)
+{
+	if (team->size > 1)
+	{
+		team->barrier();
+	}
+
+	return;
+}
+
+/* Size of a cache level in bytes from sysconf, or fallback if it is unknown */
+static long cache_size(int name, long fallback)
+{
+	long size = sysconf(name);
+	return size > 0 ? size : fallback;
+}
+
+/* Pick the tile sizes: --tile-i/--tile-j if given, otherwise half of L1 for
+ * the source tile (x, y, m) and a quarter of L2 for the target tile (x, y, ax, ay) */
+static void choose_tiles()
+{
+	tile_j = opt_tile_j;
+	if (tile_j == 0)
+	{
+		tile_j = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 * 1024) / 2 / (3 * sizeof(double));
+	}
+	tile_j = tile_j < SOA_PAD ? SOA_PAD : tile_j / SOA_PAD * SOA_PAD;	// whole vectors
+
+	tile_i = opt_tile_i;
+	if (tile_i == 0)
+	{
+		tile_i = cache_size(_SC_LEVEL2_CACHE_SIZE, 256 * 1024) / 4 / (4 * sizeof(double));
+	}
+	tile_i = tile_i < TILE_ROWS ? TILE_ROWS : tile_i / TILE_ROWS * TILE_ROWS;
+
+	#ifndef NO_OUT
+	printf("Tiles: %d targets x %d sources\n", tile_i, tile_j);
+	#endif
+
+	return;
+}
+
+/* List the sources in body order, with their masses */
+static void fill_sources()
+{
+	int i, k;
+
+	for (i = 0, k = 0; i < numBodies; i++)
+	{
+		if (body_info.mass[i] > opt_tracer_mass)
+		{
+			source_index[k] = i;
+			source_m[k] = body_info.mass[i];
+			k++;
+		}
+	}
+
+	return;
+}
+
+/* Find the sources. Without tracers the kernels use the body arrays as they
+ * are; otherwise the sources get their own arrays, filled by prepare_sources() */
+static void init_tracers()
+{
+	int i;
+
+	num_sources = 0;
+	for (i = 0; i < numBodies; i++)
+	{
+		if (body_info.mass[i] > opt_tracer_mass)
+		{
+			num_sources++;
+		}
+	}
+
+	if (num_sources == numBodies)
+	{
+		source_index = NULL;
+		return;
+	}
+
+	if (solver != SOLVER_DIRECT && solver != SOLVER_TILED)
+	{
+		printf("Tracers are only supported by the direct and tiled solvers\n");
+		exit(1);
+	}
+
+	source_index = (int*)my_malloc(sizeof(int) * (num_sources + 1));
+	source_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	source_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	source_m = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	fill_sources();
+
+	#ifndef NO_OUT
+	printf("Tracers: %d of %d bodies\n", numBodies - num_sources, numBodies);
+	#endif
+
+	return;
+}
+
+/* Each thread gathers the positions of an equal block of the sources */
+static void prepare_sources(Team *team)
+{
+	int first, last, k;
+
+	first = ((long)team->id * num_sources) / team->size;
+	last = ((long)(team->id + 1) * num_sources) / team->size;
+	for (k = first; k < last; k++)
+	{
+		source_x[k] = bodies->x[source_index[k]];
+		source_y[k] = bodies->y[source_index[k]];
+	}
+
+	team_barrier(team);
+
+	return;
+}
+
+/* Each thread does an equal block of bodies against all sources, one target
+ * tile at a time, each target tile against all source tiles in turn. The
+ * blocks start on a multiple of TILE_ROWS, so only the last bodies of the
+ * system go through the leftover rows of the tile kernel, whatever the team
+ * size, and every body gets the same bits from any number of threads. */
+static void prepare_tiled(Team *team)
+{
+	const double *x = bodies->x;
+	const double *y = bodies->y;
+	const double *sx = source_index != NULL ? source_x : x;
+	const double *sy = source_index != NULL ? source_y : y;
+	const double *sm = source_index != NULL ? source_m : body_info.mass;
+	int groups = (numBodies + TILE_ROWS - 1) / TILE_ROWS;
+	int first, last, ib, jb;
+
+	first = ((long)team->id * groups) / team->size * TILE_ROWS;
+	last = ((long)(team->id + 1) * groups) / team->size * TILE_ROWS;
+	last = last < numBodies ? last : numBodies;
+	memset(accel_x + first, 0, (last - first) * sizeof(double));
+	memset(accel_y + first, 0, (last - first) * sizeof(double));
+
+	for (ib = first; ib < last; ib += tile_i)
+	{
+		int ni = last - ib < tile_i ? last - ib : tile_i;
+
+		for (jb = 0; jb < num_sources; jb += tile_j)
+		{
+			int nj = num_sources - jb < tile_j ? num_sources - jb : tile_j;
+
+			accel_tile_kernel(x + ib, y + ib, ni, sx + jb, sy + jb, sm + jb, nj,
+							  accel_x + ib, accel_y + ib);
+		}
+	}
+
+	team_barrier(team);
+
+	return;
+}
+
+/* Float copies of the masses of the sources */
+static void fill_float_masses()
+{
+	int k;
+
+	for (k = 0; k < num_sources; k++)
+	{
+		float_m[k] = body_info.mass[source_index != NULL ? source_index[k] : k];
+	}
+
+	return;
+}
+
+/* Set up the float copies of the sources for --precision=single|mixed */
+static void init_precision()
+{
+	if (strcmp(opt_precision, "double") == 0)
+	{
+		float_kernel = NULL;
+		return;
+	}
+	else if (strcmp(opt_precision, "single") == 0)
+	{
+		float_kernel = accel_kernel_single;
+	}
+	else if (strcmp(opt_precision, "mixed") == 0)
+	{
+		float_kernel = accel_kernel_mixed;
+	}
+	else
+	{
+		printf("Unknown precision: %s\n", opt_precision);
+		exit(1);
+	}
+
+	if (solver != SOLVER_DIRECT)
+	{
+		printf("--precision=%s is only supported by the direct solver\n", opt_precision);
+		exit(1);
+	}
+
+	float_x = (float*)my_aligned_malloc(numPadded * sizeof(float));
+	float_y = (float*)my_aligned_malloc(numPadded * sizeof(float));
+	float_m = (float*)my_aligned_malloc(numPadded * sizeof(float));
+	fill_float_masses();
+
+	return;
+}
+
+/* Each thread converts the positions of an equal block of the sources to float */
+static void prepare_float(Team *team)
+{
+	int first, last, k;
+
+	first = ((long)team->id * num_sources) / team->size;
+	last = ((long)(team->id + 1) * num_sources) / team->size;
+	for (k = first; k < last; k++)
+	{
+		int i = source_index != NULL ? source_index[k] : k;
+
+		float_x[k] = bodies->x[i];
+		float_y[k] = bodies->y[i];
+	}
+
+	team_barrier(team);
+
+	return;
+}
+
+/* Split the rows of the upper triangle i < j into parts with about the same
+ * number of pairs each. Row i has numBodies - 1 - i pairs, so equal row counts
+ * would give the first thread almost twice the average work. */
+static void split_triangle(int parts, int *rows)
+{
+	double total = (double)numBodies * (numBodies - 1) / 2.0;
+	double done = 0.0;
+	int t = 1;
+	int i;
+
+	rows[0] = 0;
+	for (i = 0; i < numBodies && t < parts; i++)
+	{
+		while (t < parts && done >= total * t / parts)
+		{
+			rows[t++] = i;
+		}
+		done += numBodies - 1 - i;
+	}
+	while (t <= parts)
+	{
+		rows[t++] = numBodies;
+	}
+
+	return;
+}
+
+/* Visit each pair (i, j) with i < j once, for the rows [first, last), and add
+ * the equal and opposite accelerations of both bodies to the buffers */
+static void accumulate_pairs(int first, int last, double *ax, double *ay)
+{
+	const double *x = bodies->x;
+	const double *y = bodies->y;
+	const double *mass = body_info.mass;
+	double k = K;
+	double eps2 = softening * softening;
+	int i, j;
+
+	for (i = first; i < last; i++)
+	{
+		double xi = x[i];
+		double yi = y[i];
+		double mi = mass[i];
+		double sum_x = 0;
+		double sum_y = 0;
+
+		for (j = i + 1; j < numBodies; j++)
+		{
+			double dx = x[j] - xi;
+			double dy = y[j] - yi;
+			double r_squared = dx*dx + dy*dy + eps2;
+			double s = r_squared != 0 ? k / (r_squared * sqrt(r_squared)) : 0;
+
+			sum_x += mass[j] * s * dx;
+			sum_y += mass[j] * s * dy;
+			ax[j] -= mi * s * dx;
+			ay[j] -= mi * s * dy;
+		}
+
+		ax[i] += sum_x;
+		ay[i] += sum_y;
+	}
+
+	return;
+}
+
+/* Each thread does its share of the triangle into its own buffer, then the
+ * buffers are summed (in thread order) over a block of bodies per thread */
+static void prepare_symmetric(Team *team)
+{
+	int first, last, i, t;
+
+	accumulate_pairs(pair_rows[team->id], pair_rows[team->id + 1], pair_ax[team->id], pair_ay[team->id]);
+	team_barrier(team);
+
+	first = ((long)team->id * numBodies) / team->size;
+	last = ((long)(team->id + 1) * numBodies) / team->size;
+	for (i = first; i < last; i++)
+	{
+		double ax = 0;
+		double ay = 0;
+
+		for (t = 0; t < team->size; t++)
+		{
+			ax += pair_ax[t][i];
+			ay += pair_ay[t][i];
+			pair_ax[t][i] = 0;		// Ready for the next step
+			pair_ay[t][i] = 0;
+		}
+		accel_x[i] = ax;
+		accel_y[i] = ay;
+	}
+
+	team_barrier(team);
+
+	return;
+}
+
+/* Set up the solver chosen with --solver for a team of num_threads threads.
+ * Must be called after init(). */
+void accel_init(int num_threads)
+{
+	int t;
+
+	team_size = num_threads;
+
+	if (strcmp(opt_solver, "direct") == 0)
+	{
+		solver = SOLVER_DIRECT;
+	}
+	else if (strcmp(opt_solver, "tiled") == 0)
+	{
+		solver = SOLVER_TILED;
+		accel_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		accel_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		choose_tiles();
+	}
+	else if (strcmp(opt_solver, "symmetric") == 0)
+	{
+		solver = SOLVER_SYMMETRIC;
+		accel_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		accel_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		pair_ax = (double**)my_malloc(sizeof(double*) * num_threads);
+		pair_ay = (double**)my_malloc(sizeof(double*) * num_threads);
+		for (t = 0; t < num_threads; t++)
+		{
+			pair_ax[t] = (double*)my_aligned_malloc(numPadded * sizeof(double));
+			pair_ay[t] = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		}
+		pair_rows = (int*)my_malloc(sizeof(int) * (num_threads + 1));
+		split_triangle(num_threads, pair_rows);
+	}
+	else if (strcmp(opt_solver, "bh") == 0)
+	{
+		solver = SOLVER_BH;
+		bh_init(num_threads);
+	}
+	else if (strcmp(opt_solver, "fmm") == 0)
+	{
+		if (opt_order < 1 || opt_order > FMM_MAX_ORDER)
+		{
+			printf("Expansion order must be between 1 and %d\n", FMM_MAX_ORDER);
+			exit(1);
+		}
+		solver = SOLVER_FMM;
+		fmm_init(opt_order);
+	}
+	else if (strcmp(opt_solver, "pm") == 0)
+	{
+		int assign = strcmp(opt_assign, "tsc") == 0 ? PM_TSC : PM_CIC;
+
+		if (opt_grid < 4 || (opt_grid & (opt_grid - 1)) != 0)
+		{
+			printf("Particle-mesh grid must be a power of 2, at least 4\n");
+			exit(1);
+		}
+		if (strcmp(opt_assign, "cic") != 0 && strcmp(opt_assign, "tsc") != 0)
+		{
+			printf("Unknown mass assignment: %s\n", opt_assign);
+			exit(1);
+		}
+		solver = SOLVER_PM;
+		pm_init(opt_grid, assign, num_threads);
+	}
+	else if (strcmp(opt_solver, "cell") == 0)
+	{
+		if (opt_cutoff <= 0)
+		{
+			printf("The cell solver needs --cutoff\n");
+			exit(1);
+		}
+		solver = SOLVER_CELL;
+		cell_init(opt_cutoff, opt_skin >= 0 ? opt_skin : opt_cutoff / 5, num_threads);
+	}
+	else
+	{
+		printf("Unknown solver: %s\n", opt_solver);
+		exit(1);
+	}
+
+	init_tracers();
+	init_precision();
+
+	// The other solvers have gravity built in (far field expansions, pair loops, float kernels)
+	if (strcmp(force_law, "gravity") != 0 && ((solver != SOLVER_DIRECT && solver != SOLVER_CELL) || float_kernel != NULL))
+	{
+		printf("Force law %s is only supported by the direct and cell solvers in double precision\n", force_law);
+		exit(1);
+	}
+
+	// Only the sums of accel_kernel have rsqrt versions, see nbody_kernel.c
+	if (opt_rsqrt >= 0 && ((solver != SOLVER_DIRECT && solver != SOLVER_CELL) || float_kernel != NULL))
+	{
+		printf("--rsqrt is only supported by the direct and cell solvers in double precision\n");
+		exit(1);
+	}
+
+	// The pair buffers are split by thread, so their sums depend on the team size
+	if (opt_reproducible && solver == SOLVER_SYMMETRIC)
+	{
+		printf("--reproducible is not supported by the symmetric solver, use direct or tiled\n");
+		exit(1);
+	}
+
+	#ifndef NO_OUT
+	if (opt_reproducible)
+	{
+		printf("Reproducible: %s\n", solver == SOLVER_PM ? "fixed point mass deposit, a few percent per step"
+														 : "no extra work for this solver");
+	}
+	#endif
+
+	// compact_body() has its own kernel, the plain direct sum of gravity
+	if (compact_storage && (solver != SOLVER_DIRECT || float_kernel != NULL || source_index != NULL
+							|| opt_rsqrt >= 0 || strcmp(force_law, "gravity") != 0))
+	{
+		printf("--storage=compact only supports the direct solver for gravity, in double precision without --rsqrt or tracers\n");
+		exit(1);
+	}
+
+	return;
+}
+
+/* Team part of the force evaluation for the current step. Every thread of the
+ * team must call this before accel_body(); the accelerations are ready for all
+ * bodies when it returns. */
+void accel_prepare(Team *team)
+{
+	assert(team->size == team_size);
+
+	if (solver == SOLVER_DIRECT && float_kernel != NULL)
+	{
+		prepare_float(team);
+	}
+	else if (source_index != NULL)
+	{
+		prepare_sources(team);
+		if (solver == SOLVER_TILED)
+		{
+			prepare_tiled(team);
+		}
+	}
+	else if (solver == SOLVER_TILED)
+	{
+		prepare_tiled(team);
+	}
+	else if (solver == SOLVER_SYMMETRIC)
+	{
+		prepare_symmetric(team);
+	}
+	else if (solver == SOLVER_BH)
+	{
+		// Tree is built by the whole team, then walked by all of them in accel_body()
+		bh_build(team);
+	}
+	else if (solver == SOLVER_FMM)
+	{
+		fmm_prepare(team);
+	}
+	else if (solver == SOLVER_PM)
+	{
+		pm_prepare(team);
+	}
+	else if (solver == SOLVER_CELL)
+	{
+		cell_prepare(team);
+	}
+
+	return;
+}
+
+/* Add the acceleration of body i for the current step to *ax and *ay */
+void accel_body(int i, double *ax, double *ay)
+{
+	if (solver == SOLVER_DIRECT && float_kernel != NULL)
+	{
+		float_kernel(bodies->x[i], bodies->y[i], float_x, float_y, float_m, num_sources, ax, ay);
+	}
+	else if (solver == SOLVER_DIRECT && source_index != NULL)
+	{
+		accel_kernel(bodies->x[i], bodies->y[i], source_x, source_y, source_m, num_sources, ax, ay);
+	}
+	else if (solver == SOLVER_DIRECT)
+	{
+		accel_kernel(bodies->x[i], bodies->y[i], bodies->x, bodies->y, body_info.mass, numBodies, ax, ay);
+	}
+	else if (solver == SOLVER_BH)
+	{
+		bh_accel(bodies->x[i], bodies->y[i], opt_theta, ax, ay);
+	}
+	else if (solver == SOLVER_FMM)
+	{
+		fmm_accel(bodies->x[i], bodies->y[i], ax, ay);
+	}
+	else if (solver == SOLVER_PM)
+	{
+		pm_accel(bodies->x[i], bodies->y[i], ax, ay);
+	}
+	else if (solver == SOLVER_CELL)
+	{
+		cell_accel(i, ax, ay);
+	}
+	else
+	{
+		*ax += accel_x[i];
+		*ay += accel_y[i];
+	}
+
+	return;
+}
+
+/* The bodies were renumbered (--merge, --sort), and with --merge numBodies
+ * shrank: redo what was set up for the old bodies. Called by one thread while
+ * the team waits. */
+void accel_bodies_changed()
+{
+	// --merge does not allow tracers, so only a reorder gets here with them
+	if (source_index != NULL)
+	{
+		fill_sources();
+	}
+	if (float_kernel != NULL)
+	{
+		fill_float_masses();
+	}
+
+	if (solver == SOLVER_SYMMETRIC)
+	{
+		split_triangle(team_size, pair_rows);
+	}
+	else if (solver == SOLVER_CELL)
+	{
+		cell_invalidate();
+	}
+
+	return;
+}
+
+/* accel_body() that also adds the potential of body i per unit mass to *pot
+ * with the twin of the force kernel. Only the direct solver in double
+ * precision has it, which diag_init() checks; the others set *pot to NaN. */
+void accel_body_pot(int i, double *ax, double *ay, double *pot)
+{
+	if (solver == SOLVER_DIRECT && float_kernel == NULL && source_index != NULL)
+	{
+		accel_kernel_pot(bodies->x[i], bodies->y[i], source_x, source_y, source_m, num_sources, ax, ay, pot);
+	}
+	else if (solver == SOLVER_DIRECT && float_kernel == NULL)
+	{
+		accel_kernel_pot(bodies->x[i], bodies->y[i], bodies->x, bodies->y, body_info.mass, numBodies, ax, ay, pot);
+	}
+	else
+	{
+		accel_body(i, ax, ay);
+		*pot = NAN;
+	}
+
+	return;
+}
+
+void accel_free()
+{
+	int t;
+
+	if (float_kernel != NULL)
+	{
+		free(float_x);
+		free(float_y);
+		free(float_m);
+	}
+
+	if (source_index != NULL)
+	{
+		free(source_index);
+		free(source_x);
+		free(source_y);
+		free(source_m);
+	}
+
+	if (solver == SOLVER_SYMMETRIC)
+	{
+		for (t = 0; t < team_size; t++)
+		{
+			free(pair_ax[t]);
+			free(pair_ay[t]);
+		}
+		free(pair_ax);
+		free(pair_ay);
+		free(pair_rows);
+		free(accel_x);
+		free(accel_y);
+	}
+	else if (solver == SOLVER_TILED)
+	{
+		free(accel_x);
+		free(accel_y);
+	}
+	else if (solver == SOLVER_BH)
+	{
+		bh_free();
+	}
+	else if (solver == SOLVER_FMM)
+	{
+		fmm_free();
+	}
+	else if (solver == SOLVER_PM)
+	{
+		pm_free();
+	}
+	else if (solver == SOLVER_CELL)
+	{
+		cell_free();
+	}
+
+	return;
+}
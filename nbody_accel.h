@@ -0,0 +1,26 @@
+// nbody_accel.h: Force evaluation modes shared by all n-body versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_ACCEL_H
+#define NBODY_ACCEL_H
+
+/* The threads working on one simulation. The seq version is a team of one.
+ * barrier must make every thread of the team wait for the others; it may be
+ * NULL when size is 1. */
+typedef struct TeamStruct {
+	int id;					/* rank of this thread in the team */
+	int size;				/* number of threads in the team */
+	void (*barrier)(void);	/* wait for the whole team */
+} Team;
+
+void team_barrier(Team *team);
+
+void accel_init(int num_threads);
+void accel_prepare(Team *team);
+void accel_body(int i, double *ax, double *ay);
+void accel_body_pot(int i, double *ax, double *ay, double *pot);
+void accel_bodies_changed();
+void accel_free();
+
+#endif
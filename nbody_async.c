@@ -0,0 +1,390 @@
+// nbody_async.c: Bounded staleness stepping of the v2 versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The v2 versions stop every thread at a barrier each step (two of them in
+// pthread_v2, the omp for and the omp single in omp_v2), so every step goes
+// at the pace of the slowest thread of that step. With --stale=<k> they run
+// their steps here instead, without barriers:
+//   - every thread owns a partition, the same block of bodies as usual, and
+//     keeps its velocities to itself. After each step it publishes the new
+//     positions of its partition in a ring of versions and then the step
+//     number as the partition's version.
+//   - to take step s a thread needs the positions after step s - 1. For the
+//     other partitions it takes the newest version up to s - 1 that is
+//     published, and waits only when that is older than s - 1 - k. A thread
+//     can therefore be at most k + 1 steps ahead of any other.
+//   - with the thread k + 1 steps ahead, a partition can be read at version
+//     s - 1 - k while its owner writes version s + k, so the ring keeps
+//     2k + 2 versions and no version is overwritten while it can be read.
+// With --stale=0 every step reads the positions after the step before, as
+// with the barriers, and the run ends in the same bits; it only trades the
+// barriers for waits on the partitions it reads. With k > 0 the forces use
+// positions up to k steps old, which is fine for exploring but not for
+// --reproducible. Only the direct solver in double precision without
+// tracers, with the Euler step and none of the modules that move or renumber
+// the bodies, is supported.
+//
+// Thread 0 draws the frames: it waits for every partition to publish the
+// frame's step, whose versions stay in the ring until it is done. A
+// synchronized run waits for the frame's step as well, so that wait is
+// printed on its own and not counted as blocked.
+//
+// At the end, each thread's staleness (how many steps old the partitions it
+// read were) and time blocked on partitions are printed with the step
+// timings. The time a synchronized run would have spent at its barriers is
+// estimated from the work each thread did in each step: every thread would
+// wait for the one with the most work. That estimate minus the time blocked
+// here is the barrier time saved.
+
+#include <assert.h>
+#include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_block.h"
+#include "nbody_compact.h"
+#include "nbody_integrate.h"
+#include "nbody_async.h"
+
+typedef struct
+{
+	int lo, hi;			/* bodies [lo, hi) of the partition */
+	int version;		/* last step whose positions are in the ring, read and written atomically */
+	double *x, *y;		/* positions of all bodies as the owner reads them this step */
+	double waited;		/* seconds the owner was blocked on stale partitions */
+	long waits;			/* times the owner was blocked */
+	double frame_waited;	/* seconds thread 0 waited for the steps of the frames */
+	long frame_waits;
+	long reads;			/* other partitions the owner read */
+	long stale_sum;		/* steps behind of those reads, summed */
+	long *stale_count;	/* reads of each staleness, 0 to k */
+} Partition;
+
+int async_steps;
+
+static int team_size;			/* number of threads async_init() was set up for */
+static int ring_size;			/* versions of the positions kept */
+static double **ring_x;			/* positions after step v are in ring_x[v % ring_size] */
+static double **ring_y;
+static double *vel_x, *vel_y;	/* velocities, each thread writes its own partition only */
+static Partition **part;		/* per thread, each on its own cache lines */
+static double *work;			/* seconds of work of each thread in each step */
+
+void async_init(int num_threads)
+{
+	int t, v, i, sources = 0;
+
+	async_steps = opt_stale >= 0;
+	if (!async_steps)
+	{
+		return;
+	}
+
+	for (i = 0; i < numBodies; i++)
+	{
+		sources += body_info.mass[i] > opt_tracer_mass;
+	}
+	if (strcmp(opt_solver, "direct") != 0 || strcmp(opt_precision, "double") != 0 || sources != numBodies)
+	{
+		printf("--stale is only supported by the direct solver in double precision without tracers\n");
+		exit(1);
+	}
+	if (compact_storage || opt_merge || block_steps || symplectic || strcmp(opt_sort, "none") != 0
+		|| opt_balance > 0 || opt_balance_log != NULL || opt_fof != NULL || opt_diag != NULL)
+	{
+		printf("--stale is not supported with --storage=compact, --merge, --block-levels, --integrator,\n");
+		printf("--sort, --balance, --fof or --diag\n");
+		exit(1);
+	}
+	if (opt_reproducible && opt_stale > 0)
+	{
+		printf("--reproducible needs --stale=0: stale positions depend on the timing of the threads\n");
+		exit(1);
+	}
+
+	team_size = num_threads;
+	ring_size = 2 * opt_stale + 2;
+	ring_x = (double**)my_malloc(sizeof(double*) * ring_size);
+	ring_y = (double**)my_malloc(sizeof(double*) * ring_size);
+	for (v = 0; v < ring_size; v++)
+	{
+		ring_x[v] = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		ring_y[v] = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	}
+	memcpy(ring_x[0], bodies->x, numBodies * sizeof(double));
+	memcpy(ring_y[0], bodies->y, numBodies * sizeof(double));
+	vel_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	vel_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	memcpy(vel_x, bodies->vx, numBodies * sizeof(double));
+	memcpy(vel_y, bodies->vy, numBodies * sizeof(double));
+
+	part = (Partition**)my_malloc(sizeof(Partition*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		Partition *p = (Partition*)my_aligned_malloc((sizeof(Partition) + SOA_ALIGN - 1) / SOA_ALIGN * SOA_ALIGN);
+
+		// The same blocks the versions give their threads
+		p->lo = (int)(((long)t * numBodies) / num_threads);
+		p->hi = (int)(((long)(t + 1) * numBodies) / num_threads);
+		p->version = 0;
+		p->x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		p->y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+		memset(p->x, 0, numPadded * sizeof(double));
+		memset(p->y, 0, numPadded * sizeof(double));
+		p->waited = 0;
+		p->waits = 0;
+		p->frame_waited = 0;
+		p->frame_waits = 0;
+		p->reads = 0;
+		p->stale_sum = 0;
+		p->stale_count = (long*)my_malloc(sizeof(long) * (opt_stale + 1));
+		memset(p->stale_count, 0, sizeof(long) * (opt_stale + 1));
+		part[t] = p;
+	}
+	work = (double*)my_malloc(sizeof(double) * ((long)nsteps * num_threads + 1));
+
+	#ifndef NO_OUT
+	printf("Stale: threads read positions up to %d steps old\n", opt_stale);
+	#endif
+
+	return;
+}
+
+/* Wall clock time */
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Version of partition p once it is at least least, adding any wait to
+ * *waited and *waits */
+static int wait_version(Partition *p, int least, double *waited, long *waits)
+{
+	int v = __atomic_load_n(&p->version, __ATOMIC_ACQUIRE);
+
+	if (v < least)
+	{
+		double since = now();
+
+		while ((v = __atomic_load_n(&p->version, __ATOMIC_ACQUIRE)) < least)
+		{
+			sched_yield();
+		}
+		*waited += now() - since;
+		(*waits)++;
+	}
+
+	return v;
+}
+
+/* Run all steps of this thread's partition, see the top of the file. Every
+ * thread of the team must call it instead of its step loop; the step times
+ * are added to *step_time. */
+void async_run(Team *team, double *step_time)
+{
+	Partition *me = part[team->id];
+	int step, t, i;
+
+	assert(team->size == team_size);
+
+	for (step = 1; step <= nsteps; step++)
+	{
+		double step_s = now();
+		double waited = me->waited;
+		double *new_x = ring_x[step % ring_size];
+		double *new_y = ring_y[step % ring_size];
+
+		// Gather the positions the forces of this step are taken from
+		for (t = 0; t < team_size; t++)
+		{
+			Partition *p = part[t];
+			int v = step - 1;
+
+			if (p != me)
+			{
+				v = wait_version(p, step - 1 - opt_stale, &me->waited, &me->waits);
+				// A partition ahead of this one still has the version needed
+				v = v < step - 1 ? v : step - 1;
+				me->reads++;
+				me->stale_sum += step - 1 - v;
+				me->stale_count[step - 1 - v]++;
+			}
+			memcpy(me->x + p->lo, ring_x[v % ring_size] + p->lo, (p->hi - p->lo) * sizeof(double));
+			memcpy(me->y + p->lo, ring_y[v % ring_size] + p->lo, (p->hi - p->lo) * sizeof(double));
+		}
+
+		for (i = me->lo; i < me->hi; i++)
+		{
+			double x = me->x[i];
+			double y = me->y[i];
+			double vx = vel_x[i];
+			double vy = vel_y[i];
+			double ax = 0;
+			double ay = 0;
+
+			// The same sum accel_body() does, over the gathered positions
+			accel_kernel(x, y, me->x, me->y, body_info.mass, numBodies, &ax, &ay);
+
+			x += vx * opt_dt;
+			y += vy * opt_dt;
+
+			if (x>=x_max || x<x_min)
+			{
+				x=x+(ceil((x_max-x)/univ_x)-1)*univ_x;
+			}
+			if (y>=y_max || y<y_min)
+			{
+				y=y+(ceil((y_max-y)/univ_y)-1)*univ_y;
+			}
+
+			vx += ax * opt_dt;
+			vy += ay * opt_dt;
+			assert(!(isnan(x) || isnan(y)));
+			assert(!(isnan(vx) || isnan(vy)));
+			new_x[i] = x;
+			new_y[i] = y;
+			vel_x[i] = vx;
+			vel_y[i] = vy;
+		}
+
+		// The positions are written before the version says they are there
+		__atomic_store_n(&me->version, step, __ATOMIC_RELEASE);
+		work[(long)(step - 1) * team_size + team->id] = now() - step_s - (me->waited - waited);
+
+		#ifndef NO_OUT
+		if (team->id == 0 && step % period == 0)
+		{
+			// No other thread touches the body arrays until the end
+			for (t = 0; t < team_size; t++)
+			{
+				wait_version(part[t], step, &me->frame_waited, &me->frame_waits);
+			}
+			memcpy(bodies->x, new_x, numBodies * sizeof(double));
+			memcpy(bodies->y, new_y, numBodies * sizeof(double));
+			write_frame(step);
+		}
+		#endif
+
+		*step_time += now() - step_s;
+	}
+
+	// Thread 0 may still be drawing from the body arrays
+	team_barrier(team);
+
+	for (i = me->lo; i < me->hi; i++)
+	{
+		bodies->x[i] = ring_x[nsteps % ring_size][i];
+		bodies->y[i] = ring_y[nsteps % ring_size][i];
+		bodies->vx[i] = vel_x[i];
+		bodies->vy[i] = vel_y[i];
+	}
+
+	return;
+}
+
+/* Print the staleness and the barrier time saved, with the step timings */
+void async_report()
+{
+	double barrier = 0, waited = 0;
+	long reads = 0;
+	int step, t, k;
+
+	if (!async_steps)
+	{
+		return;
+	}
+
+	// A synchronized step lasts as long as the thread with the most work
+	for (step = 0; step < nsteps; step++)
+	{
+		double *w = work + (long)step * team_size;
+		double most = 0;
+
+		for (t = 0; t < team_size; t++)
+		{
+			most = w[t] > most ? w[t] : most;
+		}
+		for (t = 0; t < team_size; t++)
+		{
+			barrier += most - w[t];
+		}
+	}
+
+	for (t = 0; t < team_size; t++)
+	{
+		Partition *p = part[t];
+		int worst = 0;
+
+		for (k = 0; k <= opt_stale; k++)
+		{
+			worst = p->stale_count[k] > 0 ? k : worst;
+		}
+		printf("Thread %d avg staleness: %f steps, worst %d, blocked %f s in %ld waits\n", t,
+			p->reads > 0 ? p->stale_sum / (p->reads * 1.0) : 0.0, worst, p->waited, p->waits);
+		if (p->frame_waits > 0)
+		{
+			printf("Thread %d waited %f s in %ld waits for the steps of the frames (not counted as blocked)\n", t,
+				p->frame_waited, p->frame_waits);
+		}
+		waited += p->waited;
+		reads += p->reads;
+	}
+
+	if (reads > 0)
+	{
+		printf("Reads by staleness:");
+		for (k = 0; k <= opt_stale; k++)
+		{
+			long count = 0;
+
+			for (t = 0; t < team_size; t++)
+			{
+				count += part[t]->stale_count[k];
+			}
+			printf(" %d: %.1f%%", k, 100.0 * count / reads);
+		}
+		printf("\n");
+	}
+	printf("Barrier time of a synchronized run (estimated): %f s, blocked: %f s, saved: %f s (summed over the threads)\n",
+		barrier, waited, barrier - waited);
+	fflush(stdout);
+}
+
+void async_free()
+{
+	int t;
+
+	if (!async_steps)
+	{
+		return;
+	}
+
+	for (t = 0; t < ring_size; t++)
+	{
+		free(ring_x[t]);
+		free(ring_y[t]);
+	}
+	free(ring_x);
+	free(ring_y);
+	free(vel_x);
+	free(vel_y);
+	for (t = 0; t < team_size; t++)
+	{
+		free(part[t]->x);
+		free(part[t]->y);
+		free(part[t]->stale_count);
+		free(part[t]);
+	}
+	free(part);
+	free(work);
+}
@@ -0,0 +1,17 @@
+// nbody_async.h: Bounded staleness stepping of the v2 versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_ASYNC_H
+#define NBODY_ASYNC_H
+
+#include "nbody_accel.h"
+
+extern int async_steps;		/* 1 when the steps are run by async_run() (--stale) */
+
+void async_init(int num_threads);
+void async_run(Team *team, double *step_time);
+void async_report();
+void async_free();
+
+#endif
@@ -0,0 +1,310 @@
+// nbody_balance.c: Cost zone load balancing of the pthread versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The pthread versions give every thread an equal count of bodies to step.
+// That is an equal share of the work only when every body costs the same:
+// with the tree walks of bh and fmm, a body in a dense clump costs many times
+// one in the field, and the threads with the dear ones keep the rest waiting
+// at the barrier. With --balance=<threshold> the versions time
+// their body loops and move the block boundaries to where the work is even:
+//   - every thread reads its CPU clock every BALANCE_CHUNK bodies of its loop,
+//     and each body of a chunk is charged an equal part of its time. The cost
+//     of each body is kept for the next step. CPU time, not wall time, so a
+//     thread the OS paused for another process does not make its bodies look
+//     dear.
+//   - a sort (--sort) or a merge (--merge) at the start of a step renumbers
+//     the bodies: their costs move with them (balance_move()), and the blocks
+//     are split again on the moved costs before the loop, so a zone does not
+//     end up holding other bodies than the ones that were measured.
+//   - after the loops of a step, one thread finds the imbalance factor: the
+//     busiest thread's loop time over the mean. Above the threshold, the
+//     bodies are split again into contiguous zones of equal summed cost.
+// With --sort the zones are cost zones along the curve; every thread then
+// also gets a compact region of space. The new blocks are used from the next
+// step on. Which thread steps a body does not change its update, so the run
+// ends in the same state as with equal blocks.
+//
+// --balance-log=<file> writes the imbalance factor of every step to a CSV file,
+// with or without --balance; the mean and worst are printed with the step
+// timings at the end. The integrators and block timesteps split the bodies
+// themselves, so they cannot be balanced here. The tiled, symmetric, pm and
+// cell solvers work out every body in accel_prepare(), which splits its work
+// on its own, so their loops have little left to balance.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nbody_common.h"
+#include "nbody_block.h"
+#include "nbody_integrate.h"
+#include "nbody_balance.h"
+
+#define BALANCE_CHUNK 16	// Bodies per clock reading
+
+typedef struct
+{
+	int open;			/* first body of the chunk being timed */
+	double since;		/* when that chunk started */
+	double busy;		/* time in the body loop this step */
+} LoopTimer;
+
+int balancing;
+
+static int team_size;			/* number of threads balance_init() was set up for */
+static LoopTimer **timer;		/* per thread, each on its own cache line */
+static double *cost;			/* seconds each body took in its last step */
+static double *spare_cost;		/* costs being moved by a sort or a merge */
+static int *blocks;				/* start_idx_num_owned of the pthread version */
+static int zoned;				/* 1 once the blocks are cost zones, 0 while equal */
+static FILE *log_file;			/* CSV log, NULL when --balance-log is not given */
+
+static int steps_measured;
+static double imbalance_sum;	/* for the mean imbalance factor */
+static double imbalance_worst;
+static int repartitions;		/* times the blocks were moved */
+
+/* Set up the timers for a team of num_threads threads, which step the blocks
+ * of start_idx_num_owned: first body and count of each thread */
+void balance_init(int num_threads, int *start_idx_num_owned)
+{
+	int t;
+
+	balancing = opt_balance > 0 || opt_balance_log != NULL;
+	if (!balancing)
+	{
+		return;
+	}
+
+	if (block_steps || symplectic)
+	{
+		printf("--balance is not supported with --block-levels or --integrator\n");
+		exit(1);
+	}
+
+	team_size = num_threads;
+	blocks = start_idx_num_owned;
+	zoned = 0;
+	timer = (LoopTimer**)my_malloc(sizeof(LoopTimer*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		timer[t] = (LoopTimer*)my_aligned_malloc(SOA_ALIGN);
+	}
+	cost = (double*)my_malloc(sizeof(double) * numBodies);
+	spare_cost = (double*)my_malloc(sizeof(double) * numBodies);
+
+	log_file = NULL;
+	if (opt_balance_log != NULL)
+	{
+		log_file = fopen(opt_balance_log, "w");
+		assert(log_file);
+		fprintf(log_file, "step,imbalance,repartitioned\n");
+	}
+
+	steps_measured = 0;
+	imbalance_sum = 0;
+	imbalance_worst = 0;
+	repartitions = 0;
+
+	return;
+}
+
+/* CPU time of the calling thread */
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Charge the time since the open chunk started to its bodies, up to end */
+static void close_chunk(LoopTimer *lt, int end)
+{
+	double t = now();
+	double each = (t - lt->since) / (end - lt->open);
+	int i;
+
+	for (i = lt->open; i < end; i++)
+	{
+		cost[i] = each;
+	}
+	lt->busy += t - lt->since;
+	lt->open = end;
+	lt->since = t;
+}
+
+/* The thread starts its body loop at body first */
+void balance_start(int thread, int first)
+{
+	LoopTimer *lt = timer[thread];
+
+	lt->open = first;
+	lt->since = now();
+	lt->busy = 0;
+}
+
+/* The thread is about to step body i */
+void balance_body(int thread, int i)
+{
+	LoopTimer *lt = timer[thread];
+
+	if (i - lt->open == BALANCE_CHUNK)
+	{
+		close_chunk(lt, i);
+	}
+}
+
+/* The thread finished its body loop, which ended before body end */
+void balance_stop(int thread, int end)
+{
+	LoopTimer *lt = timer[thread];
+
+	if (end > lt->open)
+	{
+		close_chunk(lt, end);
+	}
+}
+
+/* Split the bodies into contiguous zones of equal summed cost. Returns 0 when
+ * nothing was measured. */
+static int cost_zones(int *start_idx_num_owned)
+{
+	double total = 0, sum = 0;
+	int i, t;
+
+	for (i = 0; i < numBodies; i++)
+	{
+		total += cost[i];
+	}
+	if (!(total > 0))
+	{
+		return 0;
+	}
+
+	start_idx_num_owned[0] = 0;
+	for (i = 0, t = 1; i < numBodies && t < team_size; i++)
+	{
+		// Thread t starts at the first body whose cost would fill zone t - 1
+		while (t < team_size && sum + 0.5 * cost[i] >= total * t / team_size)
+		{
+			start_idx_num_owned[t * 2] = i;
+			t++;
+		}
+		sum += cost[i];
+	}
+	for (; t < team_size; t++)
+	{
+		start_idx_num_owned[t * 2] = numBodies;
+	}
+	for (t = 0; t < team_size; t++)
+	{
+		int end = t < team_size - 1 ? start_idx_num_owned[(t + 1) * 2] : numBodies;
+
+		start_idx_num_owned[(t * 2) + 1] = end - start_idx_num_owned[t * 2];
+	}
+
+	return 1;
+}
+
+/* Body i of the old numbering is body k of the new one, in a sort or a merge:
+ * its cost moves along. Called by the thread that moves the body; the bodies
+ * a merge absorbs are not moved, and their cost is dropped. */
+void balance_move(int i, int k)
+{
+	spare_cost[k] = cost[i];
+}
+
+/* Called by one thread once every body of a sort or a merge is moved: the
+ * moved costs replace the old ones, and the blocks are split again for the
+ * new numbering, into cost zones if they were, else into equal blocks. The
+ * threads then read their blocks again. */
+void balance_renumbered()
+{
+	double *tmp = cost;
+	int t;
+
+	cost = spare_cost;
+	spare_cost = tmp;
+
+	if (zoned && cost_zones(blocks))
+	{
+		return;
+	}
+	for (t = 0; t < team_size; t++)
+	{
+		blocks[t * 2] = ((long)t * numBodies) / team_size;
+		blocks[(t * 2) + 1] = ((long)(t + 1) * numBodies) / team_size - blocks[t * 2];
+	}
+}
+
+/* Called by one thread after every thread's loop of the step is done: find
+ * the imbalance factor and rebalance the blocks if it is above --balance.
+ * Returns 1 if the blocks changed. */
+int balance_step(int step)
+{
+	double most = 0, mean = 0, imbalance;
+	int t, moved = 0;
+
+	for (t = 0; t < team_size; t++)
+	{
+		most = timer[t]->busy > most ? timer[t]->busy : most;
+		mean += timer[t]->busy / team_size;
+	}
+	imbalance = mean > 0 ? most / mean : 1;
+
+	if (opt_balance > 0 && imbalance > opt_balance)
+	{
+		moved = cost_zones(blocks);
+		repartitions += moved;
+		zoned |= moved;
+	}
+
+	steps_measured++;
+	imbalance_sum += imbalance;
+	imbalance_worst = imbalance > imbalance_worst ? imbalance : imbalance_worst;
+	if (log_file != NULL)
+	{
+		fprintf(log_file, "%d,%.4f,%d\n", step, imbalance, moved);
+	}
+
+	return moved;
+}
+
+/* Print the imbalance factors, with the step timings */
+void balance_report()
+{
+	if (!balancing || steps_measured == 0)
+	{
+		return;
+	}
+
+	printf("Load imbalance (busiest thread / mean): avg %f, worst %f, %d repartitions\n",
+		imbalance_sum / steps_measured, imbalance_worst, repartitions);
+	fflush(stdout);
+}
+
+void balance_free()
+{
+	int t;
+
+	if (!balancing)
+	{
+		return;
+	}
+
+	if (log_file != NULL)
+	{
+		fclose(log_file);
+	}
+	for (t = 0; t < team_size; t++)
+	{
+		free(timer[t]);
+	}
+	free(timer);
+	free(cost);
+	free(spare_cost);
+}
@@ -0,0 +1,20 @@
+// nbody_balance.h: Cost zone load balancing of the pthread versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_BALANCE_H
+#define NBODY_BALANCE_H
+
+extern int balancing;		/* 1 when the body loops are timed (--balance, --balance-log) */
+
+void balance_init(int num_threads, int *start_idx_num_owned);
+void balance_start(int thread, int first);
+void balance_body(int thread, int i);
+void balance_stop(int thread, int end);
+void balance_move(int i, int k);
+void balance_renumbered();
+int balance_step(int step);
+void balance_report();
+void balance_free();
+
+#endif
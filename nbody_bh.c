@@ -0,0 +1,461 @@
+// nbody_bh.c: Barnes-Hut quadtree over the universe
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The tree is rebuilt from the current bodies every step. It covers the square
+// around the whole universe (bodies are always wrapped back inside it), and
+// every node stores its mass, center of mass and quadrupole moment. A node that
+// is small enough compared to its distance (size / distance < theta) is used as
+// a single multipole instead of visiting its bodies. Leaves use the direct
+// kernel on their bodies, which are stored contiguously in tree order.
+//
+// The whole team builds the tree in bh_build(), so the build does not stay
+// serial while the walks are parallel:
+//   1. every thread computes the Morton key of its share of the bodies: the
+//      position in the root square quantized to 32 bits per axis, x bits on
+//      the even bits. The keys are sorted with the team's radix sort
+//      (nbody_radix.c), which puts the bodies of every node of every level
+//      next to each other, in tree order.
+//   2. the tree is made a level at a time. The nodes of a level with more than
+//      BH_LEAF_SIZE bodies are split evenly over the team; the bodies of a node
+//      are sorted by quadrant, so each child's bodies are found by a binary
+//      search on the key bits of the level. Every thread counts its children,
+//      the counts are scanned in thread order, and every thread writes its
+//      children to its own place in the next level.
+//   3. the moments are summed bottom-up, one level at a time from the deepest,
+//      the nodes of a level split evenly over the team
+// Sorted keys give a quadtree directly; a binary radix tree (Karras 2012) would
+// have to be collapsed into one to be walked by quadrant, and atomic insertion
+// would number the nodes in the order the threads got there. Here the tree
+// is the same for any team size, as --reproducible needs. The nodes stay valid
+// until the next build, level by level in bh_nodes, for any code that wants to
+// walk the tree.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_radix.h"
+#include "nbody_bh.h"
+
+BHNode *bh_nodes;
+int bh_num_nodes;
+int bh_num_levels;
+int bh_level_start[BH_MAX_DEPTH + 3];
+int *bh_index;
+double *bh_x, *bh_y, *bh_m;
+
+static int team_size;			/* number of threads bh_init() was set up for */
+static int max_nodes;			/* allocated size of bh_nodes */
+static uint64_t *keys[2];		/* Morton keys of the bodies, sorted and scratch */
+static int *order[2];			/* body of each key, sorted and scratch; bh_index is one of them */
+static int **digit_count;		/* per thread: counts of the radix sort */
+static int *children;			/* children each thread adds to the next level */
+static const uint64_t *sorted_keys;	/* key of the body at each tree position */
+
+void bh_init(int num_threads)
+{
+	int t;
+
+	team_size = num_threads;
+	max_nodes = 2 * numBodies / BH_LEAF_SIZE + 64;
+	bh_nodes = (BHNode*)my_malloc(sizeof(BHNode) * max_nodes);
+	bh_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	bh_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	bh_m = (double*)my_aligned_malloc(numPadded * sizeof(double));
+
+	for (t = 0; t < 2; t++)
+	{
+		keys[t] = (uint64_t*)my_malloc(sizeof(uint64_t) * numBodies);
+		order[t] = (int*)my_malloc(sizeof(int) * numBodies);
+	}
+	digit_count = (int**)my_malloc(sizeof(int*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		digit_count[t] = (int*)my_malloc(sizeof(int) * RADIX_SIZE);
+	}
+	children = (int*)my_malloc(sizeof(int) * num_threads);
+
+	return;
+}
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* The low 32 bits of v, spread to the even bits */
+static uint64_t spread_bits(uint64_t v)
+{
+	v = (v | (v << 16)) & 0x0000ffff0000ffffULL;
+	v = (v | (v << 8)) & 0x00ff00ff00ff00ffULL;
+	v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	v = (v | (v << 2)) & 0x3333333333333333ULL;
+	v = (v | (v << 1)) & 0x5555555555555555ULL;
+
+	return v;
+}
+
+/* A coordinate as a 32 bit integer over [low, low + size) */
+static uint64_t quantize(double x, double low, double size)
+{
+	double q = (x - low) / size * 4294967296.0;
+
+	// The wrap in update() can round a very fast body just outside the universe
+	return q < 0 ? 0 : (q < 4294967296.0 ? (uint64_t)q : 4294967295ULL);
+}
+
+/* Quadrant of the body at tree position k inside a node at the given depth */
+static int quadrant(int k, int depth)
+{
+	return (int)((sorted_keys[k] >> (2 * (BH_MAX_DEPTH - 1 - depth))) & 3);
+}
+
+/* First of the tree positions [lo, hi) of a node at the given depth whose
+ * quadrant is q or above; they are sorted by quadrant */
+static int quadrant_start(int lo, int hi, int depth, int q)
+{
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+
+		if (quadrant(mid, depth) < q)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static int is_split(BHNode *node, int depth)
+{
+	return node->count > BH_LEAF_SIZE && depth < BH_MAX_DEPTH;
+}
+
+static void init_node(BHNode *node, double bx, double by, double size, int first, int count)
+{
+	memset(node, 0, sizeof(BHNode));
+	node->bx = bx;
+	node->by = by;
+	node->size = size;
+	node->first = first;
+	node->count = count;
+	node->child[0] = node->child[1] = node->child[2] = node->child[3] = -1;
+}
+
+/* Mass, center of mass and quadrupole of a leaf straight from its bodies */
+static void leaf_moments(BHNode *node)
+{
+	double m = 0, mx = 0, my = 0;
+	int k;
+
+	for (k = node->first; k < node->first + node->count; k++)
+	{
+		m += bh_m[k];
+		mx += bh_m[k] * bh_x[k];
+		my += bh_m[k] * bh_y[k];
+	}
+
+	node->mass = m;
+	node->cx = m > 0 ? mx / m : node->bx + node->size / 2;
+	node->cy = m > 0 ? my / m : node->by + node->size / 2;
+
+	for (k = node->first; k < node->first + node->count; k++)
+	{
+		double dx = bh_x[k] - node->cx;
+		double dy = bh_y[k] - node->cy;
+		double d_squared = dx*dx + dy*dy;
+
+		node->qxx += bh_m[k] * (3*dx*dx - d_squared);
+		node->qxy += bh_m[k] * 3*dx*dy;
+		node->qyy += bh_m[k] * (3*dy*dy - d_squared);
+	}
+
+	return;
+}
+
+/* Combine the moments of the children into the parent (parallel axis theorem) */
+static void internal_moments(BHNode *node)
+{
+	double m = 0, mx = 0, my = 0;
+	int q;
+
+	for (q = 0; q < 4; q++)
+	{
+		if (node->child[q] >= 0)
+		{
+			BHNode *c = bh_nodes + node->child[q];
+			m += c->mass;
+			mx += c->mass * c->cx;
+			my += c->mass * c->cy;
+		}
+	}
+
+	node->mass = m;
+	node->cx = m > 0 ? mx / m : node->bx + node->size / 2;
+	node->cy = m > 0 ? my / m : node->by + node->size / 2;
+
+	for (q = 0; q < 4; q++)
+	{
+		if (node->child[q] >= 0)
+		{
+			BHNode *c = bh_nodes + node->child[q];
+			double sx = c->cx - node->cx;
+			double sy = c->cy - node->cy;
+			double s_squared = sx*sx + sy*sy;
+
+			node->qxx += c->qxx + c->mass * (3*sx*sx - s_squared);
+			node->qxy += c->qxy + c->mass * 3*sx*sy;
+			node->qyy += c->qyy + c->mass * (3*sy*sy - s_squared);
+		}
+	}
+
+	return;
+}
+
+/* Sort the bodies by key and make the root, see the top of the file */
+static void sort_bodies(Team *team)
+{
+	double size = univ_x > univ_y ? univ_x : univ_y;
+	int lo, hi, i, src;
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		keys[0][i] = spread_bits(quantize(bodies->x[i], x_min, size))
+				   | (spread_bits(quantize(bodies->y[i], y_min, size)) << 1);
+		order[0][i] = i;
+	}
+	team_barrier(team);
+
+	src = radix_sort(team, numBodies, 2 * BH_MAX_DEPTH, keys, order, digit_count);
+
+	if (team->id == 0)
+	{
+		bh_index = order[src];
+		sorted_keys = keys[src];
+		init_node(bh_nodes, x_min, y_min, size, 0, numBodies);
+		bh_num_nodes = 1;
+		bh_level_start[0] = 0;
+		bh_level_start[1] = 1;
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Split the nodes of one level into the next, see the top of the file */
+static void split_level(Team *team, int level)
+{
+	int start = bh_level_start[level];
+	int end = bh_level_start[level + 1];
+	int lo, hi, n, q, t;
+	int next = end;
+	int total = 0;
+
+	share(team, end - start, &lo, &hi);
+	children[team->id] = 0;
+	for (n = start + lo; n < start + hi; n++)
+	{
+		BHNode *node = bh_nodes + n;
+
+		if (is_split(node, level))
+		{
+			for (q = 0; q < 4; q++)
+			{
+				int first = quadrant_start(node->first, node->first + node->count, level, q);
+				int last = quadrant_start(first, node->first + node->count, level, q + 1);
+
+				children[team->id] += last > first;
+			}
+		}
+	}
+	team_barrier(team);
+
+	for (t = 0; t < team->size; t++)
+	{
+		next += t < team->id ? children[t] : 0;
+		total += children[t];
+	}
+	if (team->id == 0)
+	{
+		if (end + total > max_nodes)
+		{
+			while (end + total > max_nodes)
+			{
+				max_nodes *= 2;
+			}
+			bh_nodes = (BHNode*)realloc(bh_nodes, sizeof(BHNode) * max_nodes);
+			assert(bh_nodes);
+		}
+		bh_num_nodes = end + total;
+		bh_level_start[level + 2] = end + total;
+	}
+	team_barrier(team);
+
+	for (n = start + lo; n < start + hi; n++)
+	{
+		BHNode *node = bh_nodes + n;
+		double half = node->size / 2;
+
+		if (!is_split(node, level))
+		{
+			continue;
+		}
+		for (q = 0; q < 4; q++)
+		{
+			int first = quadrant_start(node->first, node->first + node->count, level, q);
+			int last = quadrant_start(first, node->first + node->count, level, q + 1);
+
+			if (last > first)
+			{
+				init_node(bh_nodes + next, node->bx + half * (q & 1), node->by + half * (q >> 1), half, first, last - first);
+				node->child[q] = next++;
+			}
+		}
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Build the tree from the current bodies. Every thread of the team must call
+ * it; the tree is complete when it returns. */
+void bh_build(Team *team)
+{
+	int lo, hi, k, n, level;
+
+	assert(team->size == team_size);
+	sort_bodies(team);
+
+	for (level = 0; bh_level_start[level + 1] > bh_level_start[level]; level++)
+	{
+		split_level(team, level);
+	}
+	if (team->id == 0)
+	{
+		bh_num_levels = level;
+	}
+
+	share(team, numBodies, &lo, &hi);
+	for (k = lo; k < hi; k++)
+	{
+		bh_x[k] = bodies->x[bh_index[k]];
+		bh_y[k] = bodies->y[bh_index[k]];
+		bh_m[k] = body_info.mass[bh_index[k]];
+	}
+	team_barrier(team);
+
+	// Moments bottom-up: the children of a level are all on the next one
+	for (level--; level >= 0; level--)
+	{
+		int start = bh_level_start[level];
+
+		share(team, bh_level_start[level + 1] - start, &lo, &hi);
+		for (n = start + lo; n < start + hi; n++)
+		{
+			BHNode *node = bh_nodes + n;
+
+			if (is_split(node, level))
+			{
+				internal_moments(node);
+			}
+			else
+			{
+				leaf_moments(node);
+			}
+		}
+		team_barrier(team);
+	}
+
+	return;
+}
+
+/* Add the acceleration at (x, y) due to all bodies in the tree to *ax, *ay */
+void bh_accel(double x, double y, double theta, double *ax, double *ay)
+{
+	int stack[4 * BH_MAX_DEPTH + 4];
+	int top = 0;
+	double k = K;
+	double theta_squared = theta * theta;
+	double sum_x = 0;
+	double sum_y = 0;
+
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		BHNode *node = bh_nodes + stack[--top];
+		double dx = node->cx - x;
+		double dy = node->cy - y;
+		double r_squared = dx*dx + dy*dy;
+		int inside = x >= node->bx && x < node->bx + node->size &&
+					 y >= node->by && y < node->by + node->size;
+
+		if (node->child[0] < 0 && node->child[1] < 0 && node->child[2] < 0 && node->child[3] < 0)
+		{
+			accel_kernel(x, y, bh_x + node->first, bh_y + node->first, bh_m + node->first,
+						 node->count, &sum_x, &sum_y);
+		}
+		else if (!inside && node->size * node->size < theta_squared * r_squared)
+		{
+			// Far enough away: monopole plus quadrupole of the whole node
+			double r = sqrt(r_squared);
+			double r3_inv = 1.0 / (r_squared * r);
+			double r5_inv = r3_inv / r_squared;
+			double qd_x = node->qxx * dx + node->qxy * dy;
+			double qd_y = node->qxy * dx + node->qyy * dy;
+			double dqd = dx * qd_x + dy * qd_y;
+
+			sum_x += k * (node->mass * dx * r3_inv - qd_x * r5_inv + 2.5 * dqd * dx * r5_inv / r_squared);
+			sum_y += k * (node->mass * dy * r3_inv - qd_y * r5_inv + 2.5 * dqd * dy * r5_inv / r_squared);
+		}
+		else
+		{
+			int q;
+			for (q = 0; q < 4; q++)
+			{
+				if (node->child[q] >= 0)
+				{
+					stack[top++] = node->child[q];
+				}
+			}
+		}
+	}
+
+	*ax += sum_x;
+	*ay += sum_y;
+
+	return;
+}
+
+void bh_free()
+{
+	int t;
+
+	free(bh_nodes);
+	free(bh_x);
+	free(bh_y);
+	free(bh_m);
+	for (t = 0; t < 2; t++)
+	{
+		free(keys[t]);
+		free(order[t]);
+	}
+	for (t = 0; t < team_size; t++)
+	{
+		free(digit_count[t]);
+	}
+	free(digit_count);
+	free(children);
+}
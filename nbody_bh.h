@@ -0,0 +1,38 @@
+// nbody_bh.h: Barnes-Hut quadtree over the universe
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_BH_H
+#define NBODY_BH_H
+
+#include "nbody_accel.h"
+
+#define BH_LEAF_SIZE 8		// Most bodies kept in a leaf before it is split
+#define BH_MAX_DEPTH 32		// Leaves at this depth are never split (the keys have 32 bits per axis)
+
+/* One square of the quadtree. The bodies in a node are entries
+ * [first, first + count) of the tree ordered arrays bh_x, bh_y, bh_m. */
+typedef struct BHNodeStruct {
+	double mass;			/* total mass in the node */
+	double cx, cy;			/* center of mass */
+	double qxx, qxy, qyy;	/* quadrupole moment about the center of mass */
+	double bx, by;			/* lower left corner of the square */
+	double size;			/* width of the square */
+	int child[4];			/* children (-1 if empty), quadrant = (x >= mid) + 2*(y >= mid) */
+	int first;				/* first body of the node in tree order */
+	int count;				/* number of bodies in the node */
+} BHNode;
+
+extern BHNode *bh_nodes;	/* all nodes, level by level; the root is bh_nodes[0] */
+extern int bh_num_nodes;	/* number of nodes in use */
+extern int bh_num_levels;	/* levels of the tree, the root is level 0 */
+extern int bh_level_start[BH_MAX_DEPTH + 3];	/* nodes of level l are [bh_level_start[l], bh_level_start[l + 1]), up to an empty level */
+extern int *bh_index;		/* bh_index[k] is the body at tree position k */
+extern double *bh_x, *bh_y, *bh_m;	/* body positions and masses in tree order */
+
+void bh_init(int num_threads);
+void bh_build(Team *team);
+void bh_accel(double x, double y, double theta, double *ax, double *ay);
+void bh_free();
+
+#endif
@@ -0,0 +1,403 @@
+// nbody_block.c: Hierarchical block timesteps
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// With --block-levels=L every body moves with its own step of 2^-l base steps,
+// 0 <= l <= L, so one tight pair no longer forces small steps on everybody.
+// Time is counted in ticks of 2^-L base steps. A body's step is picked after
+// each of its force evaluations from the acceleration and the jerk, estimated
+// from the change of the acceleration over the step it just finished:
+//   dt = eta |a| / |da/dt|        (eta is --block-eta)
+// rounded down to a power of 2. A step may only start on a tick that is a
+// multiple of its own length, and at most doubles from one step to the next,
+// so the steps stay nested and every body lands on each base step boundary.
+// Bodies start on the finest level and coarsen from there.
+//
+// Each body is advanced by velocity Verlet over its own step dt:
+//   x(t + dt) = x + v dt + a dt^2 / 2
+//   v(t + dt) = v + (a + a(t + dt)) dt / 2
+// At every tick where some body's step ends (the active bodies), the team
+//   1. predicts the positions of all bodies to that tick with the formula
+//      above (the active ones land on their new positions), and collects the
+//      active bodies of its share in per thread lists
+//   2. runs accel_prepare() on the predicted positions
+//   3. splits the concatenated active lists evenly over the threads, which
+//      evaluate the forces of only those bodies, finish their velocities and
+//      pick their next step
+// Ticks with no active body are skipped. The work of a base step is then the
+// force evaluations of the active bodies, instead of all N at the finest
+// step; the summary printed at the end gives the ratio. The solvers that work
+// out every body in accel_prepare() (tiled, symmetric, pm, cell) still do all
+// bodies at every tick.
+//
+// All bodies are active on every base step boundary, so the frames every
+// period base steps, the --diag rows and the final state are those of a
+// synchronized system. A --diag row is summed by the evaluation at its time,
+// the end of the base step before the one that reports it. Each body's updates
+// depend on nothing but the predicted positions, so the run is the same for
+// any team size.
+//
+// The base step is --dt long. With --block-levels=0 this is plain velocity
+// Verlet with that step, the same as --integrator=kdk (nbody_integrate.c).
+
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_compact.h"
+#include "nbody_block.h"
+
+int block_steps;
+
+static int team_size;			/* number of threads block_init() was set up for */
+static int max_level;			/* --block-levels */
+static long long base_ticks;	/* ticks per base step */
+static double tick_length;		/* length of one tick */
+
+static double *start_x, *start_y;	/* positions at the start of each body's step */
+static double *start_ax, *start_ay;	/* accelerations there */
+static long long *t_start;		/* tick each body's step started */
+static long long *t_end;		/* tick each body's step ends */
+static unsigned char *level;	/* each body's step is 2^-level base steps */
+
+static int **active;			/* per thread: the active bodies of its share */
+static int *num_active;			/* length of each thread's list */
+static long long *next_part;	/* earliest step end seen by each thread */
+static long long *next_event;	/* each thread's copy of the tick of the next step end */
+static DiagSums *pending;		/* per thread diagnostics row waiting for its step */
+
+static long long evaluations;	/* force evaluations of bodies */
+
+void block_init(int num_threads)
+{
+	int t, i;
+
+	block_steps = opt_block_levels >= 0;
+	if (!block_steps)
+	{
+		return;
+	}
+
+	if (opt_block_levels > BLOCK_MAX_LEVELS)
+	{
+		printf("--block-levels must be at most %d\n", BLOCK_MAX_LEVELS);
+		exit(1);
+	}
+	if (compact_storage || opt_merge)
+	{
+		printf("Block timesteps are not supported with --storage=compact or --merge\n");
+		exit(1);
+	}
+
+	team_size = num_threads;
+	max_level = opt_block_levels;
+	base_ticks = 1LL << max_level;
+	tick_length = opt_dt / base_ticks;
+
+	start_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	start_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	start_ax = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	start_ay = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	t_start = (long long*)my_malloc(sizeof(long long) * numBodies);
+	t_end = (long long*)my_malloc(sizeof(long long) * numBodies);
+	level = (unsigned char*)my_malloc(numBodies);
+	for (i = 0; i < numBodies; i++)
+	{
+		// Every body is evaluated at tick 0, with a step of 0
+		start_x[i] = bodies->x[i];
+		start_y[i] = bodies->y[i];
+		t_start[i] = 0;
+		t_end[i] = 0;
+		level[i] = max_level;
+	}
+
+	active = (int**)my_malloc(sizeof(int*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		active[t] = (int*)my_malloc(sizeof(int) * numBodies);
+	}
+	num_active = (int*)my_malloc(sizeof(int) * num_threads);
+	next_part = (long long*)my_malloc(sizeof(long long) * num_threads);
+	next_event = (long long*)my_malloc(sizeof(long long) * num_threads);
+	pending = (DiagSums*)my_malloc(sizeof(DiagSums) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		diag_clear(pending + t);
+	}
+	evaluations = 0;
+
+	#ifndef NO_OUT
+	printf("Block timesteps: %d levels, eta %f\n", max_level, opt_block_eta);
+	#endif
+
+	return;
+}
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* Wrap a coordinate back into [low, low + size) as update() does */
+static double wrap(double x, double low, double size)
+{
+	if (x >= low + size || x < low)
+	{
+		x = x + (ceil((low + size - x) / size) - 1) * size;
+	}
+
+	return x;
+}
+
+/* Ticks in a step of the given level */
+static long long level_ticks(int l)
+{
+	return 1LL << (max_level - l);
+}
+
+/* Level of the next step of a body that is at tick, was on level l, and
+ * wants steps of at most dt */
+static int next_level(long long tick, int l, double dt)
+{
+	int want = 0;
+
+	while (want < max_level && ldexp(opt_dt, -want) > dt)
+	{
+		want++;
+	}
+
+	// At most double, and only onto a step that starts on this tick
+	if (want < l - 1)
+	{
+		want = l - 1;
+	}
+	while (want < l && tick % level_ticks(want) != 0)
+	{
+		want++;
+	}
+
+	return want;
+}
+
+/* Finish the step of active body i at tick: new velocity from its new
+ * acceleration, and its next step */
+static void finish_body(int i, long long tick, DiagSums *sums)
+{
+	double dt = (tick - t_start[i]) * tick_length;
+	double ax = 0, ay = 0, pot = 0;
+	double vx, vy, jx, jy, a2, j2, want;
+
+	if (sums != NULL)
+	{
+		accel_body_pot(i, &ax, &ay, &pot);
+	}
+	else
+	{
+		accel_body(i, &ax, &ay);
+	}
+
+	vx = bodies->vx[i] + 0.5 * (start_ax[i] + ax) * dt;
+	vy = bodies->vy[i] + 0.5 * (start_ay[i] + ay) * dt;
+	assert(!(isnan(vx) || isnan(vy)));
+	bodies->vx[i] = vx;
+	bodies->vy[i] = vy;
+	if (sums != NULL)
+	{
+		diag_add_body(i, vx, vy, pot, sums);
+	}
+
+	// No jerk is known after the first evaluation; the body stays on the finest level
+	jx = dt > 0 ? (ax - start_ax[i]) / dt : 0;
+	jy = dt > 0 ? (ay - start_ay[i]) / dt : 0;
+	a2 = ax*ax + ay*ay;
+	j2 = jx*jx + jy*jy;
+	want = dt > 0 && j2 > 0 ? opt_block_eta * sqrt(a2 / j2) : (dt > 0 ? opt_dt : 0.0);
+
+	start_x[i] = bodies->x[i];
+	start_y[i] = bodies->y[i];
+	start_ax[i] = ax;
+	start_ay[i] = ay;
+	level[i] = next_level(tick, level[i], want);
+	t_start[i] = tick;
+	t_end[i] = tick + level_ticks(level[i]);
+
+	return;
+}
+
+/* Advance the bodies whose steps end at tick, see the top of the file.
+ * Returns the tick of the next step end. */
+static long long do_tick(Team *team, long long tick)
+{
+	int *mine = active[team->id];
+	long long soonest = LLONG_MAX;
+	int lo, hi, i, t, k, total, first, skip;
+	DiagSums *sums = NULL;
+
+	// 1. Predict every body to tick and collect the active ones
+	share(team, numBodies, &lo, &hi);
+	num_active[team->id] = 0;
+	for (i = lo; i < hi; i++)
+	{
+		double tau = (tick - t_start[i]) * tick_length;
+
+		bodies->x[i] = wrap(start_x[i] + bodies->vx[i] * tau + 0.5 * start_ax[i] * tau * tau, x_min, univ_x);
+		bodies->y[i] = wrap(start_y[i] + bodies->vy[i] * tau + 0.5 * start_ay[i] * tau * tau, y_min, univ_y);
+		if (t_end[i] == tick)
+		{
+			mine[num_active[team->id]++] = i;
+		}
+		else
+		{
+			soonest = t_end[i] < soonest ? t_end[i] : soonest;
+		}
+	}
+	team_barrier(team);
+
+	// 2. Team part of the forces on the predicted positions
+	accel_prepare(team);
+
+	// 3. An even share of all the active bodies, in thread order
+	total = 0;
+	for (t = 0; t < team->size; t++)
+	{
+		total += num_active[t];
+	}
+	share(team, total, &lo, &hi);
+
+	// Rows are summed on the base step boundary they are for
+	if (tick % base_ticks == 0 && diag_due((int)(tick / base_ticks) + 1))
+	{
+		sums = pending + team->id;
+	}
+
+	first = 0;
+	for (t = 0; t < team->size && first < hi; t++)
+	{
+		skip = lo > first ? lo - first : 0;
+		for (k = skip; k < num_active[t] && first + k < hi; k++)
+		{
+			i = active[t][k];
+			finish_body(i, tick, sums);
+			soonest = t_end[i] < soonest ? t_end[i] : soonest;
+		}
+		first += num_active[t];
+	}
+	next_part[team->id] = soonest;
+
+	if (team->id == 0)
+	{
+		evaluations += total;
+	}
+	team_barrier(team);
+
+	soonest = LLONG_MAX;
+	for (t = 0; t < team->size; t++)
+	{
+		soonest = next_part[t] < soonest ? next_part[t] : soonest;
+	}
+
+	return soonest;
+}
+
+/* Move the bodies one base step, from bodies into bodies_new. Called by every
+ * thread of the team in place of the force and update loop of a step. On a
+ * diagnostics step thread 0 adds the row for step - 1 to sums. */
+void block_step(Team *team, int step, DiagSums *sums)
+{
+	long long end = step * base_ticks;
+	long long *next = next_event + team->id;
+	int lo, hi, i, t;
+
+	assert(team->size == team_size);
+
+	// The bodies are moved in place; a frame may still be drawn from them (v2 versions)
+	team_barrier(team);
+
+	if (step == 1)
+	{
+		*next = do_tick(team, 0);
+	}
+
+	if (diag_due(step))
+	{
+		if (team->id == 0)
+		{
+			for (t = 0; t < team->size; t++)
+			{
+				diag_merge(sums, pending + t);
+				diag_clear(pending + t);
+			}
+		}
+		team_barrier(team);
+	}
+
+	while (*next <= end)
+	{
+		*next = do_tick(team, *next);
+	}
+
+	// Every body is synchronized at the end of a base step
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		bodies_new->x[i] = bodies->x[i];
+		bodies_new->y[i] = bodies->y[i];
+		bodies_new->vx[i] = bodies->vx[i];
+		bodies_new->vy[i] = bodies->vy[i];
+	}
+	team_barrier(team);
+
+	return;
+}
+
+void block_free()
+{
+	#ifndef NO_OUT
+	int levels_used[BLOCK_MAX_LEVELS + 1];	/* bodies per level at the end */
+	#endif
+	int i;
+
+	if (!block_steps)
+	{
+		return;
+	}
+
+	#ifndef NO_OUT
+	memset(levels_used, 0, sizeof(levels_used));
+	for (i = 0; i < numBodies; i++)
+	{
+		levels_used[level[i]]++;
+	}
+	printf("Block timesteps: %.1f force evaluations per base step (%.1f%% of N per finest step)\n",
+		   (double)evaluations / nsteps, 100.0 * evaluations / ((double)nsteps * base_ticks * numBodies));
+	printf("Bodies per level at the end:");
+	for (i = 0; i <= max_level; i++)
+	{
+		printf(" %d", levels_used[i]);
+	}
+	printf("\n");
+	#endif
+
+	for (i = 0; i < team_size; i++)
+	{
+		free(active[i]);
+	}
+	free(active);
+	free(num_active);
+	free(next_part);
+	free(next_event);
+	free(pending);
+	free(start_x);
+	free(start_y);
+	free(start_ax);
+	free(start_ay);
+	free(t_start);
+	free(t_end);
+	free(level);
+}
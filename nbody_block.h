@@ -0,0 +1,19 @@
+// nbody_block.h: Hierarchical block timesteps
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_BLOCK_H
+#define NBODY_BLOCK_H
+
+#include "nbody_accel.h"
+#include "nbody_diag.h"
+
+#define BLOCK_MAX_LEVELS 20	// Finest step is 2^-20 of a base step
+
+extern int block_steps;		/* 1 when the bodies are moved by block_step() (--block-levels) */
+
+void block_init(int num_threads);
+void block_step(Team *team, int step, DiagSums *sums);
+void block_free();
+
+#endif
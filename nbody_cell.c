@@ -0,0 +1,415 @@
+// nbody_cell.c: Cell lists and Verlet neighbor lists for a cutoff radius
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// --solver=cell only counts the pairs closer than --cutoff, for short range
+// laws (lj, yukawa) or dense runs where far bodies can be ignored. Like the
+// particle-mesh solver it treats the universe as the torus update() wraps
+// bodies around: a pair is taken at its nearest periodic image.
+//
+// Every body keeps a Verlet list of the bodies within cutoff + skin of it.
+// A list stays valid as long as no body has moved more than skin / 2 since it
+// was built, as two bodies then cannot have closed in by more than the skin,
+// so the lists are only rebuilt when the largest move passes that. A rebuild:
+//   1. bins the bodies into square-ish cells at least cutoff + skin wide, by a
+//      counting sort: every thread counts its share of the bodies per cell,
+//      the counts are scanned over a range of cells per thread, and every
+//      thread scatters its bodies to its own offsets in each cell
+//   2. builds the list of each body from the 3 x 3 cells around its own, each
+//      thread for its share of the bodies, into its own buffer
+// A step then has every thread gather, for its share of the bodies, the
+// neighbors inside the cutoff and run the force kernel on them, so the law,
+// softening and instruction set are the ones of the direct solver. The work
+// per step is linear in the number of bodies at a fixed density.
+//
+// The bodies are binned in the order of their index whatever the team size,
+// so the lists, and the sums over them, are the same for any thread count.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_cell.h"
+
+static double cut2;				/* cutoff squared */
+static double reach;			/* cutoff + skin, the radius of the lists */
+static double half_skin;		/* largest move before the lists are rebuilt */
+static int team_size;			/* number of threads cell_init() was set up for */
+static int ncx, ncy;			/* cells in x and y */
+static double cell_wx, cell_wy;	/* cell size */
+
+static int **cell_offset;		/* per thread: its bodies in each cell, then where they go */
+static int *cell_start;			/* bodies of cell c are cell_bodies[cell_start[c] .. cell_start[c + 1]) */
+static int *cell_bodies;		/* body indices ordered by cell */
+static int *range_total;		/* bodies in the range of cells of each thread */
+static double *moved;			/* largest move squared in the share of each thread */
+static int built;				/* 0 until the first lists are built */
+
+static double *ref_x, *ref_y;	/* positions when the lists were built */
+static int *nbr_first;			/* Verlet list of body i starts at list_buf[thread][nbr_first[i]] */
+static int *nbr_count;			/* length of the list of each body */
+static int **list_buf;			/* per thread storage of its bodies' lists */
+static int *list_size;			/* allocated length of list_buf */
+static int *list_used;			/* used length of list_buf */
+static double **gather_x, **gather_y, **gather_m;	/* per thread neighbors inside the cutoff */
+static int *gather_size;		/* allocated length of the gather buffers */
+static double *accel_x, *accel_y;	/* accelerations found by cell_prepare() */
+
+static int rebuilds, steps;		/* for the summary printed by cell_free() */
+static long list_entries;		/* list lengths summed over all rebuilds */
+
+void cell_init(double cutoff, double skin, int num_threads)
+{
+	int t;
+
+	reach = cutoff + skin;
+	if (cutoff <= 0 || skin < 0 || 3 * reach > univ_x || 3 * reach > univ_y)
+	{
+		printf("Cutoff + skin must be positive and at most a third of the universe\n");
+		exit(1);
+	}
+	cut2 = cutoff * cutoff;
+	half_skin = skin / 2;
+	team_size = num_threads;
+
+	ncx = (int)(univ_x / reach);
+	ncy = (int)(univ_y / reach);
+	cell_wx = univ_x / ncx;
+	cell_wy = univ_y / ncy;
+
+	cell_offset = (int**)my_malloc(sizeof(int*) * num_threads);
+	list_buf = (int**)my_malloc(sizeof(int*) * num_threads);
+	gather_x = (double**)my_malloc(sizeof(double*) * num_threads);
+	gather_y = (double**)my_malloc(sizeof(double*) * num_threads);
+	gather_m = (double**)my_malloc(sizeof(double*) * num_threads);
+	list_size = (int*)my_malloc(sizeof(int) * num_threads);
+	gather_size = (int*)my_malloc(sizeof(int) * num_threads);
+	list_used = (int*)my_malloc(sizeof(int) * num_threads);
+	range_total = (int*)my_malloc(sizeof(int) * num_threads);
+	moved = (double*)my_malloc(sizeof(double) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		cell_offset[t] = (int*)my_malloc(sizeof(int) * ncx * ncy);
+		list_size[t] = 0;
+		list_buf[t] = NULL;
+		gather_size[t] = 0;
+		gather_x[t] = gather_y[t] = gather_m[t] = NULL;
+	}
+	cell_start = (int*)my_malloc(sizeof(int) * (ncx * ncy + 1));
+	cell_bodies = (int*)my_malloc(sizeof(int) * numBodies);
+	nbr_first = (int*)my_malloc(sizeof(int) * numBodies);
+	nbr_count = (int*)my_malloc(sizeof(int) * numBodies);
+	ref_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	ref_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	accel_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	accel_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	built = 0;
+	rebuilds = 0;
+	steps = 0;
+	list_entries = 0;
+
+	#ifndef NO_OUT
+	printf("Cells: %d x %d, lists out to %f\n", ncx, ncy, reach);
+	#endif
+
+	return;
+}
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* Shortest periodic image of a difference along an axis of length size */
+static double nearest(double d, double size)
+{
+	return d - size * nearbyint(d / size);
+}
+
+/* Cell holding body i */
+static int cell_of(int i)
+{
+	double fx = floor((bodies->x[i] - x_min) / cell_wx);
+	double fy = floor((bodies->y[i] - y_min) / cell_wy);
+
+	// The wrap in update() can round a very fast body just outside the universe
+	int cx = fx < 0 ? 0 : (fx < ncx ? (int)fx : ncx - 1);
+	int cy = fy < 0 ? 0 : (fy < ncy ? (int)fy : ncy - 1);
+
+	return cy * ncx + cx;
+}
+
+/* Counting sort of the bodies by cell, see the top of the file */
+static void bin_bodies(Team *team)
+{
+	int *offset = cell_offset[team->id];
+	int ncells = ncx * ncy;
+	int lo, hi, i, c, t, base;
+
+	memset(offset, 0, sizeof(int) * ncells);
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		offset[cell_of(i)]++;
+	}
+	team_barrier(team);
+
+	share(team, ncells, &lo, &hi);
+	base = 0;
+	for (c = lo; c < hi; c++)
+	{
+		for (t = 0; t < team->size; t++)
+		{
+			base += cell_offset[t][c];
+		}
+	}
+	range_total[team->id] = base;
+	team_barrier(team);
+
+	// Cells in thread order, and in each cell the threads' bodies in thread order
+	base = 0;
+	for (t = 0; t < team->id; t++)
+	{
+		base += range_total[t];
+	}
+	for (c = lo; c < hi; c++)
+	{
+		cell_start[c] = base;
+		for (t = 0; t < team->size; t++)
+		{
+			int count = cell_offset[t][c];
+
+			cell_offset[t][c] = base;
+			base += count;
+		}
+	}
+	if (team->id == team->size - 1)
+	{
+		cell_start[ncells] = numBodies;
+	}
+	team_barrier(team);
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		cell_bodies[offset[cell_of(i)]++] = i;
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Verlet lists of this thread's share of the bodies */
+static void build_lists(Team *team)
+{
+	const double *x = bodies->x;
+	const double *y = bodies->y;
+	double reach2 = reach * reach;
+	int used = 0;
+	int longest = 0;
+	int lo, hi, i;
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		int c = cell_of(i);
+		int cx = c % ncx;
+		int cy = c / ncx;
+		int ox, oy, k;
+
+		nbr_count[i] = 0;
+		for (oy = -1; oy <= 1; oy++)
+		{
+			for (ox = -1; ox <= 1; ox++)
+			{
+				int n = ((cy + oy + ncy) % ncy) * ncx + (cx + ox + ncx) % ncx;
+
+				for (k = cell_start[n]; k < cell_start[n + 1]; k++)
+				{
+					int j = cell_bodies[k];
+					double dx = nearest(x[j] - x[i], univ_x);
+					double dy = nearest(y[j] - y[i], univ_y);
+
+					if (j == i || dx*dx + dy*dy >= reach2)
+					{
+						continue;
+					}
+					if (used == list_size[team->id])
+					{
+						list_size[team->id] = used < 1024 ? 1024 : 2 * used;
+						list_buf[team->id] = (int*)realloc(list_buf[team->id], sizeof(int) * list_size[team->id]);
+						assert(list_buf[team->id]);
+					}
+					list_buf[team->id][used++] = j;
+					nbr_count[i]++;
+				}
+			}
+		}
+		nbr_first[i] = used - nbr_count[i];
+		longest = nbr_count[i] > longest ? nbr_count[i] : longest;
+		ref_x[i] = x[i];
+		ref_y[i] = y[i];
+	}
+
+	if (longest > gather_size[team->id])
+	{
+		int t = team->id;
+
+		free(gather_x[t]);
+		free(gather_y[t]);
+		free(gather_m[t]);
+		gather_size[t] = longest;
+		gather_x[t] = (double*)my_aligned_malloc(longest * sizeof(double));
+		gather_y[t] = (double*)my_aligned_malloc(longest * sizeof(double));
+		gather_m[t] = (double*)my_aligned_malloc(longest * sizeof(double));
+	}
+
+	list_used[team->id] = used;
+	team_barrier(team);
+	if (team->id == 0)
+	{
+		int t;
+
+		rebuilds++;
+		for (t = 0; t < team->size; t++)
+		{
+			list_entries += list_used[t];
+		}
+	}
+
+	return;
+}
+
+/* Team part of a step: rebuild the lists if needed, then the accelerations
+ * of every thread's share of the bodies from its neighbors inside the cutoff */
+void cell_prepare(Team *team)
+{
+	const double *x = bodies->x;
+	const double *y = bodies->y;
+	double *gx = NULL, *gy = NULL, *gm = NULL;
+	double largest = 0;
+	int lo, hi, i, t, rebuild;
+
+	assert(team->size == team_size);
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; built && i < hi; i++)
+	{
+		double dx = nearest(x[i] - ref_x[i], univ_x);
+		double dy = nearest(y[i] - ref_y[i], univ_y);
+		double d2 = dx*dx + dy*dy;
+
+		largest = d2 > largest ? d2 : largest;
+	}
+	moved[team->id] = largest;
+	team_barrier(team);
+
+	rebuild = !built;
+	for (t = 0; t < team->size; t++)
+	{
+		rebuild |= moved[t] > half_skin * half_skin;
+	}
+
+	if (rebuild)
+	{
+		bin_bodies(team);
+		build_lists(team);
+		built = 1;
+	}
+
+	if (gather_size[team->id] > 0)
+	{
+		gx = gather_x[team->id];
+		gy = gather_y[team->id];
+		gm = gather_m[team->id];
+	}
+	for (i = lo; i < hi; i++)
+	{
+		const int *list = list_buf[team->id] + nbr_first[i];
+		int n = 0;
+		int k;
+
+		for (k = 0; k < nbr_count[i]; k++)
+		{
+			int j = list[k];
+			double dx = nearest(x[j] - x[i], univ_x);
+			double dy = nearest(y[j] - y[i], univ_y);
+
+			if (dx*dx + dy*dy < cut2)
+			{
+				gx[n] = x[i] + dx;
+				gy[n] = y[i] + dy;
+				gm[n] = body_info.mass[j];
+				n++;
+			}
+		}
+
+		accel_x[i] = 0;
+		accel_y[i] = 0;
+		accel_kernel(x[i], y[i], gx, gy, gm, n, accel_x + i, accel_y + i);
+	}
+
+	if (team->id == 0)
+	{
+		steps++;
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Add the acceleration of body i found by cell_prepare() to *ax, *ay */
+void cell_accel(int i, double *ax, double *ay)
+{
+	*ax += accel_x[i];
+	*ay += accel_y[i];
+}
+
+/* Rebuild the lists on the next step, as the bodies were renumbered */
+void cell_invalidate()
+{
+	built = 0;
+}
+
+void cell_free()
+{
+	int t;
+
+	#ifndef NO_OUT
+	printf("Cell lists: %d rebuilds in %d steps, %.1f neighbors per body\n",
+		   rebuilds, steps, rebuilds > 0 ? (double)list_entries / rebuilds / numBodies : 0.0);
+	#endif
+
+	for (t = 0; t < team_size; t++)
+	{
+		free(cell_offset[t]);
+		free(list_buf[t]);
+		free(gather_x[t]);
+		free(gather_y[t]);
+		free(gather_m[t]);
+	}
+	free(cell_offset);
+	free(list_buf);
+	free(gather_x);
+	free(gather_y);
+	free(gather_m);
+	free(list_size);
+	free(list_used);
+	free(gather_size);
+	free(range_total);
+	free(moved);
+	free(cell_start);
+	free(cell_bodies);
+	free(nbr_first);
+	free(nbr_count);
+	free(ref_x);
+	free(ref_y);
+	free(accel_x);
+	free(accel_y);
+}
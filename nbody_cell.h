@@ -0,0 +1,16 @@
+// nbody_cell.h: Cell lists and Verlet neighbor lists for a cutoff radius
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_CELL_H
+#define NBODY_CELL_H
+
+#include "nbody_accel.h"
+
+void cell_init(double cutoff, double skin, int num_threads);
+void cell_prepare(Team *team);
+void cell_accel(int i, double *ax, double *ay);
+void cell_invalidate();
+void cell_free();
+
+#endif
@@ -0,0 +1,625 @@
+/* FEVS: A Functional Equivalence Verification Suite for High-Performance
+ * Scientific Computing
+ *
+ * Copyright (C) 2009-2010, Stephen F. Siegel, Timothy K. Zirkel,
+ * University of Delaware
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+
+// nbody_common.c: Setup, GIF output and clean up shared by all n-body versions
+// Original program by authors listed above
+// Changes and additions done by: Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#include <assert.h>
+#include <ctype.h>
+#include <gd.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_small.h"
+#include "nbody_compact.h"
+#include "nbody_diag.h"
+#include "nbody_reorder.h"
+
+/* Global variables */
+double x_min;				/* coord of left edge of universe */
+double x_max;				/* coord of right edge of universe */
+double y_min;				/* coord of bottom edge of universe */
+double y_max;				/* coord of top edge of universe */
+double univ_x;				/* x_max-x_min */
+double univ_y;				/* y_max-y_min */
+int nx;						/* width of movie window (pixels) */
+int ny;						/* height of movie window (pixels) */
+int numBodies;				/* number of bodies */
+int numPadded;				/* numBodies rounded up to a multiple of SOA_PAD */
+double K;					/* single constant encoding G, grid spacing, etc. */
+double softening = 0;		/* Plummer softening length, 0 = none */
+char force_law[16] = "gravity";	/* gravity, coulomb, lj or yukawa */
+double law_length = 0;		/* length scale of the lj (sigma) and yukawa (range) laws */
+int nsteps;					/* number of time steps */
+int period;			 		/* number of times steps beween movie frames */
+FILE *gif;			 		/* file containing animated GIF */
+gdImagePtr im,  previm;		/* pointers to consecutive GIF images */
+int *colors;		 		/* colors we will use */
+BodyInfo body_info;			/* attributes of the bodies that never change */
+BodyState *bodies, *bodies_new;	/* two copies of the body state: current and next step */
+
+/* Optional command line settings */
+char *opt_isa = NULL;		/* --isa: force kernel instruction set (NULL = best available) */
+char *opt_solver = "direct";	/* --solver: how accelerations are computed */
+double opt_theta = 0.5;		/* --theta: Barnes-Hut opening angle */
+int opt_order = 6;			/* --order: fast multipole expansion order */
+int opt_grid = 256;			/* --grid: particle-mesh grid points per side */
+char *opt_assign = "cic";	/* --assign: particle-mesh mass assignment, cic or tsc */
+double opt_cutoff = 0;		/* --cutoff: interaction radius of the cell solver */
+double opt_skin = -1;		/* --skin: Verlet list margin of the cell solver (-1 = cutoff / 5) */
+int opt_tile_i = 0;			/* --tile-i: bodies per target tile of the tiled solver (0 = fit L2) */
+int opt_tile_j = 0;			/* --tile-j: bodies per source tile of the tiled solver (0 = fit L1) */
+char *opt_precision = "double";	/* --precision: direct solver arithmetic, double, single or mixed */
+double opt_soft = -1;			/* --soft: softening length, overrides the config file (-1 = use the file) */
+int opt_rsqrt = -1;			/* --rsqrt: Newton steps after a 1/sqrt estimate (-1 = exact sqrt and divide) */
+int opt_small_n = SMALL_N_DEFAULT;	/* --small-n: systems up to this many bodies run on one thread */
+double opt_tracer_mass = 0;		/* --tracer-mass: bodies this light or lighter are tracers, never sources */
+char *opt_storage = "double";	/* --storage: body state as double, or compact fixed point */
+int opt_reproducible = 0;		/* --reproducible: same bits for any thread count and version */
+char *opt_diag = NULL;			/* --diag: CSV log of energy, momentum and centroid (NULL = none) */
+int opt_merge = 0;				/* --merge: overlapping bodies merge into one */
+int opt_block_levels = -1;		/* --block-levels: finest block timestep is 2^-levels (-1 = one global step) */
+double opt_block_eta = 0.1;		/* --block-eta: accuracy of the block timestep criterion */
+char *opt_integrator = "euler";	/* --integrator: euler, kdk or yoshida4 */
+double opt_dt = 1;				/* --dt: length of a step */
+char *opt_sort = "none";		/* --sort: reorder the bodies along a none, morton or hilbert curve */
+int opt_sort_every = 10;		/* --sort-every: steps between two sorts */
+double opt_balance = 0;			/* --balance: imbalance factor that moves the pthread blocks (0 = equal blocks) */
+char *opt_balance_log = NULL;	/* --balance-log: CSV log of the imbalance factor of every step (NULL = none) */
+char *opt_fof = NULL;			/* --fof: CSV log of the friends-of-friends groups (NULL = none) */
+double opt_fof_link = 0;		/* --fof-link: linking length of the groups (0 = 0.2 of the mean spacing) */
+int opt_fof_min = 4;			/* --fof-min: fewest bodies of a logged group */
+int opt_stale = -1;				/* --stale: steps the v2 versions may read old positions from (-1 = barriers) */
+
+static BodyState state_a, state_b;	/* storage behind bodies and bodies_new */
+
+void* my_malloc(int numBytes)
+{
+  void *result = malloc(numBytes);
+  assert(result);
+
+  return result;
+}
+
+/* Allocate zeroed memory starting on a cache line boundary */
+void* my_aligned_malloc(size_t numBytes)
+{
+	void *result = NULL;
+	int err = posix_memalign(&result, SOA_ALIGN, numBytes);
+	assert(err == 0 && result);
+	memset(result, 0, numBytes);
+
+	return result;
+}
+
+/* Allocate the arrays of one copy of the body state */
+static void alloc_state(BodyState *state)
+{
+	if (compact_storage)
+	{
+		state->fx = (int32_t*)my_aligned_malloc(numPadded * sizeof(int32_t));
+		state->fy = (int32_t*)my_aligned_malloc(numPadded * sizeof(int32_t));
+		state->fvx = (float*)my_aligned_malloc(numPadded * sizeof(float));
+		state->fvy = (float*)my_aligned_malloc(numPadded * sizeof(float));
+		return;
+	}
+
+	state->x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	state->y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	state->vx = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	state->vy = (double*)my_aligned_malloc(numPadded * sizeof(double));
+
+	return;
+}
+
+static void free_state(BodyState *state)
+{
+	free(state->x);
+	free(state->y);
+	free(state->vx);
+	free(state->vy);
+	free(state->fx);
+	free(state->fy);
+	free(state->fvx);
+	free(state->fvy);
+}
+
+/* Read the optional --name=value settings (and --name flags) in argv[first] to argv[argc - 1] */
+void parse_options(int argc, char *argv[], int first)
+{
+	int i;
+
+	for (i = first; i < argc; i++)
+	{
+		char *arg = argv[i];
+
+		if (strncmp(arg, "--isa=", 6) == 0)
+		{
+			opt_isa = arg + 6;
+		}
+		else if (strncmp(arg, "--solver=", 9) == 0)
+		{
+			opt_solver = arg + 9;
+		}
+		else if (strncmp(arg, "--theta=", 8) == 0)
+		{
+			opt_theta = atof(arg + 8);
+			assert(opt_theta >= 0);
+		}
+		else if (strncmp(arg, "--order=", 8) == 0)
+		{
+			opt_order = atoi(arg + 8);
+		}
+		else if (strncmp(arg, "--grid=", 7) == 0)
+		{
+			opt_grid = atoi(arg + 7);
+		}
+		else if (strncmp(arg, "--assign=", 9) == 0)
+		{
+			opt_assign = arg + 9;
+		}
+		else if (strncmp(arg, "--cutoff=", 9) == 0)
+		{
+			opt_cutoff = atof(arg + 9);
+			assert(opt_cutoff > 0);
+		}
+		else if (strncmp(arg, "--skin=", 7) == 0)
+		{
+			opt_skin = atof(arg + 7);
+			assert(opt_skin >= 0);
+		}
+		else if (strncmp(arg, "--tile-i=", 9) == 0)
+		{
+			opt_tile_i = atoi(arg + 9);
+			assert(opt_tile_i >= 0);
+		}
+		else if (strncmp(arg, "--tile-j=", 9) == 0)
+		{
+			opt_tile_j = atoi(arg + 9);
+			assert(opt_tile_j >= 0);
+		}
+		else if (strncmp(arg, "--precision=", 12) == 0)
+		{
+			opt_precision = arg + 12;
+		}
+		else if (strncmp(arg, "--soft=", 7) == 0)
+		{
+			opt_soft = atof(arg + 7);
+			assert(opt_soft >= 0);
+		}
+		else if (strncmp(arg, "--small-n=", 10) == 0)
+		{
+			opt_small_n = atoi(arg + 10);
+		}
+		else if (strncmp(arg, "--rsqrt=", 8) == 0)
+		{
+			opt_rsqrt = atoi(arg + 8);
+			assert(opt_rsqrt >= 0 && opt_rsqrt <= 4);
+		}
+		else if (strncmp(arg, "--storage=", 10) == 0)
+		{
+			opt_storage = arg + 10;
+		}
+		else if (strncmp(arg, "--diag=", 7) == 0)
+		{
+			opt_diag = arg + 7;
+		}
+		else if (strcmp(arg, "--reproducible") == 0)
+		{
+			opt_reproducible = 1;
+		}
+		else if (strcmp(arg, "--merge") == 0)
+		{
+			opt_merge = 1;
+		}
+		else if (strncmp(arg, "--block-levels=", 15) == 0)
+		{
+			opt_block_levels = atoi(arg + 15);
+			assert(opt_block_levels >= 0);
+		}
+		else if (strncmp(arg, "--block-eta=", 12) == 0)
+		{
+			opt_block_eta = atof(arg + 12);
+			assert(opt_block_eta > 0);
+		}
+		else if (strncmp(arg, "--integrator=", 13) == 0)
+		{
+			opt_integrator = arg + 13;
+		}
+		else if (strncmp(arg, "--dt=", 5) == 0)
+		{
+			opt_dt = atof(arg + 5);
+			assert(opt_dt > 0);
+		}
+		else if (strncmp(arg, "--sort=", 7) == 0)
+		{
+			opt_sort = arg + 7;
+		}
+		else if (strncmp(arg, "--sort-every=", 13) == 0)
+		{
+			opt_sort_every = atoi(arg + 13);
+			assert(opt_sort_every > 0);
+		}
+		else if (strncmp(arg, "--balance=", 10) == 0)
+		{
+			opt_balance = atof(arg + 10);
+			assert(opt_balance >= 1);
+		}
+		else if (strncmp(arg, "--balance-log=", 14) == 0)
+		{
+			opt_balance_log = arg + 14;
+		}
+		else if (strncmp(arg, "--fof=", 6) == 0)
+		{
+			opt_fof = arg + 6;
+		}
+		else if (strncmp(arg, "--fof-link=", 11) == 0)
+		{
+			opt_fof_link = atof(arg + 11);
+			assert(opt_fof_link > 0);
+		}
+		else if (strncmp(arg, "--fof-min=", 10) == 0)
+		{
+			opt_fof_min = atoi(arg + 10);
+			assert(opt_fof_min >= 1);
+		}
+		else if (strncmp(arg, "--stale=", 8) == 0)
+		{
+			opt_stale = atoi(arg + 8);
+			assert(opt_stale >= 0);
+		}
+		else if (strncmp(arg, "--tracer-mass=", 14) == 0)
+		{
+			opt_tracer_mass = atof(arg + 14);
+			assert(opt_tracer_mass >= 0);
+		}
+		else
+		{
+			printf("Unknown option: %s\n", arg);
+			printf("Options: --isa=scalar|sse2|avx2|avx512 --solver=direct|tiled|symmetric|bh|fmm|pm|cell\n");
+			printf("         --tile-i=<bodies> --tile-j=<bodies> --precision=double|single|mixed\n");
+			printf("         --soft=<softening length> --rsqrt=<newton steps> --small-n=<bodies>\n");
+			printf("         --tracer-mass=<mass> --storage=double|compact --reproducible\n");
+			printf("         --diag=<log file> --cutoff=<radius> --skin=<distance> --merge\n");
+			printf("         --block-levels=<levels> --block-eta=<accuracy>\n");
+			printf("         --integrator=euler|kdk|yoshida4 --dt=<step>\n");
+			printf("         --sort=none|morton|hilbert --sort-every=<steps>\n");
+			printf("         --balance=<imbalance factor> --balance-log=<log file> (pthread versions)\n");
+			printf("         --fof=<log file> --fof-link=<linking length> --fof-min=<members>\n");
+			printf("         --stale=<steps> (v2 versions)\n");
+			printf("         --theta=<opening angle> --order=<expansion order> --grid=<points> --assign=cic|tsc\n");
+			fflush(stdout);
+			exit(1);
+		}
+	}
+
+	return;
+}
+
+/* Prepare for GIF creation: open file, allocate color array */
+void prepgif(char *outfilename)
+{
+	gif = fopen(outfilename, "wb");
+	assert(gif);
+	colors = (int*)my_malloc(sizeof(int) * MAXCOLORS);
+
+	return;
+}
+
+/* Optional settings after K, as keyword and values, in any order:
+ *   eps <length>           Plummer softening length
+ *   law <name> [<length>]  force law; lj takes sigma, yukawa its range */
+static void read_settings(FILE *infile)
+{
+	char word[16];
+	int c;
+
+	for (;;)
+	{
+		// The settings are the only words; nsteps follows as a number
+		fscanf(infile, " ");
+		c = fgetc(infile);
+		ungetc(c, infile);
+		if (c == EOF || !isalpha(c))
+		{
+			break;
+		}
+
+		fscanf(infile, "%15s", word);
+		if (strcmp(word, "eps") == 0)
+		{
+			fscanf(infile, "%lf", &softening);
+			assert(softening >= 0);
+		}
+		else if (strcmp(word, "law") == 0)
+		{
+			fscanf(infile, "%15s", force_law);
+			if (strcmp(force_law, "lj") == 0 || strcmp(force_law, "yukawa") == 0)
+			{
+				fscanf(infile, "%lf", &law_length);
+				assert(law_length > 0);
+			}
+		}
+		else
+		{
+			printf("Unknown setting in config file: %s\n", word);
+			exit(1);
+		}
+	}
+
+	return;
+}
+
+/* init: reads init file and initializes variables */
+void init(char *infilename, char *outfilename)
+{
+	FILE *infile = fopen(infilename, "r");
+	int i;
+
+	assert(infile);
+	fscanf(infile, "%lf", &x_min);
+	fscanf(infile, "%lf", &x_max);
+	assert(x_max > x_min);
+	univ_x = x_max-x_min;
+	fscanf(infile, "%lf", &y_min);
+	fscanf(infile, "%lf", &y_max);
+	assert(y_max > y_min);
+	univ_y = y_max-y_min;
+	fscanf(infile, "%d", &nx);
+	assert(nx>=10);
+	fscanf(infile, "%d", &ny);
+	assert(ny>=10);
+	fscanf(infile, "%lf", &K);
+	assert(K>0);
+	read_settings(infile);
+	if (opt_soft >= 0)
+	{
+		softening = opt_soft;
+	}
+	fscanf(infile, "%d", &nsteps);
+	assert(nsteps>=1);
+	fscanf(infile, "%d", &period);
+	assert(period>0);
+	fscanf(infile, "%d", &numBodies);
+	assert(numBodies>0);
+
+	#ifndef NO_OUT
+	printf("x_min = %lf\n", x_min);
+	printf("x_max = %lf\n", x_max);
+	printf("y_min = %lf\n", y_min);
+	printf("y_max = %lf\n", y_max);
+	printf("nx = %d\n", nx);
+	printf("ny = %d\n", ny);
+	printf("K = %f\n", K);
+	if (softening > 0)
+	{
+		printf("eps = %f\n", softening);
+	}
+	if (strcmp(force_law, "gravity") != 0)
+	{
+		printf("law = %s %f\n", force_law, law_length);
+	}
+	printf("nsteps = %d\n", nsteps);
+	printf("period = %d\n", period);
+	printf("numBodies = %d\n", numBodies);
+	fflush(stdout);
+	#endif
+
+	// Padding entries stay zeroed: a zero mass body never contributes any force
+	numPadded = (numBodies + SOA_PAD - 1) / SOA_PAD * SOA_PAD;
+	body_info.mass = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	body_info.color = (int*)my_aligned_malloc(numPadded * sizeof(int));
+	body_info.size = (int*)my_aligned_malloc(numPadded * sizeof(int));
+	compact_init();
+	alloc_state(&state_a);
+	alloc_state(&state_b);
+	bodies = &state_a;
+	bodies_new = &state_b;
+
+	for (i=0; i<numBodies; i++)
+	{
+		double x, y, vx, vy;
+
+		fscanf(infile, "%lf", &body_info.mass[i]);
+		assert(body_info.mass[i] >= 0);	// massless bodies are tracers
+		fscanf(infile, "%d", &body_info.color[i]);
+		assert(body_info.color[i] >=0 && body_info.color[i]<MAXCOLORS);
+		fscanf(infile, "%d", &body_info.size[i]);
+		assert(body_info.size[i] > 0);
+		fscanf(infile, "%lf", &x);
+		assert(x >=x_min && x < x_max);
+		fscanf(infile, "%lf", &y);
+		assert(y >=y_min && y < y_max);
+		fscanf(infile, "%lf", &vx);
+		fscanf(infile, "%lf", &vy);
+
+		if (compact_storage)
+		{
+			compact_store(bodies, i, x, y, vx, vy);
+		}
+		else
+		{
+			bodies->x[i] = x;
+			bodies->y[i] = y;
+			bodies->vx[i] = vx;
+			bodies->vy[i] = vy;
+		}
+	}
+
+	fclose(infile);
+	diag_init();
+
+	#ifndef NO_OUT
+	prepgif(outfilename);
+	#endif
+
+	return;
+}
+
+/* Write one frame of the GIF for given time */
+// Note for parallel versions: gd states only one thread per image, so the write
+// frame has be to sequential
+void write_frame(int time)
+{
+	int i, k;
+
+	im = gdImageCreate(nx,ny);
+	if (time == 0)
+	{
+		gdImageColorAllocate(im, 0, 0, 0);	/* black background */
+		for (i=0; i<MAXCOLORS; i++)
+		{
+			colors[i] = gdImageColorAllocate (im, i, 0, MAXCOLORS-i-1);		/* (im, i,i,i); gives gray-scale image */
+		}
+		gdImageGifAnimBegin(im, gif, 1, -1);
+	}
+	else
+	{
+		gdImagePaletteCopy(im, previm);
+	}
+
+	// In config file order, so bodies overlap the same way with --sort
+	for (k=0; k<numBodies; k++)
+	{
+		int i = body_slot != NULL ? body_slot[k] : k;
+		double x = compact_storage ? compact_x(bodies->fx[i]) : bodies->x[i];
+
+		if (x>=0 && x<nx)
+		{
+			double y = compact_storage ? compact_y(bodies->fy[i]) : bodies->y[i];
+			if (y>=0 && y<ny)
+			{
+				int size = body_info.size[i];
+				int color = body_info.color[i];
+
+				gdImageFilledEllipse(im, (int)x, ny-(int)y, size, size, colors[color]);
+			 }
+		}
+	}
+
+	if (time == 0)
+	{
+		gdImageGifAnimAdd(im, gif, 0, 0, 0, 0, gdDisposalNone, NULL);
+	}
+	else
+	{
+		gdImageGifAnimAdd(im, gif, 0, 0, 0, 5, gdDisposalNone, /* previm */ NULL);
+		gdImageDestroy(previm);
+	}
+
+	previm=im;
+	im=NULL;
+
+	return;
+}
+
+/* Add the bytes of an array to the FNV-1a hash h */
+static unsigned long long hash_bytes(unsigned long long h, const void *data, size_t size)
+{
+	const unsigned char *byte = (const unsigned char*)data;
+	size_t b;
+
+	for (b = 0; b < size; b++)
+	{
+		h = (h ^ byte[b]) * 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* Add the bytes of the doubles of an array to the FNV-1a hash h, in config
+ * file order (--sort) */
+static unsigned long long hash_in_file_order(unsigned long long h, const double *data)
+{
+	int k;
+
+	for (k = 0; k < numBodies; k++)
+	{
+		h = hash_bytes(h, data + body_slot[k], sizeof(double));
+	}
+
+	return h;
+}
+
+/* Hash of the exact bits of the current body state, for checking that two
+ * runs ended in the same state */
+unsigned long long state_checksum()
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	if (body_slot != NULL)
+	{
+		h = hash_in_file_order(h, bodies->x);
+		h = hash_in_file_order(h, bodies->y);
+		h = hash_in_file_order(h, bodies->vx);
+		h = hash_in_file_order(h, bodies->vy);
+	}
+	else if (bodies->x != NULL)
+	{
+		h = hash_bytes(h, bodies->x, numBodies * sizeof(double));
+		h = hash_bytes(h, bodies->y, numBodies * sizeof(double));
+		h = hash_bytes(h, bodies->vx, numBodies * sizeof(double));
+		h = hash_bytes(h, bodies->vy, numBodies * sizeof(double));
+	}
+	else
+	{
+		h = hash_bytes(h, bodies->fx, numBodies * sizeof(int32_t));
+		h = hash_bytes(h, bodies->fy, numBodies * sizeof(int32_t));
+		h = hash_bytes(h, bodies->fvx, numBodies * sizeof(float));
+		h = hash_bytes(h, bodies->fvy, numBodies * sizeof(float));
+	}
+
+	return h;
+}
+
+/* Close GIF file, free all allocated data structures */
+void wrapup()
+{
+	#ifndef NO_OUT
+	if (previm)
+	{
+		gdImageDestroy(previm);
+	}
+
+	gdImageGifAnimEnd(gif);
+	fclose(gif);
+	#endif
+
+	if (opt_reproducible)
+	{
+		printf("State checksum: %016llx\n", state_checksum());
+		fflush(stdout);
+	}
+
+	diag_free();
+	free(colors);
+	free(body_info.mass);
+	free(body_info.color);
+	free(body_info.size);
+	free_state(&state_a);
+	free_state(&state_b);
+}
@@ -0,0 +1,109 @@
+// nbody_common.h: Declarations shared by all 2D n-body simulation versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_COMMON_H
+#define NBODY_COMMON_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <gd.h>
+
+#define MAXCOLORS 254
+#define PWIDTH 1
+#define SOA_ALIGN 64		// Byte alignment of every body array (one cache line)
+#define SOA_PAD 8			// Body arrays are padded to a multiple of this many elements
+
+/* The bodies are stored as a structure of arrays instead of an array of
+ * structures. The force loop only reads x, y and mass of the other bodies,
+ * so keeping each field in its own contiguous array means every cache line
+ * pulled in by that loop is fully used.
+ *
+ * Attributes that never change during the simulation are stored once
+ * (only --merge rewrites them, see nbody_merge.c). */
+typedef struct BodyInfoStruct {
+	double *mass;			/* mass of each body */
+	int *color;				/* color used to draw each body */
+	int *size;				/* diameter of each body in pixels */
+} BodyInfo;
+
+/* Dynamic state of the bodies; this is the part that is double buffered.
+ * With --storage=compact only the packed arrays are allocated, see
+ * nbody_compact.c, otherwise only the double ones. */
+typedef struct BodyStateStruct {
+	double *x;		/* x positions */
+	double *y;		/* y positions */
+	double *vx;		/* velocities, x-direction */
+	double *vy;		/* velocities, y-direction */
+	int32_t *fx;	/* packed: fixed point x positions */
+	int32_t *fy;	/* packed: fixed point y positions */
+	float *fvx;		/* packed: velocities, x-direction */
+	float *fvy;		/* packed: velocities, y-direction */
+} BodyState;
+
+/* Global variables */
+extern double x_min;			/* coord of left edge of universe */
+extern double x_max;			/* coord of right edge of universe */
+extern double y_min;			/* coord of bottom edge of universe */
+extern double y_max;			/* coord of top edge of universe */
+extern double univ_x;			/* x_max-x_min */
+extern double univ_y;			/* y_max-y_min */
+extern int nx;					/* width of movie window (pixels) */
+extern int ny;					/* height of movie window (pixels) */
+extern int numBodies;			/* number of bodies */
+extern int numPadded;			/* numBodies rounded up to a multiple of SOA_PAD */
+extern double K;				/* single constant encoding G, grid spacing, etc. */
+extern double softening;		/* Plummer softening length, 0 = none */
+extern char force_law[16];		/* gravity, coulomb, lj or yukawa */
+extern double law_length;		/* length scale of the lj (sigma) and yukawa (range) laws */
+extern int nsteps;				/* number of time steps */
+extern int period;				/* number of times steps beween movie frames */
+extern FILE *gif;				/* file containing animated GIF */
+extern gdImagePtr im, previm;	/* pointers to consecutive GIF images */
+extern int *colors;				/* colors we will use */
+extern BodyInfo body_info;		/* attributes of the bodies that never change */
+extern BodyState *bodies, *bodies_new;	/* two copies of the body state: current and next step */
+
+/* Optional command line settings, given as --name=value after the required arguments */
+extern char *opt_isa;			/* --isa: force kernel instruction set (NULL = best available) */
+extern char *opt_solver;		/* --solver: how accelerations are computed */
+extern double opt_theta;		/* --theta: Barnes-Hut opening angle */
+extern int opt_order;			/* --order: fast multipole expansion order */
+extern int opt_grid;			/* --grid: particle-mesh grid points per side */
+extern char *opt_assign;		/* --assign: particle-mesh mass assignment, cic or tsc */
+extern double opt_cutoff;		/* --cutoff: interaction radius of the cell solver */
+extern double opt_skin;			/* --skin: Verlet list margin of the cell solver (-1 = cutoff / 5) */
+extern int opt_tile_i;			/* --tile-i: bodies per target tile of the tiled solver (0 = fit L2) */
+extern int opt_tile_j;			/* --tile-j: bodies per source tile of the tiled solver (0 = fit L1) */
+extern char *opt_precision;		/* --precision: direct solver arithmetic, double, single or mixed */
+extern double opt_soft;			/* --soft: softening length, overrides the config file (-1 = use the file) */
+extern int opt_rsqrt;			/* --rsqrt: Newton steps after a 1/sqrt estimate (-1 = exact sqrt and divide) */
+extern int opt_small_n;			/* --small-n: systems up to this many bodies run on one thread */
+extern double opt_tracer_mass;	/* --tracer-mass: bodies this light or lighter are tracers, never sources */
+extern char *opt_storage;		/* --storage: body state as double, or compact fixed point */
+extern int opt_reproducible;		/* --reproducible: same bits for any thread count and version */
+extern char *opt_diag;			/* --diag: CSV log of energy, momentum and centroid (NULL = none) */
+extern int opt_merge;			/* --merge: overlapping bodies merge into one */
+extern int opt_block_levels;	/* --block-levels: finest block timestep is 2^-levels (-1 = one global step) */
+extern double opt_block_eta;	/* --block-eta: accuracy of the block timestep criterion */
+extern char *opt_integrator;	/* --integrator: euler, kdk or yoshida4 */
+extern double opt_dt;			/* --dt: length of a step */
+extern char *opt_sort;			/* --sort: reorder the bodies along a none, morton or hilbert curve */
+extern int opt_sort_every;		/* --sort-every: steps between two sorts */
+extern double opt_balance;		/* --balance: imbalance factor that moves the pthread blocks (0 = equal blocks) */
+extern char *opt_balance_log;	/* --balance-log: CSV log of the imbalance factor of every step (NULL = none) */
+extern char *opt_fof;			/* --fof: CSV log of the friends-of-friends groups (NULL = none) */
+extern double opt_fof_link;		/* --fof-link: linking length of the groups (0 = 0.2 of the mean spacing) */
+extern int opt_fof_min;			/* --fof-min: fewest bodies of a logged group */
+extern int opt_stale;			/* --stale: steps the v2 versions may read old positions from (-1 = barriers) */
+
+void* my_malloc(int numBytes);
+void* my_aligned_malloc(size_t numBytes);
+void parse_options(int argc, char *argv[], int first);
+void prepgif(char *outfilename);
+void init(char *infilename, char *outfilename);
+void write_frame(int time);
+unsigned long long state_checksum();
+void wrapup();
+
+#endif
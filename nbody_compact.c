@@ -0,0 +1,136 @@
+// nbody_compact.c: Compact fixed point storage of the body state
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// With --storage=compact the double buffered state takes 16 bytes per body
+// instead of 32: positions are 32 bit fixed point offsets across the universe
+// and velocities are floats. With the mass (8 bytes) and the color and size
+// (4 bytes each) a body needs 48 bytes instead of 80, so runs of tens of
+// millions of bodies fit in 60% of the memory and the force loop streams 16
+// bytes per source instead of 24.
+//
+// A position is stored as the signed offset X in [-2^31, 2^31) of the fixed
+// point cell it falls in, x = x_min + (X + 2^31 + 1/2) * univ_x / 2^32, so it
+// is off by at most 2^-33 (1.2e-10) of the universe size. A step adds the
+// velocity rounded to whole cells, which adds at most that much again per
+// step. The 32 bit offsets wrap around by themselves, and that is exactly the
+// wrap of update() back into the universe. Velocities keep 24 bits (6e-8
+// relative); an acceleration below that fraction of the velocity is lost.
+//
+// The kernel (accel_kernel_compact) takes the offsets as they are: the
+// difference of two offsets is exact in double, so only the scaling to a
+// distance rounds. Only the direct solver in double precision with gravity
+// works on this storage, and the versions call compact_body() in place of
+// their own update of a body.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_compact.h"
+
+#define FIXED_CELLS 4294967296.0	// 2^32 fixed point cells across the universe
+#define FIXED_HALF 2147483648.0		// 2^31, offset of the first cell
+
+int compact_storage = 0;
+double fixed_hx, fixed_hy;
+
+/* Set up the fixed point scale for --storage=compact. Called by init() before
+ * the state is allocated. */
+void compact_init()
+{
+	if (strcmp(opt_storage, "double") == 0)
+	{
+		compact_storage = 0;
+		return;
+	}
+	else if (strcmp(opt_storage, "compact") != 0)
+	{
+		printf("Unknown storage: %s\n", opt_storage);
+		exit(1);
+	}
+
+	compact_storage = 1;
+	fixed_hx = univ_x / FIXED_CELLS;
+	fixed_hy = univ_y / FIXED_CELLS;
+
+	#ifndef NO_OUT
+	printf("Compact storage: %d bytes per body, positions to %g of the universe\n",
+		   (int)(2 * (2 * sizeof(int32_t) + 2 * sizeof(float)) + sizeof(double) + 2), 0.5 / FIXED_CELLS);
+	#endif
+
+	return;
+}
+
+/* Fixed point offset of the cell holding u, a fraction of the universe in [0, 1) */
+static int32_t encode(double u)
+{
+	double cell = floor(u * FIXED_CELLS);
+
+	if (cell > FIXED_CELLS - 1)
+	{
+		cell = FIXED_CELLS - 1;		// u just below 1 can round up to 2^32
+	}
+
+	return (int32_t)(cell - FIXED_HALF);
+}
+
+/* Offset fx moved by the distance d along an axis with cells of length h and
+ * universe length size, wrapping around the universe */
+static int32_t advance(int32_t fx, double d, double h, double size)
+{
+	double cells = nearbyint(fmod(d, size) / h);	// less than 2^32 cells either way
+
+	return (int32_t)((uint32_t)fx + (uint32_t)(int64_t)cells);
+}
+
+/* Store body i of state, packed. x and y must be inside the universe. */
+void compact_store(BodyState *state, int i, double x, double y, double vx, double vy)
+{
+	state->fx[i] = encode((x - x_min) / univ_x);
+	state->fy[i] = encode((y - y_min) / univ_y);
+	state->fvx[i] = vx;
+	state->fvy[i] = vy;
+
+	return;
+}
+
+/* Position stored as the fixed point offset fx (or fy) */
+double compact_x(int32_t fx)
+{
+	return x_min + (fx + FIXED_HALF + 0.5) * fixed_hx;
+}
+
+double compact_y(int32_t fy)
+{
+	return y_min + (fy + FIXED_HALF + 0.5) * fixed_hy;
+}
+
+/* Move body i one step, from bodies to bodies_new, like the update loops of
+ * the versions do for the double storage */
+void compact_body(int i)
+{
+	int32_t fx = bodies->fx[i];
+	int32_t fy = bodies->fy[i];
+	double vx = bodies->fvx[i];
+	double vy = bodies->fvy[i];
+	double ax = 0;
+	double ay = 0;
+
+	accel_kernel_compact(fx, fy, bodies->fx, bodies->fy, body_info.mass, numBodies, &ax, &ay);
+
+	bodies_new->fx[i] = advance(fx, vx * opt_dt, fixed_hx, univ_x);
+	bodies_new->fy[i] = advance(fy, vy * opt_dt, fixed_hy, univ_y);
+
+	vx += ax * opt_dt;
+	vy += ay * opt_dt;
+	assert(!(isnan(vx) || isnan(vy)));
+	bodies_new->fvx[i] = vx;
+	bodies_new->fvy[i] = vy;
+
+	return;
+}
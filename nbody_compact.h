@@ -0,0 +1,19 @@
+// nbody_compact.h: Compact fixed point storage of the body state
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_COMPACT_H
+#define NBODY_COMPACT_H
+
+#include <stdint.h>
+
+extern int compact_storage;		/* 1 when the state is kept packed (--storage=compact) */
+extern double fixed_hx, fixed_hy;	/* length of one fixed point step in x and y */
+
+void compact_init();
+void compact_store(BodyState *state, int i, double x, double y, double vx, double vy);
+double compact_x(int32_t fx);
+double compact_y(int32_t fy);
+void compact_body(int i);
+
+#endif
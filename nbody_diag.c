@@ -0,0 +1,135 @@
+// nbody_diag.c: Energy, momentum and centroid diagnostics
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// --diag=<file> logs the kinetic, potential and total energy, the linear
+// momentum and the center of mass to a CSV file every period steps, starting
+// with the initial state. A row for time t is summed during the force pass of
+// step t + 1: on those steps the versions call diag_accel_body() instead of
+// accel_body(), which gets the potential of the body from the twin of the
+// force kernel in use (accel_body_pot()) and adds the body's terms to the sums
+// of its thread. The twin's forces are bit for bit those of the kernel, so
+// logging does not change the run. The partial sums are combined with
+// diag_merge(), by an OpenMP reduction or by thread 0 of the pthread versions,
+// and thread 0 writes the row. For gravity the potential is summed in the same
+// loop over the sources as the acceleration; the other laws add a second loop
+// on the logged steps only.
+//
+// The potential is only known to the direct solver in double precision, so
+// --diag is rejected with the other solvers and precisions. Tracers heavier
+// than zero are counted in the kinetic energy and momentum, but their
+// potential is only counted from their own end. The update is first order
+// unless --integrator or --block-levels pick another scheme, so the total
+// energy is not conserved exactly; the log shows how fast it drifts.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_accel.h"
+#include "nbody_compact.h"
+#include "nbody_diag.h"
+
+static FILE *diag_file;		/* CSV log, NULL when --diag is not given */
+
+/* Open the log of --diag. Called by init() once the bodies are read. */
+void diag_init()
+{
+	diag_file = NULL;
+	if (opt_diag == NULL)
+	{
+		return;
+	}
+
+	if (compact_storage)
+	{
+		printf("--diag is not supported with --storage=compact\n");
+		exit(1);
+	}
+
+	// Only the direct solver in double precision sums the potential, see accel_body_pot()
+	if (strcmp(opt_solver, "direct") != 0 || strcmp(opt_precision, "double") != 0)
+	{
+		printf("--diag is only supported by --solver=direct with --precision=double\n");
+		exit(1);
+	}
+
+	diag_file = fopen(opt_diag, "w");
+	assert(diag_file);
+	fprintf(diag_file, "time,kinetic,potential,energy,px,py,cx,cy\n");
+
+	return;
+}
+
+/* 1 if the force pass of this step also sums a diagnostics row */
+int diag_due(int step)
+{
+	return diag_file != NULL && (step - 1) % period == 0;
+}
+
+void diag_clear(DiagSums *sums)
+{
+	memset(sums, 0, sizeof(DiagSums));
+}
+
+/* accel_body() for a diagnostics step: also adds the terms of body i, at the
+ * start of the step, to sums */
+void diag_accel_body(int i, double *ax, double *ay, DiagSums *sums)
+{
+	double pot = 0;
+
+	accel_body_pot(i, ax, ay, &pot);
+	diag_add_body(i, bodies->vx[i], bodies->vy[i], pot, sums);
+
+	return;
+}
+
+/* Add the terms of body i at its current position, moving at (vx, vy) with
+ * potential pot per unit mass, to sums */
+void diag_add_body(int i, double vx, double vy, double pot, DiagSums *sums)
+{
+	double m = body_info.mass[i];
+
+	sums->kinetic += 0.5 * m * (vx*vx + vy*vy);
+	sums->potential += 0.5 * m * pot;
+	sums->px += m * vx;
+	sums->py += m * vy;
+	sums->mx += m * bodies->x[i];
+	sums->my += m * bodies->y[i];
+	sums->mass += m;
+
+	return;
+}
+
+/* Add the partial sums part into into */
+void diag_merge(DiagSums *into, const DiagSums *part)
+{
+	into->kinetic += part->kinetic;
+	into->potential += part->potential;
+	into->px += part->px;
+	into->py += part->py;
+	into->mx += part->mx;
+	into->my += part->my;
+	into->mass += part->mass;
+}
+
+/* Write the row for time from the sums over all bodies */
+void diag_write(int time, const DiagSums *sums)
+{
+	fprintf(diag_file, "%d,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g\n", time,
+			sums->kinetic, sums->potential, sums->kinetic + sums->potential,
+			sums->px, sums->py, sums->mx / sums->mass, sums->my / sums->mass);
+
+	return;
+}
+
+void diag_free()
+{
+	if (diag_file != NULL)
+	{
+		fclose(diag_file);
+	}
+}
@@ -0,0 +1,27 @@
+// nbody_diag.h: Energy, momentum and centroid diagnostics
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_DIAG_H
+#define NBODY_DIAG_H
+
+/* Sums over the bodies for one diagnostics row. Threads sum their own bodies
+ * and the partial sums are combined with diag_merge(). */
+typedef struct DiagSumsStruct {
+	double kinetic;		/* sum of m v^2 / 2 */
+	double potential;	/* sum of m phi / 2, each pair counted from both ends */
+	double px, py;		/* linear momentum */
+	double mx, my;		/* mass weighted positions */
+	double mass;		/* total mass */
+} DiagSums;
+
+void diag_init();
+int diag_due(int step);
+void diag_clear(DiagSums *sums);
+void diag_accel_body(int i, double *ax, double *ay, DiagSums *sums);
+void diag_add_body(int i, double vx, double vy, double pot, DiagSums *sums);
+void diag_merge(DiagSums *into, const DiagSums *part);
+void diag_write(int time, const DiagSums *sums);
+void diag_free();
+
+#endif
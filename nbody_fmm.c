@@ -0,0 +1,486 @@
+// nbody_fmm.c: Fast multipole method solver
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The force law here is a = K*m/r^2 (a 1/r potential) even though the bodies
+// move in a plane, so the complex variable expansions of the 2D log potential
+// do not apply. Instead the expansions are Cartesian Taylor series of 1/r in
+// (x, y), truncated at total order p (--order). Coefficient (a, b) is the term
+// with x^a y^b.
+//
+// The universe square is divided into a uniform quadtree whose leaf level has
+// about FMM_LEAF_BODIES bodies per cell. Each step:
+//   1. the bodies are binned into the leaf cells (thread 0)
+//   2. upward pass: P2M at the leaves, then M2M level by level to level 2
+//   3. downward pass: level by level, L2L from the parent plus M2L from the
+//      cells in the interaction list (children of the parent's neighbors that
+//      are not neighbors themselves)
+//   4. for each body in accel_body(): L2P from its leaf plus the direct kernel
+//      over the leaf and its 8 neighbors
+// The passes split the cells of a level evenly over the team with a barrier
+// between levels. The interaction offsets on a level are always the same
+// 7x7 set, so the derivatives of 1/r are tabulated once at unit spacing and
+// scaled by the cell width.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_fmm.h"
+
+#define COEF(a, b) (((a) + (b)) * ((a) + (b) + 1) / 2 + (b))	// Index of coefficient (a, b)
+#define NUM_COEF(p) (((p) + 1) * ((p) + 2) / 2)					// Coefficients with a + b <= p
+
+static int p;					/* expansion order */
+static int num_coef;			/* NUM_COEF(p) */
+static int leaf_level;			/* deepest level of the quadtree, at least 2 */
+static int level_first[32];		/* index of the first cell of each level */
+static double root_size;		/* width of the root square */
+static double *mpole;			/* multipole coefficients of every cell */
+static double *local;			/* local expansion coefficients of every cell */
+static double *d_unit;			/* derivatives of 1/r at the 7x7 cell offsets, unit spacing */
+
+// Leaf binning: bodies of leaf cell c are [cell_start[c], cell_start[c + 1]) of fmm_x, fmm_y, fmm_m
+static int *cell_start;
+static int *cell_fill;
+static double *fmm_x, *fmm_y, *fmm_m;
+
+/* All derivatives d^(a+b)/dx^a dy^b of 1/r at (x, y) with a + b <= order, using
+ * the Hermite type recurrence for functions of r^2 (McMurchie-Davidson):
+ *   R(k; a, b) = x R(k+1; a-1, b) + (a-1) R(k+1; a-2, b)
+ * with R(k; 0, 0) = (-1)^k (2k-1)!! / r^(2k+1) and D(a, b) = R(0; a, b) */
+static void derivatives(double x, double y, int order, double *d)
+{
+	double r_tmp[(FMM_MAX_ORDER + 1) * NUM_COEF(FMM_MAX_ORDER)];
+	int nc = NUM_COEF(order);
+	double r_squared = x*x + y*y;
+	double f = 1.0 / sqrt(r_squared);
+	int k, n, a, b;
+
+	// R(k; 0, 0)
+	for (k = 0; k <= order; k++)
+	{
+		r_tmp[k * nc] = f;
+		f *= -(2*k + 1) / r_squared;
+	}
+
+	for (n = 1; n <= order; n++)
+	{
+		for (k = 0; k <= order - n; k++)
+		{
+			double *rk = r_tmp + k * nc;
+			double *rk1 = r_tmp + (k + 1) * nc;
+
+			for (b = 0; b <= n; b++)
+			{
+				a = n - b;
+				if (a > 0)
+				{
+					rk[COEF(a, b)] = x * rk1[COEF(a - 1, b)] + (a > 1 ? (a - 1) * rk1[COEF(a - 2, b)] : 0);
+				}
+				else
+				{
+					rk[COEF(a, b)] = y * rk1[COEF(a, b - 1)] + (b > 1 ? (b - 1) * rk1[COEF(a, b - 2)] : 0);
+				}
+			}
+		}
+	}
+
+	memcpy(d, r_tmp, sizeof(double) * nc);
+
+	return;
+}
+
+void fmm_init(int order)
+{
+	int l, n, ox, oy, num_cells;
+
+	assert(order >= 1 && order <= FMM_MAX_ORDER);
+	p = order;
+	num_coef = NUM_COEF(p);
+
+	// Deep enough for about FMM_LEAF_BODIES per leaf, capped to keep the tables in memory
+	leaf_level = 2;
+	while (leaf_level < 10 && (double)numBodies / (1 << (2 * leaf_level)) > FMM_LEAF_BODIES)
+	{
+		leaf_level++;
+	}
+
+	num_cells = 0;
+	for (l = 0; l <= leaf_level; l++)
+	{
+		level_first[l] = num_cells;
+		num_cells += 1 << (2 * l);
+	}
+	level_first[leaf_level + 1] = num_cells;
+
+	root_size = univ_x > univ_y ? univ_x : univ_y;
+	mpole = (double*)my_aligned_malloc(sizeof(double) * num_cells * num_coef);
+	local = (double*)my_aligned_malloc(sizeof(double) * num_cells * num_coef);
+
+	d_unit = (double*)my_aligned_malloc(sizeof(double) * 49 * num_coef);
+	for (oy = -3; oy <= 3; oy++)
+	{
+		for (ox = -3; ox <= 3; ox++)
+		{
+			if (ox != 0 || oy != 0)
+			{
+				derivatives(ox, oy, p, d_unit + ((oy + 3) * 7 + ox + 3) * num_coef);
+			}
+		}
+	}
+
+	n = 1 << (2 * leaf_level);
+	cell_start = (int*)my_malloc(sizeof(int) * (n + 1));
+	cell_fill = (int*)my_malloc(sizeof(int) * n);
+	fmm_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	fmm_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	fmm_m = (double*)my_aligned_malloc(numPadded * sizeof(double));
+
+	return;
+}
+
+/* Leaf cell coordinate of position v along an axis starting at v_min */
+static int leaf_coord(double v, double v_min)
+{
+	int side = 1 << leaf_level;
+	int c = (int)((v - v_min) / root_size * side);
+
+	return c < 0 ? 0 : c >= side ? side - 1 : c;
+}
+
+/* Counting sort of the bodies into leaf cells, row major order */
+static void bin_bodies()
+{
+	int side = 1 << leaf_level;
+	int n = side * side;
+	int c, i;
+
+	memset(cell_fill, 0, sizeof(int) * n);
+	for (i = 0; i < numBodies; i++)
+	{
+		cell_fill[leaf_coord(bodies->y[i], y_min) * side + leaf_coord(bodies->x[i], x_min)]++;
+	}
+
+	cell_start[0] = 0;
+	for (c = 0; c < n; c++)
+	{
+		cell_start[c + 1] = cell_start[c] + cell_fill[c];
+		cell_fill[c] = cell_start[c];
+	}
+
+	for (i = 0; i < numBodies; i++)
+	{
+		int k = cell_fill[leaf_coord(bodies->y[i], y_min) * side + leaf_coord(bodies->x[i], x_min)]++;
+		fmm_x[k] = bodies->x[i];
+		fmm_y[k] = bodies->y[i];
+		fmm_m[k] = body_info.mass[i];
+	}
+
+	return;
+}
+
+/* Cells [*lo, *hi) of the n cells of a level are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* P2M: multipole of leaf cell (i, j) about its center straight from its bodies */
+static void leaf_multipole(int i, int j)
+{
+	int side = 1 << leaf_level;
+	double w = root_size / side;
+	double cx = x_min + (i + 0.5) * w;
+	double cy = y_min + (j + 0.5) * w;
+	int c = j * side + i;
+	double *m = mpole + (level_first[leaf_level] + c) * num_coef;
+	double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+	int k, a, b;
+
+	memset(m, 0, sizeof(double) * num_coef);
+	for (k = cell_start[c]; k < cell_start[c + 1]; k++)
+	{
+		px[0] = fmm_m[k];
+		py[0] = 1;
+		for (a = 1; a <= p; a++)
+		{
+			px[a] = px[a - 1] * (fmm_x[k] - cx) / a;
+			py[a] = py[a - 1] * (fmm_y[k] - cy) / a;
+		}
+		for (a = 0; a <= p; a++)
+		{
+			for (b = 0; a + b <= p; b++)
+			{
+				m[COEF(a, b)] += px[a] * py[b];
+			}
+		}
+	}
+
+	return;
+}
+
+/* M2M: shift the multipoles of the 4 children of cell (i, j) on level l to its center */
+static void combine_multipoles(int l, int i, int j)
+{
+	double half = root_size / (1 << l) / 4;		// child center minus parent center, per axis
+	double *m = mpole + (level_first[l] + j * (1 << l) + i) * num_coef;
+	int q, a, b, c, e;
+
+	memset(m, 0, sizeof(double) * num_coef);
+	for (q = 0; q < 4; q++)
+	{
+		int ci = 2*i + (q & 1);
+		int cj = 2*j + (q >> 1);
+		double *mc = mpole + (level_first[l + 1] + cj * (1 << (l + 1)) + ci) * num_coef;
+		double dx = (q & 1) ? half : -half;
+		double dy = (q >> 1) ? half : -half;
+		double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+
+		if (mc[0] == 0)
+		{
+			continue;	// Empty child
+		}
+
+		px[0] = py[0] = 1;
+		for (a = 1; a <= p; a++)
+		{
+			px[a] = px[a - 1] * dx / a;
+			py[a] = py[a - 1] * dy / a;
+		}
+
+		for (a = 0; a <= p; a++)
+		{
+			for (b = 0; a + b <= p; b++)
+			{
+				double sum = 0;
+				for (c = 0; c <= a; c++)
+				{
+					for (e = 0; e <= b; e++)
+					{
+						sum += mc[COEF(c, e)] * px[a - c] * py[b - e];
+					}
+				}
+				m[COEF(a, b)] += sum;
+			}
+		}
+	}
+
+	return;
+}
+
+/* L2L + M2L: local expansion of cell (i, j) on level l */
+static void build_local(int l, int i, int j)
+{
+	int side = 1 << l;
+	double w = root_size / side;
+	double *loc = local + (level_first[l] + j * side + i) * num_coef;
+	double scale[FMM_MAX_ORDER + 1];
+	double d_scaled[NUM_COEF(FMM_MAX_ORDER)], m_signed[NUM_COEF(FMM_MAX_ORDER)];
+	int pi = i >> 1;
+	int pj = j >> 1;
+	int si, sj, a, b, c, e, n;
+
+	memset(loc, 0, sizeof(double) * num_coef);
+
+	// L2L from the parent (levels above 2 have nothing from further away)
+	if (l > 2)
+	{
+		double *lp = local + (level_first[l - 1] + pj * (side / 2) + pi) * num_coef;
+		double dx = (i & 1) ? w / 2 : -w / 2;
+		double dy = (j & 1) ? w / 2 : -w / 2;
+		double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+
+		px[0] = py[0] = 1;
+		for (a = 1; a <= p; a++)
+		{
+			px[a] = px[a - 1] * dx / a;
+			py[a] = py[a - 1] * dy / a;
+		}
+
+		for (a = 0; a <= p; a++)
+		{
+			for (b = 0; a + b <= p; b++)
+			{
+				double sum = 0;
+				for (c = 0; a + b + c <= p; c++)
+				{
+					for (e = 0; a + b + c + e <= p; e++)
+					{
+						sum += lp[COEF(a + c, b + e)] * px[c] * py[e];
+					}
+				}
+				loc[COEF(a, b)] = sum;
+			}
+		}
+	}
+
+	// D(o * w) = D(o) / w^(n+1) for derivative order n
+	scale[0] = 1 / w;
+	for (n = 1; n <= p; n++)
+	{
+		scale[n] = scale[n - 1] / w;
+	}
+
+	// M2L from the interaction list
+	for (sj = 2*pj - 2; sj <= 2*pj + 3; sj++)
+	{
+		for (si = 2*pi - 2; si <= 2*pi + 3; si++)
+		{
+			double *m, *d;
+
+			if (si < 0 || sj < 0 || si >= side || sj >= side ||
+				(abs(si - i) <= 1 && abs(sj - j) <= 1))
+			{
+				continue;
+			}
+
+			m = mpole + (level_first[l] + sj * side + si) * num_coef;
+			if (m[0] == 0)
+			{
+				continue;
+			}
+
+			// Derivatives at this offset scaled to the level, and the multipole with (-1)^(c+e)
+			d = d_unit + ((j - sj + 3) * 7 + (i - si + 3)) * num_coef;
+			for (n = 0; n <= p; n++)
+			{
+				for (b = 0; b <= n; b++)
+				{
+					d_scaled[COEF(n - b, b)] = d[COEF(n - b, b)] * scale[n];
+					m_signed[COEF(n - b, b)] = n & 1 ? -m[COEF(n - b, b)] : m[COEF(n - b, b)];
+				}
+			}
+
+			for (a = 0; a <= p; a++)
+			{
+				for (b = 0; a + b <= p; b++)
+				{
+					double sum = 0;
+					for (c = 0; a + b + c <= p; c++)
+					{
+						for (e = 0; a + b + c + e <= p; e++)
+						{
+							sum += m_signed[COEF(c, e)] * d_scaled[COEF(a + c, b + e)];
+						}
+					}
+					loc[COEF(a, b)] += sum;
+				}
+			}
+		}
+	}
+
+	return;
+}
+
+/* Team part of a step: binning, upward pass and downward pass */
+void fmm_prepare(Team *team)
+{
+	int l, c, lo, hi;
+	int side;
+
+	if (team->id == 0)
+	{
+		bin_bodies();
+	}
+	team_barrier(team);
+
+	side = 1 << leaf_level;
+	share(team, side * side, &lo, &hi);
+	for (c = lo; c < hi; c++)
+	{
+		leaf_multipole(c % side, c / side);
+	}
+	team_barrier(team);
+
+	for (l = leaf_level - 1; l >= 2; l--)
+	{
+		side = 1 << l;
+		share(team, side * side, &lo, &hi);
+		for (c = lo; c < hi; c++)
+		{
+			combine_multipoles(l, c % side, c / side);
+		}
+		team_barrier(team);
+	}
+
+	for (l = 2; l <= leaf_level; l++)
+	{
+		side = 1 << l;
+		share(team, side * side, &lo, &hi);
+		for (c = lo; c < hi; c++)
+		{
+			build_local(l, c % side, c / side);
+		}
+		team_barrier(team);
+	}
+
+	return;
+}
+
+/* Add the acceleration at (x, y) to *ax, *ay: far field from the local
+ * expansion of its leaf, near field directly from the 3x3 leaves around it */
+void fmm_accel(double x, double y, double *ax, double *ay)
+{
+	int side = 1 << leaf_level;
+	double w = root_size / side;
+	int i = leaf_coord(x, x_min);
+	int j = leaf_coord(y, y_min);
+	double *loc = local + (level_first[leaf_level] + j * side + i) * num_coef;
+	double hx = x - (x_min + (i + 0.5) * w);
+	double hy = y - (y_min + (j + 0.5) * w);
+	double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+	double far_x = 0;
+	double far_y = 0;
+	int a, b, row;
+
+	px[0] = py[0] = 1;
+	for (a = 1; a < p; a++)
+	{
+		px[a] = px[a - 1] * hx / a;
+		py[a] = py[a - 1] * hy / a;
+	}
+	for (a = 0; a < p; a++)
+	{
+		for (b = 0; a + b < p; b++)
+		{
+			far_x += loc[COEF(a + 1, b)] * px[a] * py[b];
+			far_y += loc[COEF(a, b + 1)] * px[a] * py[b];
+		}
+	}
+	*ax += K * far_x;
+	*ay += K * far_y;
+
+	// Neighbor cells of one row are next to each other in the binned arrays
+	for (row = j - 1; row <= j + 1; row++)
+	{
+		int first, last;
+
+		if (row < 0 || row >= side)
+		{
+			continue;
+		}
+		first = cell_start[row * side + (i > 0 ? i - 1 : 0)];
+		last = cell_start[row * side + (i < side - 1 ? i + 1 : side - 1) + 1];
+		accel_kernel(x, y, fmm_x + first, fmm_y + first, fmm_m + first, last - first, ax, ay);
+	}
+
+	return;
+}
+
+void fmm_free()
+{
+	free(mpole);
+	free(local);
+	free(d_unit);
+	free(cell_start);
+	free(cell_fill);
+	free(fmm_x);
+	free(fmm_y);
+	free(fmm_m);
+}
@@ -0,0 +1,18 @@
+// nbody_fmm.h: Fast multipole method solver
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_FMM_H
+#define NBODY_FMM_H
+
+#include "nbody_accel.h"
+
+#define FMM_MAX_ORDER 12	// Highest expansion order allowed by --order
+#define FMM_LEAF_BODIES 32	// Average bodies per leaf cell the leaf level is sized for
+
+void fmm_init(int order);
+void fmm_prepare(Team *team);
+void fmm_accel(double x, double y, double *ax, double *ay);
+void fmm_free();
+
+#endif
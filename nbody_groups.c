@@ -0,0 +1,485 @@
+// nbody_groups.c: In-situ friends-of-friends group finder
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// --fof=<file> finds the clumps of bodies every period steps, while the run
+// goes, instead of from the frames afterwards. Two bodies closer than the
+// linking length (--fof-link, at their nearest periodic image) are friends,
+// and a group is everything connected by friends. Groups of at least --fof-min
+// bodies go to a CSV log, a row per group:
+//   time,groups,group,members,mass,cx,cy
+// where groups is the number of groups at that time, and (cx, cy) the center
+// of mass, taken across the periodic edges. A time without a group gets a
+// single row with groups 0 and the rest empty. The default linking length is
+// 0.2 of the mean spacing of the bodies.
+//
+// Like the --diag rows, the groups of time t are found at the start of step
+// t + 1, by the whole team:
+//   1. the bodies are hashed into square cells at least as wide as the
+//      linking length, by the same counting sort as in nbody_merge.c
+//   2. every thread links each body of its share to its friends of higher
+//      number in the 3 x 3 cells around it, in a union-find forest that all
+//      threads change at once without locks: a root is only ever hung under
+//      a lower numbered root, by an atomic compare and swap that fails if
+//      another thread got there first, and the link is then retried from the
+//      new roots. Finding a root halves the path as it goes.
+//   3. every body is pointed straight at its root, and the members of each
+//      root counted with an atomic add
+//   4. the roots with enough members are numbered in body order, by counts
+//      scanned in thread order, and every thread sums the mass and centroid
+//      of its share of the bodies per group; thread 0 adds the threads' sums
+//      in thread order and writes the rows
+// The root of a group is always its lowest numbered body, so the groups and
+// their numbers are the same for any team size; the sums are partial sums per
+// thread, as for --diag.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_compact.h"
+#include "nbody_groups.h"
+
+static FILE *log_file;			/* CSV log, NULL when --fof is not given */
+static int team_size;			/* number of threads groups_init() was set up for */
+static double link_length;		/* friends are closer than this */
+static int num_buckets;			/* size of the hash table, a power of 2 */
+static int ncx, ncy;			/* cells in x and y */
+static double cell_wx, cell_wy;	/* cell size */
+
+static int **bucket_offset;		/* per thread: its bodies in each bucket, then where they go */
+static int *bucket_start;		/* bodies of bucket b are bucket_bodies[bucket_start[b] .. bucket_start[b + 1]) */
+static int *bucket_bodies;		/* body indices ordered by bucket */
+static int *range_total;		/* bodies in the range of buckets of each thread */
+
+static int *parent;				/* union-find forest, changed with atomics */
+static int *members;			/* bodies under each root */
+static int *group_of;			/* group number of each root, -1 if too small */
+static int *group_root;			/* root of each group */
+static int *found;				/* groups among the roots of each thread's share */
+static double **part;			/* per thread: mass and mass weighted offsets of each group */
+static int part_size;			/* groups the part arrays hold */
+
+static int snapshots;			/* times searched */
+static int most_groups;			/* largest number of groups at one time */
+
+void groups_init(int num_threads)
+{
+	int t;
+
+	log_file = NULL;
+	if (opt_fof == NULL)
+	{
+		return;
+	}
+
+	if (compact_storage)
+	{
+		printf("--fof is not supported with --storage=compact\n");
+		exit(1);
+	}
+
+	team_size = num_threads;
+	link_length = opt_fof_link > 0 ? opt_fof_link : 0.2 * sqrt(univ_x * univ_y / numBodies);
+	num_buckets = 1;
+	while (num_buckets < 2 * numBodies)
+	{
+		num_buckets *= 2;
+	}
+	ncx = (int)(univ_x / link_length);
+	ncy = (int)(univ_y / link_length);
+	ncx = ncx < 1 ? 1 : ncx;
+	ncy = ncy < 1 ? 1 : ncy;
+	cell_wx = univ_x / ncx;
+	cell_wy = univ_y / ncy;
+
+	bucket_offset = (int**)my_malloc(sizeof(int*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		bucket_offset[t] = (int*)my_malloc(sizeof(int) * num_buckets);
+	}
+	bucket_start = (int*)my_malloc(sizeof(int) * (num_buckets + 1));
+	bucket_bodies = (int*)my_malloc(sizeof(int) * numBodies);
+	range_total = (int*)my_malloc(sizeof(int) * num_threads);
+	parent = (int*)my_malloc(sizeof(int) * numBodies);
+	members = (int*)my_malloc(sizeof(int) * numBodies);
+	group_of = (int*)my_malloc(sizeof(int) * numBodies);
+	group_root = (int*)my_malloc(sizeof(int) * numBodies);
+	found = (int*)my_malloc(sizeof(int) * num_threads);
+	part = (double**)my_malloc(sizeof(double*) * num_threads);
+	part_size = 0;
+	for (t = 0; t < num_threads; t++)
+	{
+		part[t] = NULL;
+	}
+
+	snapshots = 0;
+	most_groups = 0;
+	log_file = fopen(opt_fof, "w");
+	assert(log_file);
+	fprintf(log_file, "time,groups,group,members,mass,cx,cy\n");
+
+	#ifndef NO_OUT
+	printf("Friends-of-friends: linking length %f, at least %d members\n", link_length, opt_fof_min);
+	#endif
+
+	return;
+}
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* Shortest periodic image of a difference along an axis of length size */
+static double nearest(double d, double size)
+{
+	return d - size * nearbyint(d / size);
+}
+
+/* Cell holding body i */
+static void cell_of(int i, int *cx, int *cy)
+{
+	double fx = floor((bodies->x[i] - x_min) / cell_wx);
+	double fy = floor((bodies->y[i] - y_min) / cell_wy);
+
+	// The wrap in update() can round a very fast body just outside the universe
+	*cx = fx < 0 ? 0 : (fx < ncx ? (int)fx : ncx - 1);
+	*cy = fy < 0 ? 0 : (fy < ncy ? (int)fy : ncy - 1);
+}
+
+static int bucket_of(int cx, int cy)
+{
+	return (int)(((unsigned)cx * 73856093u ^ (unsigned)cy * 19349663u) & (unsigned)(num_buckets - 1));
+}
+
+static int bucket_of_body(int i)
+{
+	int cx, cy;
+
+	cell_of(i, &cx, &cy);
+	return bucket_of(cx, cy);
+}
+
+/* Counting sort of the bodies by bucket, as hash_bodies() in nbody_merge.c */
+static void hash_bodies(Team *team)
+{
+	int *offset = bucket_offset[team->id];
+	int lo, hi, i, b, t, base;
+
+	memset(offset, 0, sizeof(int) * num_buckets);
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		offset[bucket_of_body(i)]++;
+	}
+	team_barrier(team);
+
+	share(team, num_buckets, &lo, &hi);
+	base = 0;
+	for (b = lo; b < hi; b++)
+	{
+		for (t = 0; t < team->size; t++)
+		{
+			base += bucket_offset[t][b];
+		}
+	}
+	range_total[team->id] = base;
+	team_barrier(team);
+
+	base = 0;
+	for (t = 0; t < team->id; t++)
+	{
+		base += range_total[t];
+	}
+	for (b = lo; b < hi; b++)
+	{
+		bucket_start[b] = base;
+		for (t = 0; t < team->size; t++)
+		{
+			int count = bucket_offset[t][b];
+
+			bucket_offset[t][b] = base;
+			base += count;
+		}
+	}
+	if (team->id == team->size - 1)
+	{
+		bucket_start[num_buckets] = numBodies;
+	}
+	team_barrier(team);
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		bucket_bodies[offset[bucket_of_body(i)]++] = i;
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Root of body i, halving the path to it on the way */
+static int find_root(int i)
+{
+	for (;;)
+	{
+		int p = __atomic_load_n(parent + i, __ATOMIC_ACQUIRE);
+		int gp;
+
+		if (p == i)
+		{
+			return i;
+		}
+		gp = __atomic_load_n(parent + p, __ATOMIC_ACQUIRE);
+		if (gp != p)
+		{
+			// Losing the race to another thread only leaves the path longer
+			__atomic_compare_exchange_n(parent + i, &p, gp, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+		}
+		i = gp;
+	}
+}
+
+/* Put bodies a and b in the same group */
+static void link_bodies(int a, int b)
+{
+	for (;;)
+	{
+		int expected;
+
+		a = find_root(a);
+		b = find_root(b);
+		if (a == b)
+		{
+			return;
+		}
+		if (a < b)
+		{
+			int t = a;
+
+			a = b;
+			b = t;
+		}
+
+		// Hang the higher root under the lower one, unless it stopped being a root
+		expected = a;
+		if (__atomic_compare_exchange_n(parent + a, &expected, b, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			return;
+		}
+	}
+}
+
+/* Link every body of this thread's share to its higher numbered friends */
+static void link_friends(Team *team)
+{
+	const double *x = bodies->x;
+	const double *y = bodies->y;
+	double link_squared = link_length * link_length;
+	int lo, hi, i;
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		int cx, cy, ox, oy, k;
+
+		cell_of(i, &cx, &cy);
+		for (oy = -1; oy <= 1; oy++)
+		{
+			for (ox = -1; ox <= 1; ox++)
+			{
+				// Other cells sharing the bucket are rejected by the distance
+				int b = bucket_of((cx + ox + ncx) % ncx, (cy + oy + ncy) % ncy);
+
+				for (k = bucket_start[b]; k < bucket_start[b + 1]; k++)
+				{
+					int j = bucket_bodies[k];
+					double dx, dy;
+
+					if (j <= i)
+					{
+						continue;
+					}
+					dx = nearest(x[j] - x[i], univ_x);
+					dy = nearest(y[j] - y[i], univ_y);
+					if (dx*dx + dy*dy < link_squared)
+					{
+						link_bodies(i, j);
+					}
+				}
+			}
+		}
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Wrap a coordinate back into [low, low + size) */
+static double wrap(double x, double low, double size)
+{
+	return x - size * floor((x - low) / size);
+}
+
+/* Add the threads' sums of each group in thread order and write the rows of
+ * this time. Called by thread 0. */
+static void write_groups(int time, int groups)
+{
+	int g, t;
+
+	if (groups == 0)
+	{
+		fprintf(log_file, "%d,0,,,,,\n", time);
+	}
+	for (g = 0; g < groups; g++)
+	{
+		int r = group_root[g];
+		double m = 0, mx = 0, my = 0;
+
+		for (t = 0; t < team_size; t++)
+		{
+			m += part[t][3 * g];
+			mx += part[t][3 * g + 1];
+			my += part[t][3 * g + 2];
+		}
+		fprintf(log_file, "%d,%d,%d,%d,%.9g,%.9g,%.9g\n", time, groups, g, members[r], m,
+				wrap(bodies->x[r] + (m > 0 ? mx / m : 0), x_min, univ_x),
+				wrap(bodies->y[r] + (m > 0 ? my / m : 0), y_min, univ_y));
+	}
+
+	snapshots++;
+	most_groups = groups > most_groups ? groups : most_groups;
+}
+
+/* Find the groups if this step starts a period, see the top of the file.
+ * Every thread of the team must call it at the start of a step. */
+void groups_step(Team *team, int step)
+{
+	int lo, hi, i, t, g;
+	int groups = 0;
+	double *sums;
+
+	if (log_file == NULL || (step - 1) % period != 0)
+	{
+		return;
+	}
+	assert(team->size == team_size);
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		parent[i] = i;
+		members[i] = 0;
+	}
+	hash_bodies(team);
+	link_friends(team);
+
+	for (i = lo; i < hi; i++)
+	{
+		int r = find_root(i);
+
+		__atomic_fetch_add(members + r, 1, __ATOMIC_RELAXED);
+	}
+	team_barrier(team);
+	for (i = lo; i < hi; i++)
+	{
+		__atomic_store_n(parent + i, find_root(i), __ATOMIC_RELEASE);
+	}
+
+	found[team->id] = 0;
+	for (i = lo; i < hi; i++)
+	{
+		found[team->id] += parent[i] == i && members[i] >= opt_fof_min;
+	}
+	team_barrier(team);
+
+	g = 0;
+	for (t = 0; t < team->size; t++)
+	{
+		g += t < team->id ? found[t] : 0;
+		groups += found[t];
+	}
+	for (i = lo; i < hi; i++)
+	{
+		group_of[i] = -1;
+		if (parent[i] == i && members[i] >= opt_fof_min)
+		{
+			group_root[g] = i;
+			group_of[i] = g++;
+		}
+	}
+	if (team->id == 0 && groups > part_size)
+	{
+		part_size = groups;
+		for (t = 0; t < team->size; t++)
+		{
+			free(part[t]);
+			part[t] = (double*)my_malloc(sizeof(double) * 3 * part_size);
+		}
+	}
+	team_barrier(team);
+
+	// Mass weighted offsets from the root, so a group across an edge stays whole
+	sums = part[team->id];
+	memset(sums, 0, sizeof(double) * 3 * groups);
+	for (i = lo; i < hi; i++)
+	{
+		int r = parent[i];
+
+		g = group_of[r];
+		if (g >= 0)
+		{
+			double m = body_info.mass[i];
+
+			sums[3 * g] += m;
+			sums[3 * g + 1] += m * nearest(bodies->x[i] - bodies->x[r], univ_x);
+			sums[3 * g + 2] += m * nearest(bodies->y[i] - bodies->y[r], univ_y);
+		}
+	}
+	team_barrier(team);
+
+	if (team->id == 0)
+	{
+		write_groups(step - 1, groups);
+	}
+	team_barrier(team);
+
+	return;
+}
+
+void groups_free()
+{
+	int t;
+
+	if (log_file == NULL)
+	{
+		return;
+	}
+
+	#ifndef NO_OUT
+	printf("Friends-of-friends: %d times searched, at most %d groups\n", snapshots, most_groups);
+	#endif
+
+	fclose(log_file);
+	for (t = 0; t < team_size; t++)
+	{
+		free(bucket_offset[t]);
+		free(part[t]);
+	}
+	free(bucket_offset);
+	free(bucket_start);
+	free(bucket_bodies);
+	free(range_total);
+	free(parent);
+	free(members);
+	free(group_of);
+	free(group_root);
+	free(found);
+	free(part);
+}
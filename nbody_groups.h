@@ -0,0 +1,14 @@
+// nbody_groups.h: In-situ friends-of-friends group finder
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_GROUPS_H
+#define NBODY_GROUPS_H
+
+#include "nbody_accel.h"
+
+void groups_init(int num_threads);
+void groups_step(Team *team, int step);
+void groups_free();
+
+#endif
@@ -0,0 +1,276 @@
+// nbody_integrate.c: Symplectic integrators shared by all n-body versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The update loops of the versions are first order: a body moves with its old
+// velocity, then the velocity takes the acceleration at the old position. The
+// error of a step goes as dt^2, so accuracy was only bought with more, smaller
+// steps. --integrator picks a better scheme, run here for all versions:
+//   euler     the update loops of the versions (the default)
+//   kdk       leapfrog, kick-drift-kick: half a kick with the acceleration at
+//             the start, a full drift, half a kick with the new acceleration.
+//             Second order, one force evaluation per step.
+//   yoshida4  three kdk steps of w1 dt, w0 dt, w1 dt with
+//             w1 = 1 / (2 - 2^(1/3)), w0 = 1 - 2 w1 (Yoshida 1990). Fourth
+//             order, three force evaluations per step.
+// Both are symplectic, so the energy error stays bounded instead of drifting.
+// --dt sets the step for every integrator; it used to be fixed at 1, with the
+// time scale folded into K and the velocities. The acceleration at the end of
+// a step is the one at the start of the next, so it is kept and only the
+// first step evaluates the forces once more.
+//
+// Every thread of the team calls integrate_step() in place of the update loop
+// of a step, and does an equal block of the bodies in every pass:
+//   1. kick and drift its block, then wait for the team
+//   2. accel_prepare() and the forces of its block at the new positions,
+//      closing kick, then wait for the team
+// The bodies are moved in place and copied to bodies_new at the end, so the
+// versions swap the arrays as before. A --diag row is summed by the last force
+// pass of the step before the one that reports it, with the velocities at the
+// same time.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_compact.h"
+#include "nbody_integrate.h"
+
+int symplectic;
+
+static int team_size;			/* number of threads integrate_init() was set up for */
+static int num_stages;			/* kdk steps per step */
+static double stage[3];			/* length of each kdk step, in steps */
+static double *accel_x, *accel_y;	/* acceleration at the current positions */
+static double *spare_x, *spare_y;	/* accel_x and accel_y of the bodies in a new order (--sort) */
+static int evaluated;			/* numBodies when accel_x was found, 0 before the first step */
+static DiagSums *pending;		/* per thread diagnostics row waiting for its step */
+
+void integrate_init(int num_threads)
+{
+	int t;
+
+	symplectic = 0;
+	if (strcmp(opt_integrator, "euler") == 0)
+	{
+		return;
+	}
+	else if (strcmp(opt_integrator, "kdk") == 0)
+	{
+		num_stages = 1;
+		stage[0] = 1;
+	}
+	else if (strcmp(opt_integrator, "yoshida4") == 0)
+	{
+		double w1 = 1 / (2 - cbrt(2.0));
+
+		num_stages = 3;
+		stage[0] = w1;
+		stage[1] = 1 - 2 * w1;
+		stage[2] = w1;
+	}
+	else
+	{
+		printf("Unknown integrator: %s\n", opt_integrator);
+		exit(1);
+	}
+
+	// Block timesteps are kdk on every body's own step
+	if (opt_block_levels >= 0)
+	{
+		printf("--integrator=%s is not supported with --block-levels, which uses kdk\n", opt_integrator);
+		exit(1);
+	}
+	if (compact_storage)
+	{
+		printf("--integrator=%s is not supported with --storage=compact\n", opt_integrator);
+		exit(1);
+	}
+
+	symplectic = 1;
+	team_size = num_threads;
+	evaluated = 0;
+	accel_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	accel_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	spare_x = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	spare_y = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	pending = (DiagSums*)my_malloc(sizeof(DiagSums) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		diag_clear(pending + t);
+	}
+
+	#ifndef NO_OUT
+	printf("Integrator: %s, dt %f\n", opt_integrator, opt_dt);
+	#endif
+
+	return;
+}
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* Wrap a coordinate back into [low, low + size) as update() does */
+static double wrap(double x, double low, double size)
+{
+	if (x >= low + size || x < low)
+	{
+		x = x + (ceil((low + size - x) / size) - 1) * size;
+	}
+
+	return x;
+}
+
+/* Forces on this thread's block at the current positions, and a kick of h
+ * with them. With sums, also the diagnostics terms after the kick. */
+static void force_kick(Team *team, double h, DiagSums *sums)
+{
+	int lo, hi, i;
+
+	accel_prepare(team);
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		double ax = 0, ay = 0, pot = 0;
+
+		if (sums != NULL)
+		{
+			accel_body_pot(i, &ax, &ay, &pot);
+		}
+		else
+		{
+			accel_body(i, &ax, &ay);
+		}
+		accel_x[i] = ax;
+		accel_y[i] = ay;
+
+		bodies->vx[i] += ax * h;
+		bodies->vy[i] += ay * h;
+		assert(!(isnan(bodies->vx[i]) || isnan(bodies->vy[i])));
+		if (sums != NULL)
+		{
+			diag_add_body(i, bodies->vx[i], bodies->vy[i], pot, sums);
+		}
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Move the bodies one step, from bodies into bodies_new. Called by every
+ * thread of the team in place of the force and update loop of a step. On a
+ * diagnostics step thread 0 adds the row for step - 1 to sums. */
+void integrate_step(Team *team, int step, DiagSums *sums)
+{
+	int lo, hi, i, s, t;
+
+	assert(team->size == team_size);
+
+	// The bodies are moved in place; a frame may still be drawn from them (v2 versions)
+	team_barrier(team);
+
+	// First step, or --merge renumbered the bodies
+	if (evaluated != numBodies)
+	{
+		force_kick(team, 0, step == 1 && diag_due(1) ? pending + team->id : NULL);
+		if (team->id == 0)
+		{
+			evaluated = numBodies;
+		}
+	}
+
+	if (diag_due(step))
+	{
+		if (team->id == 0)
+		{
+			for (t = 0; t < team->size; t++)
+			{
+				diag_merge(sums, pending + t);
+				diag_clear(pending + t);
+			}
+		}
+		team_barrier(team);
+	}
+
+	share(team, numBodies, &lo, &hi);
+	for (s = 0; s < num_stages; s++)
+	{
+		double h = stage[s] * opt_dt;
+		int last = s == num_stages - 1;
+
+		for (i = lo; i < hi; i++)
+		{
+			bodies->vx[i] += accel_x[i] * 0.5 * h;
+			bodies->vy[i] += accel_y[i] * 0.5 * h;
+			bodies->x[i] = wrap(bodies->x[i] + bodies->vx[i] * h, x_min, univ_x);
+			bodies->y[i] = wrap(bodies->y[i] + bodies->vy[i] * h, y_min, univ_y);
+			assert(!(isnan(bodies->x[i]) || isnan(bodies->y[i])));
+		}
+		team_barrier(team);
+
+		force_kick(team, 0.5 * h, last && diag_due(step + 1) ? pending + team->id : NULL);
+	}
+
+	for (i = lo; i < hi; i++)
+	{
+		bodies_new->x[i] = bodies->x[i];
+		bodies_new->y[i] = bodies->y[i];
+		bodies_new->vx[i] = bodies->vx[i];
+		bodies_new->vy[i] = bodies->vy[i];
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* The bodies were sorted (nbody_reorder.c): slot k now holds the body that
+ * was in slot from[k]. The kept accelerations follow, so no force evaluation
+ * is repeated. Called by every thread of the team. */
+void integrate_permute(Team *team, const int *from)
+{
+	int lo, hi, k;
+
+	share(team, numBodies, &lo, &hi);
+	for (k = lo; k < hi; k++)
+	{
+		spare_x[k] = accel_x[from[k]];
+		spare_y[k] = accel_y[from[k]];
+	}
+	team_barrier(team);
+
+	if (team->id == 0)
+	{
+		double *tmp_x = accel_x;
+		double *tmp_y = accel_y;
+
+		accel_x = spare_x;
+		accel_y = spare_y;
+		spare_x = tmp_x;
+		spare_y = tmp_y;
+	}
+	team_barrier(team);
+
+	return;
+}
+
+void integrate_free()
+{
+	if (!symplectic)
+	{
+		return;
+	}
+
+	free(accel_x);
+	free(accel_y);
+	free(spare_x);
+	free(spare_y);
+	free(pending);
+}
@@ -0,0 +1,18 @@
+// nbody_integrate.h: Symplectic integrators shared by all n-body versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_INTEGRATE_H
+#define NBODY_INTEGRATE_H
+
+#include "nbody_accel.h"
+#include "nbody_diag.h"
+
+extern int symplectic;		/* 1 when the bodies are moved by integrate_step() (--integrator) */
+
+void integrate_init(int num_threads);
+void integrate_step(Team *team, int step, DiagSums *sums);
+void integrate_permute(Team *team, const int *from);
+void integrate_free();
+
+#endif
@@ -0,0 +1,1346 @@
+// nbody_kernel.c: Pairwise acceleration kernels shared by all n-body versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The scalar kernel is the original force loop from update(). The branches in
+// it (j == i, r != 0) keep gcc from vectorizing it even at -O3, so there are
+// hand vectorized versions for SSE2, AVX2+FMA and AVX-512. The vector versions
+// compute K*m/(r^2 * r) once per pair instead of one sqrt and three divides,
+// and mask out the pairs with r^2 == 0 instead of branching.
+// kernel_select() checks the CPU (cpuid) at startup and picks the widest one.
+// Each instruction set also has float kernels for --precision=single|mixed,
+// which do twice the pairs per vector; the mixed ones widen every term to
+// double before adding it up, so the rounding error of the sum stays that of
+// double and only the terms themselves are float.
+//
+// --rsqrt=n swaps the double kernels for ones that get 1/r from a reciprocal
+// square root estimate and n Newton-Raphson steps y' = y (3 - r^2 y^2) / 2, so
+// a pair is K*m * y^3 with multiplies only. The relative error e of y roughly
+// squares each step (e' = 1.5 e^2) until it reaches double rounding (~1e-16),
+// and the force of a pair is off by at most 3e relative to the exact kernel:
+//   estimate                          e0          0 steps  1 step  2 steps  3 steps
+//   avx512    rsqrt14                 2^-14       2e-4     2e-8    1e-15    1e-15
+//   avx2/sse2 float rsqrtps           1.5*2^-12   1e-3     6e-7    2e-13    1e-15
+//   scalar    exponent bit trick      0.035       0.1      5e-3    1e-5     1e-10
+// The error of a body's total acceleration is bounded by that times the sum of
+// the pair magnitudes, which is larger than the total when the pulls cancel.
+// The float estimate needs r^2 inside the float range, 1e-38 to 3e38.
+// Only accel_kernel has rsqrt versions, so accel_init() allows --rsqrt with
+// the direct and cell solvers in double precision only: the tile, pair and
+// float kernels and the far fields of bh and fmm always divide exactly.
+//
+// With a softening length eps (config file or --soft) every kernel uses
+// r^2 + eps^2 in place of r^2, the Plummer force K*m*d/(r^2 + eps^2)^(3/2).
+// The body itself then gives 0 * finite = 0 without a test, so the scalar
+// kernel is replaced by a branch-free one gcc can vectorize; the vector
+// kernels keep their r^2 == 0 mask, which never fires.
+//
+// The force laws other than gravity (law in the config file) are generated by
+// LAW_KERNEL from an expression for the factor f in a = f * (dx, dy). Each
+// law gets its own loop per instruction set, with K and the law constants
+// copied into locals before the loop, and gcc vectorizes it for that target.
+// The scalar one (--isa=scalar) is not vectorized and adds the pairs in order.
+// The laws, with km = K * m of the source:
+//   coulomb  f = -km / r^3                           repulsive inverse square
+//   lj       f = 12 km/sigma (s^3 - s^6) / r^2        s = sigma^2 / r^2, well at r = sigma
+//   yukawa   f = km exp(-r/range) (1 + r/range) / r^3  screened gravity
+//
+// Each double kernel has a twin, name_pot(), that also sums the potential
+// for the diagnostics (--diag): gravity -km/r, coulomb km/r, lj
+// km/sigma (s^6 - 2 s^3) and yukawa -km exp(-r/range)/r, with the softened r.
+// The body itself is left out by its distance, as a softened r^2 is never 0.
+// The twin's forces are bit for bit those of the kernel: KERNEL_TWINS builds
+// both from one loop for gravity, and a law's twin calls the law kernel.
+//
+// The compact storage kernels (COMPACT_KERNEL) are the gravity kernel on
+// fixed point positions: the difference of two offsets is converted to double
+// exactly and scaled to a distance, which gcc vectorizes like the laws.
+#include <assert.h>
+#include <immintrin.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_compact.h"
+
+AccelKernel accel_kernel;
+AccelTileKernel accel_tile_kernel;
+AccelKernelFloat accel_kernel_single;
+AccelKernelFloat accel_kernel_mixed;
+AccelKernelCompact accel_kernel_compact;
+AccelPotKernel accel_kernel_pot;
+const char *kernel_isa;
+
+static double eps2;			/* softening length squared */
+static double law_c1, law_c2;	/* constants of the force law, see LAW_KERNEL */
+static int newton_steps;	/* Newton-Raphson steps of the rsqrt kernels */
+static char isa_name[64];	/* kernel_isa with the rsqrt setting */
+static int isa_width;		/* 0 for scalar, 1 for sse2, 2 for avx2, 3 for avx512 */
+
+/* Every double gravity kernel kernel_select() can pick is written once as
+ * name_sum(), which also subtracts K*m/r of each source but the body itself
+ * from *pot when pot is not NULL. KERNEL_TWINS(name, attributes) defines name() as the
+ * AccelKernel and name_pot() as the AccelPotKernel on it: the forces of the
+ * two are summed by the same operations, so the --diag steps move the bodies
+ * exactly like the others. */
+#define KERNEL_TWINS(name, ...) \
+__attribute__((__VA_ARGS__)) \
+static void name(double x, double y, const double *sx, const double *sy, \
+				 const double *sm, int n, double *ax, double *ay) \
+{ \
+	name##_sum(x, y, sx, sy, sm, n, ax, ay, NULL); \
+} \
+\
+__attribute__((__VA_ARGS__)) \
+static void name##_pot(double x, double y, const double *sx, const double *sy, \
+					   const double *sm, int n, double *ax, double *ay, double *pot) \
+{ \
+	name##_sum(x, y, sx, sy, sm, n, ax, ay, pot); \
+}
+
+#define ANY_ISA		// No target attribute: plain x86-64
+
+/* Original loop, one pair at a time. Also does the leftover sources of the
+ * vector kernels. */
+__attribute__((always_inline))
+static inline void accel_scalar_sum(double x, double y, const double *sx, const double *sy,
+									const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	double k = K;
+	double sum_x = *ax;
+	double sum_y = *ay;
+	double sum_p = 0;
+	int j;
+
+	for (j = 0; j < n; j++)
+	{
+		double r, dx, dy, r_squared, acceleration;
+
+		dx = sx[j] - x;
+		dy = sy[j] - y;
+		r_squared = dx*dx + dy*dy + eps2;
+
+		if (r_squared != 0)
+		{
+			r = sqrt(r_squared);
+			acceleration = k*sm[j]/(r_squared);
+			sum_x += acceleration*dx/r;
+			sum_y += acceleration*dy/r;
+			if (pot != NULL && dx*dx + dy*dy != 0)
+			{
+				sum_p -= k*sm[j]/r;
+			}
+		}
+	}
+
+	*ax = sum_x;
+	*ay = sum_y;
+	if (pot != NULL)
+	{
+		*pot += sum_p;
+	}
+}
+
+KERNEL_TWINS(accel_scalar, ANY_ISA)
+
+/* Softened pairs one at a time, no branches */
+__attribute__((always_inline))
+static inline void soft_scalar_sum(double x, double y, const double *sx, const double *sy,
+								   const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	double k = K;
+	double sum_x = 0;
+	double sum_y = 0;
+	double sum_p = 0;
+	int j;
+
+	for (j = 0; j < n; j++)
+	{
+		double dx = sx[j] - x;
+		double dy = sy[j] - y;
+		double r_squared = dx*dx + dy*dy + eps2;
+		double r = __builtin_sqrt(r_squared);
+		double f = k * sm[j] / (r_squared * r);
+
+		sum_x += f * dx;
+		sum_y += f * dy;
+		if (pot != NULL && dx*dx + dy*dy != 0)
+		{
+			sum_p -= k * sm[j] / r;
+		}
+	}
+
+	*ax += sum_x;
+	*ay += sum_y;
+	if (pot != NULL)
+	{
+		*pot += sum_p;
+	}
+}
+
+KERNEL_TWINS(soft_scalar, ANY_ISA)
+
+/* 2 pairs per iteration */
+__attribute__((target("sse2"), always_inline))
+static inline void accel_sse2_sum(double x, double y, const double *sx, const double *sy,
+								  const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	__m128d vx = _mm_set1_pd(x);
+	__m128d vy = _mm_set1_pd(y);
+	__m128d vk = _mm_set1_pd(K);
+	__m128d veps2 = _mm_set1_pd(eps2);
+	__m128d zero = _mm_setzero_pd();
+	__m128d sum_x = zero;
+	__m128d sum_y = zero;
+	__m128d sum_p = zero;
+	double lanes[2];
+	int j;
+
+	for (j = 0; j + 2 <= n; j += 2)
+	{
+		__m128d dx = _mm_sub_pd(_mm_loadu_pd(sx + j), vx);
+		__m128d dy = _mm_sub_pd(_mm_loadu_pd(sy + j), vy);
+		__m128d r_squared = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), veps2);
+		__m128d nonzero = _mm_cmpneq_pd(r_squared, zero);
+		__m128d r = _mm_sqrt_pd(r_squared);
+		__m128d r_cubed = _mm_mul_pd(r_squared, r);
+		__m128d km = _mm_mul_pd(vk, _mm_loadu_pd(sm + j));
+
+		// 0/0 lanes give NaN, the mask turns them back into 0
+		__m128d f = _mm_div_pd(km, r_cubed);
+		f = _mm_and_pd(f, nonzero);
+		sum_x = _mm_add_pd(sum_x, _mm_mul_pd(f, dx));
+		sum_y = _mm_add_pd(sum_y, _mm_mul_pd(f, dy));
+
+		if (pot != NULL)
+		{
+			__m128d apart = _mm_cmpneq_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), zero);
+
+			sum_p = _mm_add_pd(sum_p, _mm_and_pd(_mm_div_pd(km, r), apart));
+		}
+	}
+
+	_mm_storeu_pd(lanes, sum_x);
+	*ax += lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, sum_y);
+	*ay += lanes[0] + lanes[1];
+	if (pot != NULL)
+	{
+		_mm_storeu_pd(lanes, sum_p);
+		*pot -= lanes[0] + lanes[1];
+	}
+
+	// Leftover sources
+	accel_scalar_sum(x, y, sx + j, sy + j, sm + j, n - j, ax, ay, pot);
+}
+
+KERNEL_TWINS(accel_sse2, target("sse2"))
+
+/* 4 pairs per iteration */
+__attribute__((target("avx2,fma"), always_inline))
+static inline void accel_avx2_sum(double x, double y, const double *sx, const double *sy,
+								  const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	__m256d vx = _mm256_set1_pd(x);
+	__m256d vy = _mm256_set1_pd(y);
+	__m256d vk = _mm256_set1_pd(K);
+	__m256d veps2 = _mm256_set1_pd(eps2);
+	__m256d zero = _mm256_setzero_pd();
+	__m256d sum_x = zero;
+	__m256d sum_y = zero;
+	__m256d sum_p = zero;
+	double lanes[4];
+	int j;
+
+	for (j = 0; j + 4 <= n; j += 4)
+	{
+		__m256d dx = _mm256_sub_pd(_mm256_loadu_pd(sx + j), vx);
+		__m256d dy = _mm256_sub_pd(_mm256_loadu_pd(sy + j), vy);
+		__m256d r_squared = _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dx, dx, veps2));
+		__m256d nonzero = _mm256_cmp_pd(r_squared, zero, _CMP_NEQ_OQ);
+		__m256d r = _mm256_sqrt_pd(r_squared);
+		__m256d r_cubed = _mm256_mul_pd(r_squared, r);
+		__m256d km = _mm256_mul_pd(vk, _mm256_loadu_pd(sm + j));
+
+		__m256d f = _mm256_div_pd(km, r_cubed);
+		f = _mm256_and_pd(f, nonzero);
+		sum_x = _mm256_fmadd_pd(f, dx, sum_x);
+		sum_y = _mm256_fmadd_pd(f, dy, sum_y);
+
+		if (pot != NULL)
+		{
+			__m256d apart = _mm256_cmp_pd(_mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)), zero, _CMP_NEQ_OQ);
+
+			sum_p = _mm256_add_pd(sum_p, _mm256_and_pd(_mm256_div_pd(km, r), apart));
+		}
+	}
+
+	_mm256_storeu_pd(lanes, sum_x);
+	*ax += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	_mm256_storeu_pd(lanes, sum_y);
+	*ay += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	if (pot != NULL)
+	{
+		_mm256_storeu_pd(lanes, sum_p);
+		*pot -= (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	}
+
+	accel_scalar_sum(x, y, sx + j, sy + j, sm + j, n - j, ax, ay, pot);
+}
+
+KERNEL_TWINS(accel_avx2, target("avx2,fma"))
+
+/* 8 pairs per iteration */
+__attribute__((target("avx512f"), always_inline))
+static inline void accel_avx512_sum(double x, double y, const double *sx, const double *sy,
+									const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	__m512d vx = _mm512_set1_pd(x);
+	__m512d vy = _mm512_set1_pd(y);
+	__m512d vk = _mm512_set1_pd(K);
+	__m512d veps2 = _mm512_set1_pd(eps2);
+	__m512d zero = _mm512_setzero_pd();
+	__m512d sum_x = zero;
+	__m512d sum_y = zero;
+	__m512d sum_p = zero;
+	int j;
+
+	for (j = 0; j + 8 <= n; j += 8)
+	{
+		__m512d dx = _mm512_sub_pd(_mm512_loadu_pd(sx + j), vx);
+		__m512d dy = _mm512_sub_pd(_mm512_loadu_pd(sy + j), vy);
+		__m512d r_squared = _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dx, dx, veps2));
+		__mmask8 nonzero = _mm512_cmp_pd_mask(r_squared, zero, _CMP_NEQ_OQ);
+		__m512d r = _mm512_sqrt_pd(r_squared);
+		__m512d r_cubed = _mm512_mul_pd(r_squared, r);
+		__m512d km = _mm512_mul_pd(vk, _mm512_loadu_pd(sm + j));
+
+		// Masked lanes are never divided, so no NaN to clean up
+		__m512d f = _mm512_maskz_div_pd(nonzero, km, r_cubed);
+		sum_x = _mm512_fmadd_pd(f, dx, sum_x);
+		sum_y = _mm512_fmadd_pd(f, dy, sum_y);
+
+		if (pot != NULL)
+		{
+			__mmask8 apart = _mm512_cmp_pd_mask(_mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)), zero, _CMP_NEQ_OQ);
+
+			sum_p = _mm512_add_pd(sum_p, _mm512_maskz_div_pd(apart, km, r));
+		}
+	}
+
+	*ax += _mm512_reduce_add_pd(sum_x);
+	*ay += _mm512_reduce_add_pd(sum_y);
+	if (pot != NULL)
+	{
+		*pot -= _mm512_reduce_add_pd(sum_p);
+	}
+
+	accel_scalar_sum(x, y, sx + j, sy + j, sm + j, n - j, ax, ay, pot);
+}
+
+KERNEL_TWINS(accel_avx512, target("avx512f"))
+
+/* Tile kernel in plain C, TILE_ROWS points against each source */
+static void tile_generic(const double *tx, const double *ty, int nt, const double *sx,
+						 const double *sy, const double *sm, int n, double *ax, double *ay)
+{
+	double k = K;
+	int t, j, r;
+
+	for (t = 0; t + TILE_ROWS <= nt; t += TILE_ROWS)
+	{
+		double sum_x[TILE_ROWS] = {0};
+		double sum_y[TILE_ROWS] = {0};
+
+		for (j = 0; j < n; j++)
+		{
+			double km = k * sm[j];
+			for (r = 0; r < TILE_ROWS; r++)
+			{
+				double dx = sx[j] - tx[t + r];
+				double dy = sy[j] - ty[t + r];
+				double r_squared = dx*dx + dy*dy + eps2;
+				double f = r_squared != 0 ? km / (r_squared * sqrt(r_squared)) : 0;
+
+				sum_x[r] += f * dx;
+				sum_y[r] += f * dy;
+			}
+		}
+
+		for (r = 0; r < TILE_ROWS; r++)
+		{
+			ax[t + r] += sum_x[r];
+			ay[t + r] += sum_y[r];
+		}
+	}
+
+	for (; t < nt; t++)
+	{
+		accel_kernel(tx[t], ty[t], sx, sy, sm, n, ax + t, ay + t);
+	}
+}
+
+/* Tile kernel, 4 points x 4 sources per iteration */
+__attribute__((target("avx2,fma")))
+static void tile_avx2(const double *tx, const double *ty, int nt, const double *sx,
+					  const double *sy, const double *sm, int n, double *ax, double *ay)
+{
+	__m256d vk = _mm256_set1_pd(K);
+	__m256d veps2 = _mm256_set1_pd(eps2);
+	__m256d zero = _mm256_setzero_pd();
+	double lanes[4];
+	int t, j, r;
+
+	for (t = 0; t + TILE_ROWS <= nt; t += TILE_ROWS)
+	{
+		__m256d px[TILE_ROWS], py[TILE_ROWS], sum_x[TILE_ROWS], sum_y[TILE_ROWS];
+
+		for (r = 0; r < TILE_ROWS; r++)
+		{
+			px[r] = _mm256_set1_pd(tx[t + r]);
+			py[r] = _mm256_set1_pd(ty[t + r]);
+			sum_x[r] = sum_y[r] = zero;
+		}
+
+		for (j = 0; j + 4 <= n; j += 4)
+		{
+			__m256d vx = _mm256_loadu_pd(sx + j);
+			__m256d vy = _mm256_loadu_pd(sy + j);
+			__m256d km = _mm256_mul_pd(vk, _mm256_loadu_pd(sm + j));
+
+			for (r = 0; r < TILE_ROWS; r++)
+			{
+				__m256d dx = _mm256_sub_pd(vx, px[r]);
+				__m256d dy = _mm256_sub_pd(vy, py[r]);
+				__m256d r_squared = _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dx, dx, veps2));
+				__m256d nonzero = _mm256_cmp_pd(r_squared, zero, _CMP_NEQ_OQ);
+				__m256d f = _mm256_div_pd(km, _mm256_mul_pd(r_squared, _mm256_sqrt_pd(r_squared)));
+
+				f = _mm256_and_pd(f, nonzero);
+				sum_x[r] = _mm256_fmadd_pd(f, dx, sum_x[r]);
+				sum_y[r] = _mm256_fmadd_pd(f, dy, sum_y[r]);
+			}
+		}
+
+		for (r = 0; r < TILE_ROWS; r++)
+		{
+			_mm256_storeu_pd(lanes, sum_x[r]);
+			ax[t + r] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			_mm256_storeu_pd(lanes, sum_y[r]);
+			ay[t + r] += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			accel_scalar(tx[t + r], ty[t + r], sx + j, sy + j, sm + j, n - j, ax + t + r, ay + t + r);
+		}
+	}
+
+	for (; t < nt; t++)
+	{
+		accel_avx2(tx[t], ty[t], sx, sy, sm, n, ax + t, ay + t);
+	}
+}
+
+/* Tile kernel, 4 points x 8 sources per iteration */
+__attribute__((target("avx512f")))
+static void tile_avx512(const double *tx, const double *ty, int nt, const double *sx,
+						const double *sy, const double *sm, int n, double *ax, double *ay)
+{
+	__m512d vk = _mm512_set1_pd(K);
+	__m512d veps2 = _mm512_set1_pd(eps2);
+	__m512d zero = _mm512_setzero_pd();
+	int t, j, r;
+
+	for (t = 0; t + TILE_ROWS <= nt; t += TILE_ROWS)
+	{
+		__m512d px[TILE_ROWS], py[TILE_ROWS], sum_x[TILE_ROWS], sum_y[TILE_ROWS];
+
+		for (r = 0; r < TILE_ROWS; r++)
+		{
+			px[r] = _mm512_set1_pd(tx[t + r]);
+			py[r] = _mm512_set1_pd(ty[t + r]);
+			sum_x[r] = sum_y[r] = zero;
+		}
+
+		for (j = 0; j + 8 <= n; j += 8)
+		{
+			__m512d vx = _mm512_loadu_pd(sx + j);
+			__m512d vy = _mm512_loadu_pd(sy + j);
+			__m512d km = _mm512_mul_pd(vk, _mm512_loadu_pd(sm + j));
+
+			for (r = 0; r < TILE_ROWS; r++)
+			{
+				__m512d dx = _mm512_sub_pd(vx, px[r]);
+				__m512d dy = _mm512_sub_pd(vy, py[r]);
+				__m512d r_squared = _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dx, dx, veps2));
+				__mmask8 nonzero = _mm512_cmp_pd_mask(r_squared, zero, _CMP_NEQ_OQ);
+				__m512d f = _mm512_maskz_div_pd(nonzero, km, _mm512_mul_pd(r_squared, _mm512_sqrt_pd(r_squared)));
+
+				sum_x[r] = _mm512_fmadd_pd(f, dx, sum_x[r]);
+				sum_y[r] = _mm512_fmadd_pd(f, dy, sum_y[r]);
+			}
+		}
+
+		for (r = 0; r < TILE_ROWS; r++)
+		{
+			ax[t + r] += _mm512_reduce_add_pd(sum_x[r]);
+			ay[t + r] += _mm512_reduce_add_pd(sum_y[r]);
+			accel_scalar(tx[t + r], ty[t + r], sx + j, sy + j, sm + j, n - j, ax + t + r, ay + t + r);
+		}
+	}
+
+	for (; t < nt; t++)
+	{
+		accel_avx512(tx[t], ty[t], sx, sy, sm, n, ax + t, ay + t);
+	}
+}
+
+/* Float pairs one at a time, summed in float */
+static void single_scalar(float x, float y, const float *sx, const float *sy,
+						  const float *sm, int n, double *ax, double *ay)
+{
+	float k = K;
+	float eps_squared = eps2;
+	float sum_x = 0;
+	float sum_y = 0;
+	int j;
+
+	for (j = 0; j < n; j++)
+	{
+		float dx = sx[j] - x;
+		float dy = sy[j] - y;
+		float r_squared = dx*dx + dy*dy + eps_squared;
+
+		if (r_squared != 0)
+		{
+			float f = k*sm[j]/(r_squared*sqrtf(r_squared));
+			sum_x += f*dx;
+			sum_y += f*dy;
+		}
+	}
+
+	*ax += sum_x;
+	*ay += sum_y;
+}
+
+/* Float pairs one at a time, summed in double */
+static void mixed_scalar(float x, float y, const float *sx, const float *sy,
+						 const float *sm, int n, double *ax, double *ay)
+{
+	float k = K;
+	float eps_squared = eps2;
+	double sum_x = 0;
+	double sum_y = 0;
+	int j;
+
+	for (j = 0; j < n; j++)
+	{
+		float dx = sx[j] - x;
+		float dy = sy[j] - y;
+		float r_squared = dx*dx + dy*dy + eps_squared;
+
+		if (r_squared != 0)
+		{
+			float f = k*sm[j]/(r_squared*sqrtf(r_squared));
+			sum_x += f*dx;
+			sum_y += f*dy;
+		}
+	}
+
+	*ax += sum_x;
+	*ay += sum_y;
+}
+
+/* 4 float pairs per iteration. Returns the per-lane terms f*dx and f*dy of the
+ * sources j .. j + 3 through tx and ty. */
+__attribute__((target("sse2")))
+static inline void terms_sse2(__m128 vx, __m128 vy, __m128 vk, const float *sx, const float *sy,
+							  const float *sm, __m128 *tx, __m128 *ty)
+{
+	__m128 veps2 = _mm_set1_ps(eps2);
+	__m128 dx = _mm_sub_ps(_mm_loadu_ps(sx), vx);
+	__m128 dy = _mm_sub_ps(_mm_loadu_ps(sy), vy);
+	__m128 r_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), veps2);
+	__m128 nonzero = _mm_cmpneq_ps(r_squared, _mm_setzero_ps());
+	__m128 f = _mm_div_ps(_mm_mul_ps(vk, _mm_loadu_ps(sm)), _mm_mul_ps(r_squared, _mm_sqrt_ps(r_squared)));
+
+	f = _mm_and_ps(f, nonzero);
+	*tx = _mm_mul_ps(f, dx);
+	*ty = _mm_mul_ps(f, dy);
+}
+
+__attribute__((target("sse2")))
+static void single_sse2(float x, float y, const float *sx, const float *sy,
+						const float *sm, int n, double *ax, double *ay)
+{
+	__m128 vx = _mm_set1_ps(x);
+	__m128 vy = _mm_set1_ps(y);
+	__m128 vk = _mm_set1_ps(K);
+	__m128 sum_x = _mm_setzero_ps();
+	__m128 sum_y = _mm_setzero_ps();
+	float lanes[4];
+	int j;
+
+	for (j = 0; j + 4 <= n; j += 4)
+	{
+		__m128 tx, ty;
+
+		terms_sse2(vx, vy, vk, sx + j, sy + j, sm + j, &tx, &ty);
+		sum_x = _mm_add_ps(sum_x, tx);
+		sum_y = _mm_add_ps(sum_y, ty);
+	}
+
+	_mm_storeu_ps(lanes, sum_x);
+	*ax += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	_mm_storeu_ps(lanes, sum_y);
+	*ay += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+	single_scalar(x, y, sx + j, sy + j, sm + j, n - j, ax, ay);
+}
+
+__attribute__((target("sse2")))
+static void mixed_sse2(float x, float y, const float *sx, const float *sy,
+					   const float *sm, int n, double *ax, double *ay)
+{
+	__m128 vx = _mm_set1_ps(x);
+	__m128 vy = _mm_set1_ps(y);
+	__m128 vk = _mm_set1_ps(K);
+	__m128d sum_x = _mm_setzero_pd();
+	__m128d sum_y = _mm_setzero_pd();
+	double lanes[2];
+	int j;
+
+	for (j = 0; j + 4 <= n; j += 4)
+	{
+		__m128 tx, ty;
+
+		terms_sse2(vx, vy, vk, sx + j, sy + j, sm + j, &tx, &ty);
+		// Low and high halves widened to double before they are summed
+		sum_x = _mm_add_pd(sum_x, _mm_add_pd(_mm_cvtps_pd(tx), _mm_cvtps_pd(_mm_movehl_ps(tx, tx))));
+		sum_y = _mm_add_pd(sum_y, _mm_add_pd(_mm_cvtps_pd(ty), _mm_cvtps_pd(_mm_movehl_ps(ty, ty))));
+	}
+
+	_mm_storeu_pd(lanes, sum_x);
+	*ax += lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, sum_y);
+	*ay += lanes[0] + lanes[1];
+
+	mixed_scalar(x, y, sx + j, sy + j, sm + j, n - j, ax, ay);
+}
+
+/* 8 float pairs per iteration */
+__attribute__((target("avx2,fma")))
+static inline void terms_avx2(__m256 vx, __m256 vy, __m256 vk, const float *sx, const float *sy,
+							  const float *sm, __m256 *tx, __m256 *ty)
+{
+	__m256 veps2 = _mm256_set1_ps(eps2);
+	__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(sx), vx);
+	__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(sy), vy);
+	__m256 r_squared = _mm256_fmadd_ps(dy, dy, _mm256_fmadd_ps(dx, dx, veps2));
+	__m256 nonzero = _mm256_cmp_ps(r_squared, _mm256_setzero_ps(), _CMP_NEQ_OQ);
+	__m256 f = _mm256_div_ps(_mm256_mul_ps(vk, _mm256_loadu_ps(sm)),
+							 _mm256_mul_ps(r_squared, _mm256_sqrt_ps(r_squared)));
+
+	f = _mm256_and_ps(f, nonzero);
+	*tx = _mm256_mul_ps(f, dx);
+	*ty = _mm256_mul_ps(f, dy);
+}
+
+__attribute__((target("avx2,fma")))
+static void single_avx2(float x, float y, const float *sx, const float *sy,
+						const float *sm, int n, double *ax, double *ay)
+{
+	__m256 vx = _mm256_set1_ps(x);
+	__m256 vy = _mm256_set1_ps(y);
+	__m256 vk = _mm256_set1_ps(K);
+	__m256 sum_x = _mm256_setzero_ps();
+	__m256 sum_y = _mm256_setzero_ps();
+	float lanes[8];
+	int j, l;
+
+	for (j = 0; j + 8 <= n; j += 8)
+	{
+		__m256 tx, ty;
+
+		terms_avx2(vx, vy, vk, sx + j, sy + j, sm + j, &tx, &ty);
+		sum_x = _mm256_add_ps(sum_x, tx);
+		sum_y = _mm256_add_ps(sum_y, ty);
+	}
+
+	_mm256_storeu_ps(lanes, sum_x);
+	for (l = 0; l < 8; l++)
+	{
+		*ax += lanes[l];
+	}
+	_mm256_storeu_ps(lanes, sum_y);
+	for (l = 0; l < 8; l++)
+	{
+		*ay += lanes[l];
+	}
+
+	single_scalar(x, y, sx + j, sy + j, sm + j, n - j, ax, ay);
+}
+
+__attribute__((target("avx2,fma")))
+static void mixed_avx2(float x, float y, const float *sx, const float *sy,
+					   const float *sm, int n, double *ax, double *ay)
+{
+	__m256 vx = _mm256_set1_ps(x);
+	__m256 vy = _mm256_set1_ps(y);
+	__m256 vk = _mm256_set1_ps(K);
+	__m256d sum_x = _mm256_setzero_pd();
+	__m256d sum_y = _mm256_setzero_pd();
+	double lanes[4];
+	int j;
+
+	for (j = 0; j + 8 <= n; j += 8)
+	{
+		__m256 tx, ty;
+
+		terms_avx2(vx, vy, vk, sx + j, sy + j, sm + j, &tx, &ty);
+		sum_x = _mm256_add_pd(sum_x, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(tx)),
+												   _mm256_cvtps_pd(_mm256_extractf128_ps(tx, 1))));
+		sum_y = _mm256_add_pd(sum_y, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(ty)),
+												   _mm256_cvtps_pd(_mm256_extractf128_ps(ty, 1))));
+	}
+
+	_mm256_storeu_pd(lanes, sum_x);
+	*ax += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	_mm256_storeu_pd(lanes, sum_y);
+	*ay += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+	mixed_scalar(x, y, sx + j, sy + j, sm + j, n - j, ax, ay);
+}
+
+/* 16 float pairs per iteration */
+__attribute__((target("avx512f")))
+static inline void terms_avx512(__m512 vx, __m512 vy, __m512 vk, const float *sx, const float *sy,
+								const float *sm, __m512 *tx, __m512 *ty)
+{
+	__m512 veps2 = _mm512_set1_ps(eps2);
+	__m512 dx = _mm512_sub_ps(_mm512_loadu_ps(sx), vx);
+	__m512 dy = _mm512_sub_ps(_mm512_loadu_ps(sy), vy);
+	__m512 r_squared = _mm512_fmadd_ps(dy, dy, _mm512_fmadd_ps(dx, dx, veps2));
+	__mmask16 nonzero = _mm512_cmp_ps_mask(r_squared, _mm512_setzero_ps(), _CMP_NEQ_OQ);
+	__m512 f = _mm512_maskz_div_ps(nonzero, _mm512_mul_ps(vk, _mm512_loadu_ps(sm)),
+								   _mm512_mul_ps(r_squared, _mm512_sqrt_ps(r_squared)));
+
+	*tx = _mm512_mul_ps(f, dx);
+	*ty = _mm512_mul_ps(f, dy);
+}
+
+/* Upper 8 floats of a vector widened to double */
+__attribute__((target("avx512f")))
+static inline __m512d high_pd(__m512 v)
+{
+	return _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
+
+__attribute__((target("avx512f")))
+static void single_avx512(float x, float y, const float *sx, const float *sy,
+						  const float *sm, int n, double *ax, double *ay)
+{
+	__m512 vx = _mm512_set1_ps(x);
+	__m512 vy = _mm512_set1_ps(y);
+	__m512 vk = _mm512_set1_ps(K);
+	__m512 sum_x = _mm512_setzero_ps();
+	__m512 sum_y = _mm512_setzero_ps();
+	int j;
+
+	for (j = 0; j + 16 <= n; j += 16)
+	{
+		__m512 tx, ty;
+
+		terms_avx512(vx, vy, vk, sx + j, sy + j, sm + j, &tx, &ty);
+		sum_x = _mm512_add_ps(sum_x, tx);
+		sum_y = _mm512_add_ps(sum_y, ty);
+	}
+
+	*ax += _mm512_reduce_add_ps(sum_x);
+	*ay += _mm512_reduce_add_ps(sum_y);
+
+	single_scalar(x, y, sx + j, sy + j, sm + j, n - j, ax, ay);
+}
+
+__attribute__((target("avx512f")))
+static void mixed_avx512(float x, float y, const float *sx, const float *sy,
+						 const float *sm, int n, double *ax, double *ay)
+{
+	__m512 vx = _mm512_set1_ps(x);
+	__m512 vy = _mm512_set1_ps(y);
+	__m512 vk = _mm512_set1_ps(K);
+	__m512d sum_x = _mm512_setzero_pd();
+	__m512d sum_y = _mm512_setzero_pd();
+	int j;
+
+	for (j = 0; j + 16 <= n; j += 16)
+	{
+		__m512 tx, ty;
+
+		terms_avx512(vx, vy, vk, sx + j, sy + j, sm + j, &tx, &ty);
+		sum_x = _mm512_add_pd(sum_x, _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(tx)), high_pd(tx)));
+		sum_y = _mm512_add_pd(sum_y, _mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(ty)), high_pd(ty)));
+	}
+
+	*ax += _mm512_reduce_add_pd(sum_x);
+	*ay += _mm512_reduce_add_pd(sum_y);
+
+	mixed_scalar(x, y, sx + j, sy + j, sm + j, n - j, ax, ay);
+}
+
+/* Reciprocal square root estimate and Newton steps, one pair at a time */
+__attribute__((always_inline))
+static inline void rsqrt_scalar_sum(double x, double y, const double *sx, const double *sy,
+									const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	double k = K;
+	double sum_x = 0;
+	double sum_y = 0;
+	double sum_p = 0;
+	int j, s;
+
+	for (j = 0; j < n; j++)
+	{
+		double dx = sx[j] - x;
+		double dy = sy[j] - y;
+		double r_squared = dx*dx + dy*dy + eps2;
+
+		if (r_squared != 0)
+		{
+			union { double d; uint64_t i; } bits = { r_squared };
+			double r_inv, half = 0.5 * r_squared;
+
+			// Halving the exponent gives sqrt; this constant also minimizes the error of the mantissa
+			bits.i = 0x5fe6eb50c7b537a9ULL - (bits.i >> 1);
+			r_inv = bits.d;
+			for (s = 0; s < newton_steps; s++)
+			{
+				r_inv = r_inv * (1.5 - half * r_inv * r_inv);
+			}
+
+			sum_x += k * sm[j] * r_inv * r_inv * r_inv * dx;
+			sum_y += k * sm[j] * r_inv * r_inv * r_inv * dy;
+			if (pot != NULL && dx*dx + dy*dy != 0)
+			{
+				sum_p -= k * sm[j] * r_inv;
+			}
+		}
+	}
+
+	*ax += sum_x;
+	*ay += sum_y;
+	if (pot != NULL)
+	{
+		*pot += sum_p;
+	}
+}
+
+KERNEL_TWINS(rsqrt_scalar, ANY_ISA)
+
+/* 2 pairs per iteration, estimate from the float rsqrtps */
+__attribute__((target("sse2"), always_inline))
+static inline void rsqrt_sse2_sum(double x, double y, const double *sx, const double *sy,
+								  const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	__m128d vx = _mm_set1_pd(x);
+	__m128d vy = _mm_set1_pd(y);
+	__m128d vk = _mm_set1_pd(K);
+	__m128d veps2 = _mm_set1_pd(eps2);
+	__m128d zero = _mm_setzero_pd();
+	__m128d three_halves = _mm_set1_pd(1.5);
+	__m128d one_half = _mm_set1_pd(0.5);
+	__m128d sum_x = zero;
+	__m128d sum_y = zero;
+	__m128d sum_p = zero;
+	double lanes[2];
+	int j, s;
+
+	// Leftover sources are done in the last iteration, so they get the same
+	// estimate as the others. Empty lanes sit on (x, y) and are masked out.
+	for (j = 0; j < n; j += 2)
+	{
+		int full = j + 2 <= n;
+		__m128d dx = _mm_sub_pd(full ? _mm_loadu_pd(sx + j) : _mm_loadl_pd(vx, sx + j), vx);
+		__m128d dy = _mm_sub_pd(full ? _mm_loadu_pd(sy + j) : _mm_loadl_pd(vy, sy + j), vy);
+		__m128d mass = full ? _mm_loadu_pd(sm + j) : _mm_load_sd(sm + j);
+		__m128d r_squared = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), veps2);
+		__m128d half = _mm_mul_pd(one_half, r_squared);
+		__m128d r_inv = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(r_squared)));
+		__m128d km, f;
+
+		for (s = 0; s < newton_steps; s++)
+		{
+			r_inv = _mm_mul_pd(r_inv, _mm_sub_pd(three_halves, _mm_mul_pd(half, _mm_mul_pd(r_inv, r_inv))));
+		}
+
+		// r^2 == 0 gives inf * 0 = NaN, the mask turns it back into 0
+		km = _mm_mul_pd(vk, mass);
+		f = _mm_mul_pd(km, _mm_mul_pd(r_inv, _mm_mul_pd(r_inv, r_inv)));
+		f = _mm_and_pd(f, _mm_cmpneq_pd(r_squared, zero));
+		sum_x = _mm_add_pd(sum_x, _mm_mul_pd(f, dx));
+		sum_y = _mm_add_pd(sum_y, _mm_mul_pd(f, dy));
+
+		if (pot != NULL)
+		{
+			__m128d apart = _mm_cmpneq_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), zero);
+
+			sum_p = _mm_add_pd(sum_p, _mm_and_pd(_mm_mul_pd(km, r_inv), apart));
+		}
+	}
+
+	_mm_storeu_pd(lanes, sum_x);
+	*ax += lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, sum_y);
+	*ay += lanes[0] + lanes[1];
+	if (pot != NULL)
+	{
+		_mm_storeu_pd(lanes, sum_p);
+		*pot -= lanes[0] + lanes[1];
+	}
+}
+
+KERNEL_TWINS(rsqrt_sse2, target("sse2"))
+
+/* 4 pairs per iteration, estimate from the float rsqrtps */
+__attribute__((target("avx2,fma"), always_inline))
+static inline void rsqrt_avx2_sum(double x, double y, const double *sx, const double *sy,
+								  const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	__m256d vx = _mm256_set1_pd(x);
+	__m256d vy = _mm256_set1_pd(y);
+	__m256d vk = _mm256_set1_pd(K);
+	__m256d veps2 = _mm256_set1_pd(eps2);
+	__m256d zero = _mm256_setzero_pd();
+	__m256d three_halves = _mm256_set1_pd(1.5);
+	__m256d one_half = _mm256_set1_pd(0.5);
+	__m256d sum_x = zero;
+	__m256d sum_y = zero;
+	__m256d sum_p = zero;
+	double lanes[4];
+	int j, s;
+
+	for (j = 0; j < n; j += 4)
+	{
+		__m256d px, py, mass, dx, dy, r_squared, half, r_inv, km, f;
+
+		if (j + 4 <= n)
+		{
+			px = _mm256_loadu_pd(sx + j);
+			py = _mm256_loadu_pd(sy + j);
+			mass = _mm256_loadu_pd(sm + j);
+		}
+		else
+		{
+			// Leftover sources; empty lanes sit on (x, y) and are masked out
+			__m256i live = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - j), _mm256_setr_epi64x(0, 1, 2, 3));
+			px = _mm256_blendv_pd(vx, _mm256_maskload_pd(sx + j, live), _mm256_castsi256_pd(live));
+			py = _mm256_blendv_pd(vy, _mm256_maskload_pd(sy + j, live), _mm256_castsi256_pd(live));
+			mass = _mm256_maskload_pd(sm + j, live);
+		}
+
+		dx = _mm256_sub_pd(px, vx);
+		dy = _mm256_sub_pd(py, vy);
+		r_squared = _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dx, dx, veps2));
+		half = _mm256_mul_pd(one_half, r_squared);
+		r_inv = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r_squared)));
+
+		for (s = 0; s < newton_steps; s++)
+		{
+			r_inv = _mm256_mul_pd(r_inv, _mm256_fnmadd_pd(half, _mm256_mul_pd(r_inv, r_inv), three_halves));
+		}
+
+		km = _mm256_mul_pd(vk, mass);
+		f = _mm256_mul_pd(km, _mm256_mul_pd(r_inv, _mm256_mul_pd(r_inv, r_inv)));
+		f = _mm256_and_pd(f, _mm256_cmp_pd(r_squared, zero, _CMP_NEQ_OQ));
+		sum_x = _mm256_fmadd_pd(f, dx, sum_x);
+		sum_y = _mm256_fmadd_pd(f, dy, sum_y);
+
+		if (pot != NULL)
+		{
+			__m256d apart = _mm256_cmp_pd(_mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)), zero, _CMP_NEQ_OQ);
+
+			sum_p = _mm256_add_pd(sum_p, _mm256_and_pd(_mm256_mul_pd(km, r_inv), apart));
+		}
+	}
+
+	_mm256_storeu_pd(lanes, sum_x);
+	*ax += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	_mm256_storeu_pd(lanes, sum_y);
+	*ay += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	if (pot != NULL)
+	{
+		_mm256_storeu_pd(lanes, sum_p);
+		*pot -= (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	}
+}
+
+KERNEL_TWINS(rsqrt_avx2, target("avx2,fma"))
+
+/* 8 pairs per iteration, estimate from rsqrt14 */
+__attribute__((target("avx512f"), always_inline))
+static inline void rsqrt_avx512_sum(double x, double y, const double *sx, const double *sy,
+									const double *sm, int n, double *ax, double *ay, double *pot)
+{
+	__m512d vx = _mm512_set1_pd(x);
+	__m512d vy = _mm512_set1_pd(y);
+	__m512d vk = _mm512_set1_pd(K);
+	__m512d veps2 = _mm512_set1_pd(eps2);
+	__m512d zero = _mm512_setzero_pd();
+	__m512d three_halves = _mm512_set1_pd(1.5);
+	__m512d one_half = _mm512_set1_pd(0.5);
+	__m512d sum_x = zero;
+	__m512d sum_y = zero;
+	__m512d sum_p = zero;
+	int j, s;
+
+	for (j = 0; j < n; j += 8)
+	{
+		// Leftover sources use a partial mask; empty lanes sit on (x, y) and are masked out
+		__mmask8 live = n - j >= 8 ? 0xff : (1 << (n - j)) - 1;
+		__m512d dx = _mm512_sub_pd(_mm512_mask_loadu_pd(vx, live, sx + j), vx);
+		__m512d dy = _mm512_sub_pd(_mm512_mask_loadu_pd(vy, live, sy + j), vy);
+		__m512d r_squared = _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dx, dx, veps2));
+		__mmask8 nonzero = _mm512_cmp_pd_mask(r_squared, zero, _CMP_NEQ_OQ);
+		__m512d half = _mm512_mul_pd(one_half, r_squared);
+		__m512d r_inv = _mm512_rsqrt14_pd(r_squared);
+		__m512d km, f;
+
+		for (s = 0; s < newton_steps; s++)
+		{
+			r_inv = _mm512_mul_pd(r_inv, _mm512_fnmadd_pd(half, _mm512_mul_pd(r_inv, r_inv), three_halves));
+		}
+
+		km = _mm512_mul_pd(vk, _mm512_maskz_loadu_pd(live, sm + j));
+		f = _mm512_maskz_mul_pd(nonzero, km, _mm512_mul_pd(r_inv, _mm512_mul_pd(r_inv, r_inv)));
+		sum_x = _mm512_fmadd_pd(f, dx, sum_x);
+		sum_y = _mm512_fmadd_pd(f, dy, sum_y);
+
+		if (pot != NULL)
+		{
+			__mmask8 apart = _mm512_cmp_pd_mask(_mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)), zero, _CMP_NEQ_OQ);
+
+			sum_p = _mm512_add_pd(sum_p, _mm512_maskz_mul_pd(apart, km, r_inv));
+		}
+	}
+
+	*ax += _mm512_reduce_add_pd(sum_x);
+	*ay += _mm512_reduce_add_pd(sum_y);
+	if (pot != NULL)
+	{
+		*pot -= _mm512_reduce_add_pd(sum_p);
+	}
+}
+
+KERNEL_TWINS(rsqrt_avx512, target("avx512f"))
+
+/* Attributes of the generated kernels: VECTOR_LOOP(isa) lets gcc vectorize the
+ * loop for the instruction set isa, reassociating the sums; SCALAR_LOOP keeps
+ * it one pair at a time, in source order, like accel_scalar(). */
+#define VECTOR_LOOP(isa) target(isa), optimize("O3", "associative-math", "no-signed-zeros", "no-trapping-math")
+#define SCALAR_LOOP optimize("no-tree-vectorize")
+
+/* Define name() with the attributes ATTR, in which f is set by the statement
+ * LAW from r_squared and km, and name_pot() on it, which adds the potential p
+ * of each pair, set by POT after LAW, in a loop of its own. c1 and c2 are the
+ * law constants. The r^2 == 0 select compiles to a blend, not a branch, and
+ * sqrt is only vectorized when it need not set errno. name_pot() calls name()
+ * for the forces instead of being its KERNEL_TWINS: gcc may reassociate the
+ * sums of a fused loop differently, and the --diag steps must move the bodies
+ * exactly like the others. */
+#define LAW_KERNEL(name, ATTR, LAW, POT) \
+__attribute__((ATTR, noinline)) \
+static void name(double x, double y, const double *sx, const double *sy, \
+				 const double *sm, int n, double *ax, double *ay) \
+{ \
+	const double k = K; \
+	const double eps_squared = eps2; \
+	const double c1 = law_c1; \
+	const double c2 = law_c2; \
+	double sum_x = 0; \
+	double sum_y = 0; \
+	int j; \
+\
+	(void)c1; \
+	(void)c2; \
+	for (j = 0; j < n; j++) \
+	{ \
+		double dx = sx[j] - x; \
+		double dy = sy[j] - y; \
+		double r_squared = dx*dx + dy*dy + eps_squared; \
+		double km = k * sm[j]; \
+		double f; \
+\
+		LAW; \
+		f = r_squared != 0 ? f : 0; \
+		sum_x += f * dx; \
+		sum_y += f * dy; \
+	} \
+\
+	*ax += sum_x; \
+	*ay += sum_y; \
+} \
+\
+__attribute__((ATTR)) \
+static void name##_pot(double x, double y, const double *sx, const double *sy, \
+					   const double *sm, int n, double *ax, double *ay, double *pot) \
+{ \
+	const double k = K; \
+	const double eps_squared = eps2; \
+	const double c1 = law_c1; \
+	const double c2 = law_c2; \
+	double sum_p = 0; \
+	int j; \
+\
+	(void)c1; \
+	(void)c2; \
+	name(x, y, sx, sy, sm, n, ax, ay); \
+	for (j = 0; j < n; j++) \
+	{ \
+		double dx = sx[j] - x; \
+		double dy = sy[j] - y; \
+		double d_squared = dx*dx + dy*dy; \
+		double r_squared = d_squared + eps_squared; \
+		double km = k * sm[j]; \
+		double f, p; \
+\
+		LAW; \
+		POT; \
+		(void)f; \
+		sum_p += d_squared != 0 ? p : 0; \
+	} \
+\
+	*pot += sum_p; \
+}
+
+#define COULOMB_LAW f = -km / (r_squared * sqrt(r_squared))
+#define COULOMB_POT p = km / sqrt(r_squared)
+#define LJ_LAW \
+	double s = c1 / r_squared; \
+	double s3 = s * s * s; \
+	f = c2 * km * (s3 - s3 * s3) / r_squared
+#define LJ_POT p = c2 * km * (s3 * s3 - 2 * s3) / 12
+#define YUKAWA_LAW \
+	double r = sqrt(r_squared); \
+	f = km * exp(-r * c1) * (1 + r * c1) / (r_squared * r)
+#define YUKAWA_POT p = -km * exp(-r * c1) / r
+
+LAW_KERNEL(coulomb_scalar, SCALAR_LOOP, COULOMB_LAW, COULOMB_POT)
+LAW_KERNEL(coulomb_sse2, VECTOR_LOOP("sse2"), COULOMB_LAW, COULOMB_POT)
+LAW_KERNEL(coulomb_avx2, VECTOR_LOOP("avx2,fma"), COULOMB_LAW, COULOMB_POT)
+LAW_KERNEL(coulomb_avx512, VECTOR_LOOP("avx512f"), COULOMB_LAW, COULOMB_POT)
+LAW_KERNEL(lj_scalar, SCALAR_LOOP, LJ_LAW, LJ_POT)
+LAW_KERNEL(lj_sse2, VECTOR_LOOP("sse2"), LJ_LAW, LJ_POT)
+LAW_KERNEL(lj_avx2, VECTOR_LOOP("avx2,fma"), LJ_LAW, LJ_POT)
+LAW_KERNEL(lj_avx512, VECTOR_LOOP("avx512f"), LJ_LAW, LJ_POT)
+LAW_KERNEL(yukawa_scalar, SCALAR_LOOP, YUKAWA_LAW, YUKAWA_POT)
+LAW_KERNEL(yukawa_sse2, VECTOR_LOOP("sse2"), YUKAWA_LAW, YUKAWA_POT)
+LAW_KERNEL(yukawa_avx2, VECTOR_LOOP("avx2,fma"), YUKAWA_LAW, YUKAWA_POT)
+LAW_KERNEL(yukawa_avx512, VECTOR_LOOP("avx512f"), YUKAWA_LAW, YUKAWA_POT)
+
+/* Define name() as an AccelKernelCompact with the attributes ATTR */
+#define COMPACT_KERNEL(name, ATTR) \
+__attribute__((ATTR)) \
+static void name(int32_t x, int32_t y, const int32_t *sx, const int32_t *sy, \
+				 const double *sm, int n, double *ax, double *ay) \
+{ \
+	const double k = K; \
+	const double eps_squared = eps2; \
+	const double hx = fixed_hx; \
+	const double hy = fixed_hy; \
+	const double x0 = x; \
+	const double y0 = y; \
+	double sum_x = 0; \
+	double sum_y = 0; \
+	int j; \
+\
+	for (j = 0; j < n; j++) \
+	{ \
+		double dx = ((double)sx[j] - x0) * hx; \
+		double dy = ((double)sy[j] - y0) * hy; \
+		double r_squared = dx*dx + dy*dy + eps_squared; \
+		double f = k * sm[j] / (r_squared * sqrt(r_squared)); \
+\
+		f = r_squared != 0 ? f : 0; \
+		sum_x += f * dx; \
+		sum_y += f * dy; \
+	} \
+\
+	*ax += sum_x; \
+	*ay += sum_y; \
+}
+
+COMPACT_KERNEL(compact_scalar, SCALAR_LOOP)
+COMPACT_KERNEL(compact_sse2, VECTOR_LOOP("sse2"))
+COMPACT_KERNEL(compact_avx2, VECTOR_LOOP("avx2,fma"))
+COMPACT_KERNEL(compact_avx512, VECTOR_LOOP("avx512f"))
+
+/* Swap the gravity kernels for the ones of force_law on the same instruction set */
+static void select_law()
+{
+	int wide = isa_width;
+	AccelKernel coulomb[4] = { coulomb_scalar, coulomb_sse2, coulomb_avx2, coulomb_avx512 };
+	AccelKernel lj[4] = { lj_scalar, lj_sse2, lj_avx2, lj_avx512 };
+	AccelKernel yukawa[4] = { yukawa_scalar, yukawa_sse2, yukawa_avx2, yukawa_avx512 };
+
+	if (strcmp(force_law, "gravity") == 0)
+	{
+		return;
+	}
+	else if (strcmp(force_law, "coulomb") == 0)
+	{
+		accel_kernel = coulomb[wide];
+	}
+	else if (strcmp(force_law, "lj") == 0)
+	{
+		law_c1 = law_length * law_length;
+		law_c2 = 12.0 / law_length;
+		accel_kernel = lj[wide];
+	}
+	else if (strcmp(force_law, "yukawa") == 0)
+	{
+		law_c1 = 1.0 / law_length;
+		accel_kernel = yukawa[wide];
+	}
+	else
+	{
+		printf("Unknown force law: %s\n", force_law);
+		exit(1);
+	}
+
+	if (opt_rsqrt >= 0)
+	{
+		printf("--rsqrt is only supported for gravity\n");
+		exit(1);
+	}
+	snprintf(isa_name, sizeof(isa_name), "%.32s %s", kernel_isa, force_law);
+	kernel_isa = isa_name;
+
+	return;
+}
+
+/* The AccelPotKernel whose forces are those of kernel, see KERNEL_TWINS */
+static AccelPotKernel pot_twin(AccelKernel kernel)
+{
+	static const struct { AccelKernel kernel; AccelPotKernel pot; } twins[] = {
+		{ accel_scalar, accel_scalar_pot }, { soft_scalar, soft_scalar_pot },
+		{ accel_sse2, accel_sse2_pot }, { accel_avx2, accel_avx2_pot }, { accel_avx512, accel_avx512_pot },
+		{ rsqrt_scalar, rsqrt_scalar_pot }, { rsqrt_sse2, rsqrt_sse2_pot },
+		{ rsqrt_avx2, rsqrt_avx2_pot }, { rsqrt_avx512, rsqrt_avx512_pot },
+		{ coulomb_scalar, coulomb_scalar_pot }, { coulomb_sse2, coulomb_sse2_pot },
+		{ coulomb_avx2, coulomb_avx2_pot }, { coulomb_avx512, coulomb_avx512_pot },
+		{ lj_scalar, lj_scalar_pot }, { lj_sse2, lj_sse2_pot },
+		{ lj_avx2, lj_avx2_pot }, { lj_avx512, lj_avx512_pot },
+		{ yukawa_scalar, yukawa_scalar_pot }, { yukawa_sse2, yukawa_sse2_pot },
+		{ yukawa_avx2, yukawa_avx2_pot }, { yukawa_avx512, yukawa_avx512_pot }
+	};
+	int t;
+
+	for (t = 0; t < (int)(sizeof(twins) / sizeof(twins[0])); t++)
+	{
+		if (twins[t].kernel == kernel)
+		{
+			return twins[t].pot;
+		}
+	}
+	assert(0);
+
+	return NULL;
+}
+
+/* Pick the force kernel. isa is one of "scalar", "sse2", "avx2" or "avx512";
+ * NULL picks the widest one this CPU supports. With --rsqrt the double kernel
+ * of that instruction set is the reciprocal square root one. Must be called
+ * after init() so the softening length is known. */
+void kernel_select(const char *isa)
+{
+	int has_sse2, has_avx2, has_avx512;
+
+	eps2 = softening * softening;
+
+	__builtin_cpu_init();
+	has_sse2 = __builtin_cpu_supports("sse2");
+	has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	has_avx512 = __builtin_cpu_supports("avx512f");
+
+	if (isa == NULL)
+	{
+		isa = has_avx512 ? "avx512" : has_avx2 ? "avx2" : has_sse2 ? "sse2" : "scalar";
+	}
+
+	if (strcmp(isa, "scalar") == 0)
+	{
+		accel_kernel = accel_scalar;
+		accel_tile_kernel = tile_generic;
+		accel_kernel_single = single_scalar;
+		accel_kernel_mixed = mixed_scalar;
+		accel_kernel_compact = compact_scalar;
+		kernel_isa = "scalar";
+		isa_width = 0;
+	}
+	else if (strcmp(isa, "sse2") == 0 && has_sse2)
+	{
+		accel_kernel = accel_sse2;
+		accel_tile_kernel = tile_generic;
+		accel_kernel_single = single_sse2;
+		accel_kernel_mixed = mixed_sse2;
+		accel_kernel_compact = compact_sse2;
+		kernel_isa = "sse2";
+		isa_width = 1;
+	}
+	else if (strcmp(isa, "avx2") == 0 && has_avx2)
+	{
+		accel_kernel = accel_avx2;
+		accel_tile_kernel = tile_avx2;
+		accel_kernel_single = single_avx2;
+		accel_kernel_mixed = mixed_avx2;
+		accel_kernel_compact = compact_avx2;
+		kernel_isa = "avx2+fma";
+		isa_width = 2;
+	}
+	else if (strcmp(isa, "avx512") == 0 && has_avx512)
+	{
+		accel_kernel = accel_avx512;
+		accel_tile_kernel = tile_avx512;
+		accel_kernel_single = single_avx512;
+		accel_kernel_mixed = mixed_avx512;
+		accel_kernel_compact = compact_avx512;
+		kernel_isa = "avx512";
+		isa_width = 3;
+	}
+	else
+	{
+		printf("Force kernel ISA \"%s\" is unknown or not supported by this CPU\n", isa);
+		exit(1);
+	}
+
+	if (opt_rsqrt >= 0)
+	{
+		newton_steps = opt_rsqrt;
+		accel_kernel = accel_kernel == accel_scalar ? rsqrt_scalar :
+					   accel_kernel == accel_sse2 ? rsqrt_sse2 :
+					   accel_kernel == accel_avx2 ? rsqrt_avx2 : rsqrt_avx512;
+		snprintf(isa_name, sizeof(isa_name), "%s rsqrt+%d newton", kernel_isa, newton_steps);
+		kernel_isa = isa_name;
+	}
+
+	if (eps2 > 0 && accel_kernel == accel_scalar)
+	{
+		accel_kernel = soft_scalar;
+	}
+
+	select_law();
+	accel_kernel_pot = pot_twin(accel_kernel);
+
+	if (compact_storage)
+	{
+		char name[sizeof(isa_name)];
+
+		// kernel_isa may already be isa_name, which snprintf must not read and write
+		snprintf(name, sizeof(name), "%.32s compact", kernel_isa);
+		strcpy(isa_name, name);
+		kernel_isa = isa_name;
+	}
+
+	return;
+}
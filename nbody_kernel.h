@@ -0,0 +1,49 @@
+// nbody_kernel.h: Pairwise acceleration kernels shared by all n-body versions
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_KERNEL_H
+#define NBODY_KERNEL_H
+
+#include <stdint.h>
+
+/* Add the acceleration felt at point (x, y) due to the n source bodies with
+ * positions (sx[j], sy[j]) and masses sm[j] onto *ax and *ay. Sources sitting
+ * exactly on (x, y), such as the body itself, are skipped. */
+typedef void (*AccelKernel)(double x, double y, const double *sx, const double *sy,
+							const double *sm, int n, double *ax, double *ay);
+
+/* Same as AccelKernel for the nt points (tx[t], ty[t]), adding onto ax[t] and
+ * ay[t]. Points are done TILE_ROWS at a time so every source loaded from
+ * memory is used for several points while they stay in registers. */
+typedef void (*AccelTileKernel)(const double *tx, const double *ty, int nt, const double *sx,
+								const double *sy, const double *sm, int n, double *ax, double *ay);
+
+#define TILE_ROWS 4
+
+/* AccelKernel on float positions and masses. The single precision kernels also
+ * sum in float, the mixed precision ones sum the float terms in double. */
+typedef void (*AccelKernelFloat)(float x, float y, const float *sx, const float *sy,
+								 const float *sm, int n, double *ax, double *ay);
+
+/* AccelKernel on the fixed point positions of --storage=compact, which are
+ * decoded on the fly (see nbody_compact.c) */
+typedef void (*AccelKernelCompact)(int32_t x, int32_t y, const int32_t *sx, const int32_t *sy,
+								   const double *sm, int n, double *ax, double *ay);
+
+/* AccelKernel that also adds the potential at (x, y) per unit mass of the
+ * point to *pot, in the same pass over the sources (for --diag) */
+typedef void (*AccelPotKernel)(double x, double y, const double *sx, const double *sy,
+							   const double *sm, int n, double *ax, double *ay, double *pot);
+
+extern AccelKernel accel_kernel;	/* kernel picked by kernel_select() */
+extern AccelTileKernel accel_tile_kernel;	/* tile kernel for the same instruction set */
+extern AccelKernelFloat accel_kernel_single;	/* float kernels for the same instruction set */
+extern AccelKernelFloat accel_kernel_mixed;
+extern AccelKernelCompact accel_kernel_compact;	/* compact storage kernel for the same instruction set */
+extern AccelPotKernel accel_kernel_pot;	/* kernel with the potential for the same instruction set and law */
+extern const char *kernel_isa;		/* name of the instruction set accel_kernel uses */
+
+void kernel_select(const char *isa);
+
+#endif
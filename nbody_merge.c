@@ -0,0 +1,450 @@
+// nbody_merge.c: Inelastic merging of overlapping bodies
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// With --merge two bodies that overlap are replaced by one, so they no longer
+// pass through each other. Body.size is the diameter a body is drawn with, and
+// the frames draw one universe unit per pixel, so bodies i and j overlap when
+// they are closer than (size_i + size_j) / 2, at their nearest periodic image.
+// The merged body keeps the total mass and momentum: it sits at the center of
+// mass, moves with the mass weighted velocity, covers the area of both (up to
+// the largest size a body can have) and takes the color of the heavier one.
+//
+// Every version calls merge_step() with its whole team at the start of a step,
+// before the forces. A step:
+//   1. hashes the bodies into square cells at least as wide as the largest
+//      body: cell (cx, cy) goes to one of 2N buckets, so the universe can be
+//      far larger than the bodies. The buckets are filled by the same counting
+//      sort as the cell solver's (nbody_cell.c), in body order.
+//   2. every thread finds, for its share of the bodies, the lowest numbered
+//      body overlapping each one in the 3 x 3 cells around it
+//   3. two bodies that are each other's lowest overlap merge into the lower
+//      numbered one; a body in a clump of three or more waits for a later step
+//   4. every thread counts the bodies of its share that are left, the counts
+//      are scanned in thread order, and every thread writes its bodies to its
+//      own offsets in bodies_new and in spare info arrays, which are then
+//      swapped in and numBodies shrinks
+// Step 4 is skipped when nothing merged. The survivors keep their order, so
+// the run is the same for any team size.
+//
+// The arrays keep their allocated size of numPadded; the bodies past the new
+// numBodies are never read, and the masses there, up to numPadded, are cleared
+// like the padding.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_balance.h"
+#include "nbody_compact.h"
+#include "nbody_merge.h"
+
+static int active;				/* 1 with --merge */
+static int team_size;			/* number of threads merge_init() was set up for */
+static int num_buckets;			/* size of the hash table, a power of 2 */
+static int ncx, ncy;			/* cells in x and y */
+static double cell_wx, cell_wy;	/* cell size */
+
+static int **bucket_offset;		/* per thread: its bodies in each bucket, then where they go */
+static int *bucket_start;		/* bodies of bucket b are bucket_bodies[bucket_start[b] .. bucket_start[b + 1]) */
+static int *bucket_bodies;		/* body indices ordered by bucket */
+static int *range_total;		/* bodies in the range of buckets of each thread */
+static int *partner;			/* lowest numbered body overlapping each body, -1 if none */
+static int *kept;				/* bodies left in the share of each thread */
+static int *widest;				/* largest size left in the share of each thread */
+
+static double *spare_mass;		/* body_info arrays the survivors are written to */
+static int *spare_color, *spare_size;
+
+static int start_bodies;		/* numBodies before the first step */
+static int merges;				/* pairs merged so far */
+
+/* Cells at least w wide that tile the universe */
+static void set_cells(int w)
+{
+	ncx = (int)(univ_x / w);
+	ncy = (int)(univ_y / w);
+	ncx = ncx < 1 ? 1 : ncx;
+	ncy = ncy < 1 ? 1 : ncy;
+	cell_wx = univ_x / ncx;
+	cell_wy = univ_y / ncy;
+}
+
+void merge_init(int num_threads)
+{
+	int t, i, w;
+
+	active = opt_merge;
+	if (!active)
+	{
+		return;
+	}
+
+	// These keep per body copies made once at the start
+	if (compact_storage || strcmp(opt_precision, "double") != 0)
+	{
+		printf("--merge needs --storage=double and --precision=double\n");
+		exit(1);
+	}
+	for (i = 0; i < numBodies; i++)
+	{
+		if (body_info.mass[i] <= opt_tracer_mass)
+		{
+			printf("--merge is not supported with tracers\n");
+			exit(1);
+		}
+	}
+
+	team_size = num_threads;
+	num_buckets = 1;
+	while (num_buckets < 2 * numBodies)
+	{
+		num_buckets *= 2;
+	}
+
+	w = 1;
+	for (i = 0; i < numBodies; i++)
+	{
+		w = body_info.size[i] > w ? body_info.size[i] : w;
+	}
+	set_cells(w);
+
+	bucket_offset = (int**)my_malloc(sizeof(int*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		bucket_offset[t] = (int*)my_malloc(sizeof(int) * num_buckets);
+	}
+	bucket_start = (int*)my_malloc(sizeof(int) * (num_buckets + 1));
+	bucket_bodies = (int*)my_malloc(sizeof(int) * numBodies);
+	range_total = (int*)my_malloc(sizeof(int) * num_threads);
+	partner = (int*)my_malloc(sizeof(int) * numBodies);
+	kept = (int*)my_malloc(sizeof(int) * num_threads);
+	widest = (int*)my_malloc(sizeof(int) * num_threads);
+	spare_mass = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	spare_color = (int*)my_aligned_malloc(numPadded * sizeof(int));
+	spare_size = (int*)my_aligned_malloc(numPadded * sizeof(int));
+	start_bodies = numBodies;
+	merges = 0;
+
+	return;
+}
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* Shortest periodic image of a difference along an axis of length size */
+static double nearest(double d, double size)
+{
+	return d - size * nearbyint(d / size);
+}
+
+/* Cell holding body i */
+static void cell_of(int i, int *cx, int *cy)
+{
+	double fx = floor((bodies->x[i] - x_min) / cell_wx);
+	double fy = floor((bodies->y[i] - y_min) / cell_wy);
+
+	// The wrap in update() can round a very fast body just outside the universe
+	*cx = fx < 0 ? 0 : (fx < ncx ? (int)fx : ncx - 1);
+	*cy = fy < 0 ? 0 : (fy < ncy ? (int)fy : ncy - 1);
+}
+
+static int bucket_of(int cx, int cy)
+{
+	return (int)(((unsigned)cx * 73856093u ^ (unsigned)cy * 19349663u) & (unsigned)(num_buckets - 1));
+}
+
+static int bucket_of_body(int i)
+{
+	int cx, cy;
+
+	cell_of(i, &cx, &cy);
+	return bucket_of(cx, cy);
+}
+
+/* Counting sort of the bodies by bucket, as bin_bodies() in nbody_cell.c */
+static void hash_bodies(Team *team)
+{
+	int *offset = bucket_offset[team->id];
+	int lo, hi, i, b, t, base;
+
+	memset(offset, 0, sizeof(int) * num_buckets);
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		offset[bucket_of_body(i)]++;
+	}
+	team_barrier(team);
+
+	share(team, num_buckets, &lo, &hi);
+	base = 0;
+	for (b = lo; b < hi; b++)
+	{
+		for (t = 0; t < team->size; t++)
+		{
+			base += bucket_offset[t][b];
+		}
+	}
+	range_total[team->id] = base;
+	team_barrier(team);
+
+	base = 0;
+	for (t = 0; t < team->id; t++)
+	{
+		base += range_total[t];
+	}
+	for (b = lo; b < hi; b++)
+	{
+		bucket_start[b] = base;
+		for (t = 0; t < team->size; t++)
+		{
+			int count = bucket_offset[t][b];
+
+			bucket_offset[t][b] = base;
+			base += count;
+		}
+	}
+	if (team->id == team->size - 1)
+	{
+		bucket_start[num_buckets] = numBodies;
+	}
+	team_barrier(team);
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		bucket_bodies[offset[bucket_of_body(i)]++] = i;
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Lowest numbered body overlapping each body of this thread's share */
+static void find_partners(Team *team)
+{
+	const double *x = bodies->x;
+	const double *y = bodies->y;
+	const int *size = body_info.size;
+	int lo, hi, i;
+
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		int cx, cy, ox, oy, k;
+		int best = -1;
+
+		cell_of(i, &cx, &cy);
+		for (oy = -1; oy <= 1; oy++)
+		{
+			for (ox = -1; ox <= 1; ox++)
+			{
+				// Other cells sharing the bucket are rejected by the distance
+				int b = bucket_of((cx + ox + ncx) % ncx, (cy + oy + ncy) % ncy);
+
+				for (k = bucket_start[b]; k < bucket_start[b + 1]; k++)
+				{
+					int j = bucket_bodies[k];
+					double dx = nearest(x[j] - x[i], univ_x);
+					double dy = nearest(y[j] - y[i], univ_y);
+					double reach = 0.5 * (size[i] + size[j]);
+
+					if (j != i && (best < 0 || j < best) && dx*dx + dy*dy < reach * reach)
+					{
+						best = j;
+					}
+				}
+			}
+		}
+		partner[i] = best;
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* 1 if body i merges into a lower numbered body this step */
+static int absorbed(int i)
+{
+	int j = partner[i];
+
+	return j >= 0 && j < i && partner[j] == i;
+}
+
+/* Write body i, merged with its partner if they merge, to position k of
+ * bodies_new and the spare info arrays. Returns its size. */
+static int write_survivor(int i, int k)
+{
+	int j = partner[i];
+	double mi = body_info.mass[i];
+
+	if (j < 0 || partner[j] != i)
+	{
+		bodies_new->x[k] = bodies->x[i];
+		bodies_new->y[k] = bodies->y[i];
+		bodies_new->vx[k] = bodies->vx[i];
+		bodies_new->vy[k] = bodies->vy[i];
+		spare_mass[k] = mi;
+		spare_color[k] = body_info.color[i];
+		spare_size[k] = body_info.size[i];
+	}
+	else
+	{
+		double mj = body_info.mass[j];
+		double m = mi + mj;
+		double wj = m > 0 ? mj / m : 0.5;
+		double wi = 1 - wj;
+		double x = bodies->x[i] + wj * nearest(bodies->x[j] - bodies->x[i], univ_x);
+		double y = bodies->y[i] + wj * nearest(bodies->y[j] - bodies->y[i], univ_y);
+		double si = body_info.size[i];
+		double sj = body_info.size[j];
+		double s = nearbyint(sqrt(si*si + sj*sj));
+
+		if (x>=x_max || x<x_min)
+		{
+			x=x+(ceil((x_max-x)/univ_x)-1)*univ_x;
+		}
+		if (y>=y_max || y<y_min)
+		{
+			y=y+(ceil((y_max-y)/univ_y)-1)*univ_y;
+		}
+
+		bodies_new->x[k] = x;
+		bodies_new->y[k] = y;
+		bodies_new->vx[k] = wi * bodies->vx[i] + wj * bodies->vx[j];
+		bodies_new->vy[k] = wi * bodies->vy[i] + wj * bodies->vy[j];
+		spare_mass[k] = m;
+		spare_color[k] = mj > mi ? body_info.color[j] : body_info.color[i];
+		spare_size[k] = (int)s;
+	}
+
+	return spare_size[k];
+}
+
+/* Merge the overlapping pairs of the current state, see the top of the file.
+ * Every thread of the team must call it at the start of a step, before
+ * accel_prepare(). Returns 1 if numBodies changed. */
+int merge_step(Team *team)
+{
+	int lo, hi, i, t, k, total, w;
+
+	if (!active)
+	{
+		return 0;
+	}
+	assert(team->size == team_size);
+
+	hash_bodies(team);
+	find_partners(team);
+
+	share(team, numBodies, &lo, &hi);
+	kept[team->id] = 0;
+	for (i = lo; i < hi; i++)
+	{
+		kept[team->id] += !absorbed(i);
+	}
+	team_barrier(team);
+
+	total = 0;
+	k = 0;
+	for (t = 0; t < team->size; t++)
+	{
+		k += t < team->id ? kept[t] : 0;
+		total += kept[t];
+	}
+	if (total == numBodies)
+	{
+		return 0;
+	}
+
+	w = 1;
+	for (i = lo; i < hi; i++)
+	{
+		if (!absorbed(i))
+		{
+			int s;
+
+			if (balancing)
+			{
+				balance_move(i, k);
+			}
+			s = write_survivor(i, k++);
+
+			w = s > w ? s : w;
+		}
+	}
+	widest[team->id] = w;
+	team_barrier(team);
+
+	if (team->id == 0)
+	{
+		BodyState *tmp_state = bodies;
+		double *tmp_mass = body_info.mass;
+		int *tmp_color = body_info.color;
+		int *tmp_size = body_info.size;
+
+		bodies = bodies_new;
+		bodies_new = tmp_state;
+		body_info.mass = spare_mass;
+		body_info.color = spare_color;
+		body_info.size = spare_size;
+		spare_mass = tmp_mass;
+		spare_color = tmp_color;
+		spare_size = tmp_size;
+
+		// The array swapped in may still hold masses of an earlier merge past numBodies
+		memset(body_info.mass + total, 0, (numPadded - total) * sizeof(double));
+		merges += numBodies - total;
+		numBodies = total;
+
+		for (t = 1; t < team->size; t++)
+		{
+			w = widest[t] > w ? widest[t] : w;
+		}
+		set_cells(w);
+		if (balancing)
+		{
+			balance_renumbered();
+		}
+		accel_bodies_changed();
+	}
+	team_barrier(team);
+
+	return 1;
+}
+
+void merge_free()
+{
+	int t;
+
+	if (!active)
+	{
+		return;
+	}
+
+	#ifndef NO_OUT
+	printf("Merges: %d, %d of %d bodies left\n", merges, numBodies, start_bodies);
+	#endif
+
+	for (t = 0; t < team_size; t++)
+	{
+		free(bucket_offset[t]);
+	}
+	free(bucket_offset);
+	free(bucket_start);
+	free(bucket_bodies);
+	free(range_total);
+	free(partner);
+	free(kept);
+	free(widest);
+	free(spare_mass);
+	free(spare_color);
+	free(spare_size);
+}
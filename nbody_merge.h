@@ -0,0 +1,14 @@
+// nbody_merge.h: Inelastic merging of overlapping bodies
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_MERGE_H
+#define NBODY_MERGE_H
+
+#include "nbody_accel.h"
+
+void merge_init(int num_threads);
+int merge_step(Team *team);
+void merge_free();
+
+#endif
@@ -0,0 +1,382 @@
+// nbody_pm.c: Particle-mesh solver for the periodic universe
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// update() wraps bodies back into the universe, so the universe is a torus.
+// This solver computes the forces of that periodic system on a grid:
+//   1. every thread assigns the mass of its share of the bodies to its own
+//      grid (CIC or TSC), then the grids are summed a block of rows per thread
+//   2. the mass grid goes through a 2D FFT (rows, then columns, split over the
+//      team), is multiplied by the Green's function and differentiated
+//   3. two inverse FFTs give the x and y acceleration on the grid
+//   4. accel_body() interpolates the grid back to the body with the same
+//      assignment scheme, so a body does not accelerate itself
+// The force law is a = K*m/r^2, a 1/r potential in the plane, whose 2D Fourier
+// transform is 2*pi/|k| (not the 1/k^2 of the 2D Poisson equation). The
+// assignment window is divided out once in Fourier space; dividing it out for
+// both the assignment and the interpolation sharpens the force further but the
+// 1/|k| kernel then amplifies aliasing too much at a few cells. Forces are
+// accurate to about 1% from 5 cells out, so this is for dense runs where the
+// grid is fine compared to the distance between neighbors.
+//
+// The private grids are summed in thread order, so the mass grid depends on
+// how the bodies were split over the team. With --reproducible the masses are
+// deposited as 64 bit fixed point numbers (2^-62 of the total mass, far below
+// double rounding of a cell) instead, whose sums do not depend on the order.
+// Everything after that is done per row or column, the same for any team.
+
+#include <assert.h>
+#include <complex.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nbody_common.h"
+#include "nbody_pm.h"
+
+static int ng;					/* grid points per side, power of 2 */
+static int scheme;				/* PM_CIC or PM_TSC */
+static int team_size;			/* number of threads pm_init() was set up for */
+static double hx, hy;			/* grid spacing */
+static double **deposit;		/* private mass grid of each thread */
+static int64_t **fixed_deposit;	/* the same in fixed point, for --reproducible */
+static double fixed_scale;		/* fixed point units per unit of mass */
+static double complex *mesh;	/* mass, then potential, in Fourier space */
+static double complex *mesh_ax, *mesh_ay;	/* acceleration, Fourier space then real */
+static double complex **line;	/* per thread buffer for one grid column */
+static double complex *twiddle;	/* exp(-2 pi i k / ng) for k < ng / 2 */
+static int *bit_rev;			/* bit reversal permutation of 0 .. ng - 1 */
+
+void pm_init(int grid, int assign, int num_threads)
+{
+	int bits = 0;
+	int k, t;
+
+	assert(grid >= 4 && (grid & (grid - 1)) == 0);
+	ng = grid;
+	scheme = assign;
+	team_size = num_threads;
+	hx = univ_x / ng;
+	hy = univ_y / ng;
+
+	deposit = (double**)my_malloc(sizeof(double*) * num_threads);
+	fixed_deposit = NULL;
+	line = (double complex**)my_malloc(sizeof(double complex*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		deposit[t] = (double*)my_aligned_malloc(sizeof(double) * ng * ng);
+		line[t] = (double complex*)my_aligned_malloc(sizeof(double complex) * ng);
+	}
+
+	if (opt_reproducible)
+	{
+		double total = 0;
+
+		for (k = 0; k < numBodies; k++)
+		{
+			total += body_info.mass[k];
+		}
+		fixed_scale = ldexp(1.0, 62) / total;	// a cell never holds more than the total
+		fixed_deposit = (int64_t**)my_malloc(sizeof(int64_t*) * num_threads);
+		for (t = 0; t < num_threads; t++)
+		{
+			fixed_deposit[t] = (int64_t*)my_aligned_malloc(sizeof(int64_t) * ng * ng);
+		}
+	}
+	mesh = (double complex*)my_aligned_malloc(sizeof(double complex) * ng * ng);
+	mesh_ax = (double complex*)my_aligned_malloc(sizeof(double complex) * ng * ng);
+	mesh_ay = (double complex*)my_aligned_malloc(sizeof(double complex) * ng * ng);
+
+	twiddle = (double complex*)my_malloc(sizeof(double complex) * ng / 2);
+	for (k = 0; k < ng / 2; k++)
+	{
+		twiddle[k] = cexp(-2 * M_PI * I * k / ng);
+	}
+
+	while ((1 << bits) < ng)
+	{
+		bits++;
+	}
+	bit_rev = (int*)my_malloc(sizeof(int) * ng);
+	for (k = 0; k < ng; k++)
+	{
+		int b, r = 0;
+		for (b = 0; b < bits; b++)
+		{
+			r |= ((k >> b) & 1) << (bits - 1 - b);
+		}
+		bit_rev[k] = r;
+	}
+
+	return;
+}
+
+/* In place radix-2 FFT of ng contiguous values. The inverse is not scaled. */
+static void fft_line(double complex *a, int inverse)
+{
+	int len, k, j;
+
+	for (k = 0; k < ng; k++)
+	{
+		if (k < bit_rev[k])
+		{
+			double complex tmp = a[k];
+			a[k] = a[bit_rev[k]];
+			a[bit_rev[k]] = tmp;
+		}
+	}
+
+	for (len = 2; len <= ng; len <<= 1)
+	{
+		int step = ng / len;
+		for (k = 0; k < ng; k += len)
+		{
+			for (j = 0; j < len / 2; j++)
+			{
+				double complex w = inverse ? conj(twiddle[j * step]) : twiddle[j * step];
+				double complex u = a[k + j];
+				double complex v = a[k + j + len / 2] * w;
+				a[k + j] = u + v;
+				a[k + j + len / 2] = u - v;
+			}
+		}
+	}
+
+	return;
+}
+
+/* Grid points [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* 2D FFT of a grid, rows then columns, split over the team */
+static void fft_grid(Team *team, double complex *grid, int inverse)
+{
+	double complex *col = line[team->id];
+	int lo, hi, r, c;
+
+	share(team, ng, &lo, &hi);
+	for (r = lo; r < hi; r++)
+	{
+		fft_line(grid + r * ng, inverse);
+	}
+	team_barrier(team);
+
+	for (c = lo; c < hi; c++)
+	{
+		for (r = 0; r < ng; r++)
+		{
+			col[r] = grid[r * ng + c];
+		}
+		fft_line(col, inverse);
+		for (r = 0; r < ng; r++)
+		{
+			grid[r * ng + c] = col[r];
+		}
+	}
+	team_barrier(team);
+
+	return;
+}
+
+/* Grid points and weights of the assignment scheme along one axis for grid
+ * coordinate g (cell centers at integers). Returns the number of points. */
+static int weights(double g, int *idx, double *w)
+{
+	if (scheme == PM_CIC)
+	{
+		int i0 = (int)floor(g);
+		double f = g - i0;
+
+		idx[0] = i0;
+		idx[1] = i0 + 1;
+		w[0] = 1 - f;
+		w[1] = f;
+		return 2;
+	}
+	else
+	{
+		int i0 = (int)floor(g + 0.5);
+		double d = g - i0;
+
+		idx[0] = i0 - 1;
+		idx[1] = i0;
+		idx[2] = i0 + 1;
+		w[0] = 0.5 * (0.5 - d) * (0.5 - d);
+		w[1] = 0.75 - d * d;
+		w[2] = 0.5 * (0.5 + d) * (0.5 + d);
+		return 3;
+	}
+}
+
+/* Wrap a grid index into 0 .. ng - 1 */
+static int wrap(int i)
+{
+	return ((i % ng) + ng) % ng;
+}
+
+/* Sinc of the assignment window along one axis, 1 at k = 0 */
+static double window(int m, double h, double size)
+{
+	double kh = M_PI * m * h / size;	// k h / 2 with k = 2 pi m / size
+	return m == 0 ? 1.0 : sin(kh) / kh;
+}
+
+/* Team part of a step: mass assignment, FFTs and the Green's function */
+void pm_prepare(Team *team)
+{
+	double *dep = deposit[team->id];
+	double norm = 1.0 / (univ_x * univ_y);
+	int power = scheme == PM_CIC ? 2 : 3;	// window is sinc^2 (CIC) or sinc^3 (TSC)
+	int lo, hi, i, c, t;
+
+	assert(team->size == team_size);
+
+	// Mass assignment of this thread's share of the bodies to its own grid
+	memset(dep, 0, sizeof(double) * ng * ng);
+	if (fixed_deposit != NULL)
+	{
+		memset(fixed_deposit[team->id], 0, sizeof(int64_t) * ng * ng);
+	}
+	share(team, numBodies, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		int ix[3], iy[3], nx_pts, ny_pts, a, b;
+		double wx[3], wy[3];
+
+		nx_pts = weights((bodies->x[i] - x_min) / hx - 0.5, ix, wx);
+		ny_pts = weights((bodies->y[i] - y_min) / hy - 0.5, iy, wy);
+		for (b = 0; b < ny_pts; b++)
+		{
+			for (a = 0; a < nx_pts; a++)
+			{
+				int g = wrap(iy[b]) * ng + wrap(ix[a]);
+				double m = body_info.mass[i] * wx[a] * wy[b];
+
+				if (fixed_deposit != NULL)
+				{
+					fixed_deposit[team->id][g] += llrint(m * fixed_scale);
+				}
+				else
+				{
+					dep[g] += m;
+				}
+			}
+		}
+	}
+	team_barrier(team);
+
+	share(team, ng * ng, &lo, &hi);
+	for (c = lo; c < hi; c++)
+	{
+		double sum = 0;
+		int64_t fixed_sum = 0;
+
+		if (fixed_deposit != NULL)
+		{
+			for (t = 0; t < team->size; t++)
+			{
+				fixed_sum += fixed_deposit[t][c];
+			}
+			sum = fixed_sum / fixed_scale;
+		}
+		else
+		{
+			for (t = 0; t < team->size; t++)
+			{
+				sum += deposit[t][c];
+			}
+		}
+		mesh[c] = sum;
+	}
+	team_barrier(team);
+
+	fft_grid(team, mesh, 0);
+
+	// phi(k) = -2 pi K M(k) / |k|, a(k) = -i k phi(k); 1/area is the inverse transform scale
+	share(team, ng, &lo, &hi);
+	for (i = lo; i < hi; i++)
+	{
+		int my = i <= ng / 2 ? i : i - ng;
+		double ky = 2 * M_PI * my / univ_y;
+		double wy = window(my, hy, univ_y);
+
+		for (c = 0; c < ng; c++)
+		{
+			int mx = c <= ng / 2 ? c : c - ng;
+			double kx = 2 * M_PI * mx / univ_x;
+			double k_len = sqrt(kx*kx + ky*ky);
+			double w = pow(window(mx, hx, univ_x) * wy, power);
+			double complex phi;
+
+			if (mx == 0 && my == 0)
+			{
+				mesh_ax[i * ng + c] = mesh_ay[i * ng + c] = 0;
+				continue;
+			}
+
+			phi = -2 * M_PI * K * norm * mesh[i * ng + c] / (k_len * w);
+			// The Nyquist modes have no well defined derivative
+			mesh_ax[i * ng + c] = mx == ng / 2 ? 0 : -I * kx * phi;
+			mesh_ay[i * ng + c] = my == ng / 2 ? 0 : -I * ky * phi;
+		}
+	}
+	team_barrier(team);
+
+	fft_grid(team, mesh_ax, 1);
+	fft_grid(team, mesh_ay, 1);
+
+	return;
+}
+
+/* Add the acceleration at (x, y) interpolated from the grid to *ax, *ay */
+void pm_accel(double x, double y, double *ax, double *ay)
+{
+	int ix[3], iy[3], nx_pts, ny_pts, a, b;
+	double wx[3], wy[3];
+
+	nx_pts = weights((x - x_min) / hx - 0.5, ix, wx);
+	ny_pts = weights((y - y_min) / hy - 0.5, iy, wy);
+	for (b = 0; b < ny_pts; b++)
+	{
+		for (a = 0; a < nx_pts; a++)
+		{
+			int g = wrap(iy[b]) * ng + wrap(ix[a]);
+			*ax += creal(mesh_ax[g]) * wx[a] * wy[b];
+			*ay += creal(mesh_ay[g]) * wx[a] * wy[b];
+		}
+	}
+
+	return;
+}
+
+void pm_free()
+{
+	int t;
+
+	for (t = 0; t < team_size; t++)
+	{
+		free(deposit[t]);
+		free(line[t]);
+	}
+	free(deposit);
+	free(line);
+	if (fixed_deposit != NULL)
+	{
+		for (t = 0; t < team_size; t++)
+		{
+			free(fixed_deposit[t]);
+		}
+		free(fixed_deposit);
+	}
+	free(mesh);
+	free(mesh_ax);
+	free(mesh_ay);
+	free(twiddle);
+	free(bit_rev);
+}
@@ -0,0 +1,17 @@
+// nbody_pm.h: Particle-mesh solver for the periodic universe
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_PM_H
+#define NBODY_PM_H
+
+#include "nbody_accel.h"
+
+enum { PM_CIC, PM_TSC };	// Mass assignment schemes
+
+void pm_init(int grid, int assign, int num_threads);
+void pm_prepare(Team *team);
+void pm_accel(double x, double y, double *ax, double *ay);
+void pm_free();
+
+#endif
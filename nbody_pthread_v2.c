@@ -27,7 +27,6 @@
 // CPEG 652 Semester Project
 
 #include <assert.h>
-#include <gd.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -35,39 +34,19 @@
 
 #include <pthread.h>
 
-#define MAXCOLORS 254
-#define PWIDTH 1
-
-/* There is one structure of this type for each "body" in the
- * simulation.	All of the attributes and the current state of the
- * body are recorded in this structure. */
-typedef struct BodyStruct {
-	double mass;	/* mass of body */
-	int color;	   	/* color used to draw this body */
-	int size;		/* diameter of body in pixels */
-	double x;		/* x position */
-	double y;		/* y position */
-	double vx;		/* velocity, x-direction */
-	double vy;		/* velocity, y-direction */
-} Body;
-
-/* Global variables */
-double x_min;				/* coord of left edge of universe */
-double x_max;				/* coord of right edge of universe */
-double y_min;				/* coord of bottom edge of universe */
-double y_max;				/* coord of top edge of universe */
-double univ_x;				/* x_max-x_min */
-double univ_y;				/* y_max-y_min */
-int nx;						/* width of movie window (pixels) */
-int ny;						/* height of movie window (pixels) */
-int numBodies;				/* number of bodies */
-double K;					/* single constant encoding G, grid spacing, etc. */
-int nsteps;					/* number of time steps */
-int period;			 		/* number of times steps beween movie frames */
-FILE *gif;			 		/* file containing animated GIF */
-gdImagePtr im,  previm;		/* pointers to consecutive GIF images */
-int *colors;		 		/* colors we will use */
-Body *bodies, *bodies_new;	/* two copies of main data structure: list of bodies */
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_accel.h"
+#include "nbody_small.h"
+#include "nbody_compact.h"
+#include "nbody_diag.h"
+#include "nbody_merge.h"
+#include "nbody_block.h"
+#include "nbody_integrate.h"
+#include "nbody_reorder.h"
+#include "nbody_groups.h"
+#include "nbody_balance.h"
+#include "nbody_async.h"
 
 // Pthread global variables
 int num_threads = 0;
@@ -79,156 +58,12 @@ int *threads_ids;
 pthread_t *threads;
 pthread_barrier_t barrier;
 double *step_time_sums;
+DiagSums *diag_parts;		// Diagnostics sums of each thread's bodies
 
-void* my_malloc(int numBytes)
+/* Barrier used by the shared force code */
+static void pthread_team_barrier(void)
 {
-  void *result = malloc(numBytes);
-  assert(result);
-
-  return result;
-}
-
-/* Prepare for GIF creation: open file, allocate color array */
-void prepgif(char *outfilename)
-{
-	gif = fopen(outfilename, "wb");
-	assert(gif);
-	colors = (int*)my_malloc(sizeof(int) * MAXCOLORS);
-
-	return;
-}
-
-/* init: reads init file and initializes variables */
-void init(char *infilename, char *outfilename)
-{
-	FILE *infile = fopen(infilename, "r");
-	int i;
-
-	assert(infile);
-	fscanf(infile, "%lf", &x_min);
-	fscanf(infile, "%lf", &x_max);
-	assert(x_max > x_min);
-	univ_x = x_max-x_min;
-	fscanf(infile, "%lf", &y_min);
-	fscanf(infile, "%lf", &y_max);
-	assert(y_max > y_min);
-	univ_y = y_max-y_min;
-	fscanf(infile, "%d", &nx);
-	assert(nx>=10);
-	fscanf(infile, "%d", &ny);
-	assert(ny>=10);
-	fscanf(infile, "%lf", &K);
-	assert(K>0);
-	fscanf(infile, "%d", &nsteps);
-	assert(nsteps>=1);
-	fscanf(infile, "%d", &period);
-	assert(period>0);
-	fscanf(infile, "%d", &numBodies);
-	assert(numBodies>0);
-
-	#ifndef NO_OUT
-	printf("x_min = %lf\n", x_min);
-	printf("x_max = %lf\n", x_max);
-	printf("y_min = %lf\n", y_min);
-	printf("y_max = %lf\n", y_max);
-	printf("nx = %d\n", nx);
-	printf("ny = %d\n", ny);
-	printf("K = %f\n", K);
-	printf("nsteps = %d\n", nsteps);
-	printf("period = %d\n", period);
-	printf("numBodies = %d\n", numBodies);
-	fflush(stdout);
-	#endif
-
-	bodies = (Body*)my_malloc(numBodies*sizeof(Body));
-	bodies_new = (Body*)my_malloc(numBodies*sizeof(Body));
-
-	for (i=0; i<numBodies; i++)
-	{
-		fscanf(infile, "%lf", &bodies[i].mass);
-		assert(bodies[i].mass > 0);
-		fscanf(infile, "%d", &bodies[i].color);
-		assert(bodies[i].color >=0 && bodies[i].color<MAXCOLORS);
-		fscanf(infile, "%d", &bodies[i].size);
-		assert(bodies[i].size > 0);
-		fscanf(infile, "%lf", &bodies[i].x);
-		assert(bodies[i].x >=x_min && bodies[i].x < x_max);
-		fscanf(infile, "%lf", &bodies[i].y);
-		assert(bodies[i].y >=y_min && bodies[i].y < y_max);
-		fscanf(infile, "%lf", &bodies[i].vx);
-		fscanf(infile, "%lf", &bodies[i].vy);
-	}
-
-	for (i=0; i<numBodies; i++)
-	{
-		bodies_new[i].mass = bodies[i].mass;
-		bodies_new[i].color = bodies[i].color;
-		bodies_new[i].size = bodies[i].size;
-	}
-
-	fclose(infile);
-
-	#ifndef NO_OUT
-	prepgif(outfilename);
-	#endif
-
-	return;
-}
-
-/* Write one frame of the GIF for given time */
-// Note for parallel versions: gd states only one thread per image, so the write
-// frame has be to sequential
-void write_frame(int time)
-{
-	int i;
-
-	im = gdImageCreate(nx,ny);
-	if (time == 0)
-	{
-		gdImageColorAllocate(im, 0, 0, 0);	/* black background */
-		for (i=0; i<MAXCOLORS; i++)
-		{
-			colors[i] = gdImageColorAllocate (im, i, 0, MAXCOLORS-i-1);		/* (im, i,i,i); gives gray-scale image */
-		}
-		gdImageGifAnimBegin(im, gif, 1, -1);
-	}
-	else
-	{
-		gdImagePaletteCopy(im, previm);
-	}
-
-	for (i=0; i<numBodies; i++)
-	{
-		Body *body = bodies + i;
-		double x = body->x;
-
-		if (x>=0 && x<nx)
-		{
-			double y = body->y;
-			if (y>=0 && y<ny)
-			{
-				int size = bodies[i].size;
-				int color = bodies[i].color;
-
-				gdImageFilledEllipse(im, (int)x, ny-(int)y, size, size, colors[color]);
-			 }
-		}
-	}
-
-	if (time == 0)
-	{
-		gdImageGifAnimAdd(im, gif, 0, 0, 0, 0, gdDisposalNone, NULL);
-	}
-	else
-	{
-		gdImageGifAnimAdd(im, gif, 0, 0, 0, 5, gdDisposalNone, /* previm */ NULL);
-		gdImageDestroy(previm);
-	}
-
-	previm=im;
-	im=NULL;
-
-	return;
+	pthread_barrier_wait(&barrier);
 }
 
 /* Move forward one time step.	This is the "integration step".	 For
@@ -248,6 +83,15 @@ void *update(void *arg) {
 	int ID = *ID_ptr;
 	int first = start_idx_num_owned[ID * 2];
 	int num_owned = start_idx_num_owned[(ID * 2) + 1];
+	Team team = {ID, num_threads, pthread_team_barrier};
+	DiagSums *sums = diag_parts + ID;
+
+	// With --stale the steps run without barriers on old positions
+	if (async_steps)
+	{
+		async_run(&team, step_time_sums + ID);
+		return NULL;
+	}
 
 	// Main N-body simulation loop
 	for (step = 1; step <= nsteps; step++)
@@ -255,74 +99,139 @@ void *update(void *arg) {
 		struct timespec thread_step_s, thread_step_e;
 		double thread_elapsed;
 		clock_gettime(CLOCK_MONOTONIC, &thread_step_s);
-		
-		// Loop through the bodies owned by this thread
-		int i;
-		for (i = first; i < first + num_owned; i++)
+
+		int diag = diag_due(step);
+		diag_clear(sums);
+
+		// Overlapping bodies merge first (--merge); the blocks follow numBodies
+		if (merge_step(&team) && !balancing)
+		{
+			first = ((long)ID * numBodies) / num_threads;
+			num_owned = ((long)(ID + 1) * numBodies) / num_threads - first;
+			start_idx_num_owned[ID * 2] = first;
+			start_idx_num_owned[(ID * 2) + 1] = num_owned;
+		}
+
+		// Then every --sort-every steps the bodies are sorted along a curve (--sort)
+		reorder_step(&team, step);
+
+		// The load balancer split the blocks again for the bodies of a merge or sort
+		if (balancing)
+		{
+			first = start_idx_num_owned[ID * 2];
+			num_owned = start_idx_num_owned[(ID * 2) + 1];
+		}
+
+		// Every period steps the groups of the bodies are logged (--fof)
+		groups_step(&team, step);
+
+		// Bodies on their own power of 2 steps are moved by the block module, and
+		// the symplectic integrators by the integrator module
+		if (block_steps)
 		{
-			double x = bodies[i].x;
-			double y = bodies[i].y;
-			double vx = bodies[i].vx;
-			double vy = bodies[i].vy;
-			double ax = 0;
-			double ay = 0;
-			int j;
-
-			// Apply effects of all other bodies onto this current body
-			for (j = 0; j < numBodies; j++)
+			block_step(&team, step, sums);
+		}
+		else if (symplectic)
+		{
+			integrate_step(&team, step, sums);
+		}
+		else
+		{
+			// Force work that needs the whole team (only some solvers have any)
+			accel_prepare(&team);
+		
+			// Loop through the bodies owned by this thread, timing them for --balance
+			if (balancing)
 			{
-				double r, mass, dx, dy, r_squared, acceleration;
+				balance_start(ID, first);
+			}
+			int i;
+			for (i = first; i < first + num_owned; i++)
+			{
+				if (balancing)
+				{
+					balance_body(ID, i);
+				}
 
-				if (j == i)
+				// Packed state is stepped by the compact storage module
+				if (compact_storage)
 				{
+					compact_body(i);
 					continue;
 				}
 
-				dx = bodies[j].x - x;
-				dy = bodies[j].y - y;
-				mass = bodies[j].mass;
-				r_squared = dx*dx + dy*dy;
-
-				if (r_squared != 0) {
-					r = sqrt(r_squared);
-					if (r != 0)
-					{
-					  acceleration = K*mass/(r_squared);
-					  ax += acceleration*dx/r;
-					  ay += acceleration*dy/r;
-					}
+				double x = bodies->x[i];
+				double y = bodies->y[i];
+				double vx = bodies->vx[i];
+				double vy = bodies->vy[i];
+				double ax = 0;
+				double ay = 0;
+
+				// Apply effects of all other bodies onto this current body
+				if (diag)
+				{
+					// Diagnostics step: the same pass sums this body's energy terms
+					diag_accel_body(i, &ax, &ay, sums);
+				}
+				else
+				{
+					accel_body(i, &ax, &ay);
 				}
-			}
 
-			x += vx;
-			y += vy;
+				x += vx * opt_dt;
+				y += vy * opt_dt;
 
-			if (x>=x_max || x<x_min)
-			{
-				x=x+(ceil((x_max-x)/univ_x)-1)*univ_x;
+				if (x>=x_max || x<x_min)
+				{
+					x=x+(ceil((x_max-x)/univ_x)-1)*univ_x;
+				}
+				if (y>=y_max || y<y_min)
+				{
+					y=y+(ceil((y_max-y)/univ_y)-1)*univ_y;
+				}
+
+				vx += ax * opt_dt;
+				vy += ay * opt_dt;
+				assert(!(isnan(x) || isnan(y)));
+				assert(!(isnan(vx) || isnan(vy)));
+				bodies_new->x[i] = x;
+				bodies_new->y[i] = y;
+				bodies_new->vx[i] = vx;
+				bodies_new->vy[i] = vy;
 			}
-			if (y>=y_max || y<y_min)
+			if (balancing)
 			{
-				y=y+(ceil((y_max-y)/univ_y)-1)*univ_y;
+				balance_stop(ID, first + num_owned);
 			}
-
-			vx += ax;
-			vy += ay;
-			assert(!(isnan(x) || isnan(y)));
-			assert(!(isnan(vx) || isnan(vy)));
-			bodies_new[i].x = x;
-			bodies_new[i].y = y;
-			bodies_new[i].vx = vx;
-			bodies_new[i].vy = vy;
 		}
 
 		// Must wait until all above operations are done before switching arrays
 		pthread_barrier_wait(&barrier);
 
 		// Main thread handles sequential operation: Switch old and new arrays
+		// and combine the diagnostics sums of the threads in thread order
 		if (ID == 0)
 		{
-			Body *tmp = bodies;
+			if (diag)
+			{
+				DiagSums total;
+				int t;
+
+				diag_clear(&total);
+				for (t = 0; t < num_threads; t++)
+				{
+					diag_merge(&total, diag_parts + t);
+				}
+				diag_write(step - 1, &total);
+			}
+
+			// Move the blocks of the next step if the work was uneven (--balance)
+			if (balancing)
+			{
+				balance_step(step);
+			}
+
+			BodyState *tmp = bodies;
 			bodies = bodies_new;
 			bodies_new = tmp;
 		}
@@ -330,6 +239,12 @@ void *update(void *arg) {
 		pthread_barrier_wait(&barrier);
 		// Must wait until thread 0 (main thread) finishes switching arrays before
 		// all threads are allowed to continue
+
+		if (balancing)
+		{
+			first = start_idx_num_owned[ID * 2];
+			num_owned = start_idx_num_owned[(ID * 2) + 1];
+		}
 		
 		// Main thread handles sequential operation: write out frame if needed
 		if(ID == 0)
@@ -353,24 +268,6 @@ void *update(void *arg) {
 	return NULL;
 }
 
-/* Close GIF file, free all allocated data structures */
-void wrapup()
-{
-	#ifndef NO_OUT
-	if (previm)
-	{
-		gdImageDestroy(previm);
-	}
-
-	gdImageGifAnimEnd(gif);
-	fclose(gif);
-	#endif
-
-	free(colors);
-	free(bodies);
-	free(bodies_new);
-}
-
 /* Perform an n-body simulation and create a GIF movie.	 Usage: you
  * can either specify two arguments: the name of the configuration
  * file and the name of the GIF file you are going to create, or you
@@ -381,9 +278,9 @@ int main(int argc, char* argv[])
 	struct timespec begin_time, end_time; 	// Used for timing
 	double elapsed_time; 					// Used for timing
 
-	if (argc != 4)
+	if (argc < 4)
 	{
-		printf("Usage: nbody_pthread_v2 <infilename> <outfilename> <number of threads>\n");
+		printf("Usage: nbody_pthread_v2 <infilename> <outfilename> <number of threads> [options]\n");
 		fflush(stdout);
 		exit(1);
 	}
@@ -395,6 +292,8 @@ int main(int argc, char* argv[])
 		exit(1);
 	}
 
+	parse_options(argc, argv, 4);
+
 	step_time_sums = (double*)my_malloc(sizeof(double) * num_threads);
 	
 	int i;
@@ -412,44 +311,64 @@ int main(int argc, char* argv[])
 	#endif
 
 	init(argv[1], argv[2]);
+	kernel_select(opt_isa);
+	accel_init(num_threads);
+	block_init(num_threads);
+	integrate_init(num_threads);
+	merge_init(num_threads);
+	reorder_init(num_threads);
+	groups_init(num_threads);
+	async_init(num_threads);
 
 	#ifndef NO_OUT
 	write_frame(0);
 	#endif
 
 	start_idx_num_owned = (int*)my_malloc(sizeof(int) * num_threads * 2);
+	balance_init(num_threads, start_idx_num_owned);
 	threads_ids = (int*)my_malloc(sizeof(int) * num_threads);
 	threads = (pthread_t*)my_malloc(sizeof(pthread_t) * num_threads);
+	diag_parts = (DiagSums*)my_malloc(sizeof(DiagSums) * num_threads);
 	pthread_barrier_init(&barrier, NULL, num_threads);  // Initialize the barrier
 
-	// Create the thread IDs and each iteration space (block partitioned)
-	for(i = 0; i < num_threads; i++){
-		threads_ids[i] = i; 						// i is the thread index or rank
-		int first = (i * numBodies) / num_threads;	// Calculate the local starting index
-		start_idx_num_owned[i * 2] = first;
-		start_idx_num_owned[(i * 2) + 1] = ((i + 1) * numBodies) / num_threads - first; // Calculate the number of bodies owned
-		// printf("id=%d, start_idx=%d, num_owned=%d\n", threads_ids[i], start_idx_num_owned[i * 2], start_idx_num_owned[(i * 2) + 1]);
-
-		// Skip over main thread (id=0) when calling pthread_create, launch other threads
-		if(i != 0)
-		{
-			pthread_create(threads + i, NULL, update, threads_ids + i);
+	// Tiny systems are cheaper to run on this thread alone
+	if (!small_run(step_time_sums))
+	{
+		// Create the thread IDs and each iteration space (block partitioned)
+		for(i = 0; i < num_threads; i++){
+			threads_ids[i] = i; 						// i is the thread index or rank
+			int first = (i * numBodies) / num_threads;	// Calculate the local starting index
+			start_idx_num_owned[i * 2] = first;
+			start_idx_num_owned[(i * 2) + 1] = ((i + 1) * numBodies) / num_threads - first; // Calculate the number of bodies owned
+			// printf("id=%d, start_idx=%d, num_owned=%d\n", threads_ids[i], start_idx_num_owned[i * 2], start_idx_num_owned[(i * 2) + 1]);
+
+			// Skip over main thread (id=0) when calling pthread_create, launch other threads
+			if(i != 0)
+			{
+				pthread_create(threads + i, NULL, update, threads_ids + i);
+			}
 		}
-	}
 
-	// Also have main thread do work instead of waiting
-	update(threads_ids);
+		// Also have main thread do work instead of waiting
+		update(threads_ids);
 
-	// When all steps for n-body are calculated, join the threads (they are no longer needed)
-	for(i = 1; i < num_threads; i++)
-	{
-		pthread_join(threads[i], NULL);
+		// When all steps for n-body are calculated, join the threads (they are no longer needed)
+		for(i = 1; i < num_threads; i++)
+		{
+			pthread_join(threads[i], NULL);
+		}
 	}
 
 	wrapup();
+	accel_free();
+	merge_free();
+	groups_free();
+	block_free();
+	integrate_free();
 	free(start_idx_num_owned);
 	free(threads_ids);
 	free(threads);
+	free(diag_parts);
 	pthread_barrier_destroy(&barrier); // Destroy the barrier; no longer needed
 
 	clock_gettime(CLOCK_MONOTONIC, &end_time);	// End timer
@@ -457,6 +376,7 @@ int main(int argc, char* argv[])
 	elapsed_time += (end_time.tv_nsec - begin_time.tv_nsec) / 1000000000.0;
 
 	printf("\nTotal time (seconds): %f\n", elapsed_time);
+	printf("Force kernel: %s, %s precision\n", kernel_isa, opt_precision);
 	fflush(stdout);
 	
 	for(i = 0; i < num_threads; i++)
@@ -464,8 +384,14 @@ int main(int argc, char* argv[])
 		printf("Thread %d avg step time: %f, Total step time %f\n", i, step_time_sums[i] / (nsteps * 1.0), step_time_sums[i]);
 	}
 	fflush(stdout);
+	reorder_report(nsteps);
+	balance_report();
+	async_report();
 	
 	free(step_time_sums);
+	reorder_free();
+	balance_free();
+	async_free();
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+// nbody_radix.c: Parallel radix sort of key and body pairs
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The space-filling curve sort (nbody_reorder.c) and the Barnes-Hut tree build
+// (nbody_bh.c) both order the bodies by an integer key. radix_sort() sorts the
+// (key, body) pairs with the whole team, least significant digit first,
+// RADIX_BITS a pass: every thread counts the digits of an equal share, works
+// out where they go from the counts of all threads (digit first, then thread
+// order), and scatters them. Passes where all keys share the digit are
+// skipped. The sort is stable, so the order is the same for any team size.
+
+#include <assert.h>
+#include <string.h>
+
+#include "nbody_radix.h"
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* Stable sort of the n (key, body) pairs in keys[0], order[0] by the low
+ * key_bits bits of the keys. keys[1] and order[1] are scratch of the same
+ * size, and counts[t] holds RADIX_SIZE ints for thread t. Every thread of the
+ * team must call it; returns the buffer (0 or 1) that holds the result. */
+int radix_sort(Team *team, int n, int key_bits, uint64_t **keys, int **order, int **counts)
+{
+	int *count = counts[team->id];
+	int offset[RADIX_SIZE];
+	int lo, hi, i, d, t, shift;
+	int src = 0;
+
+	assert(key_bits <= 64);
+
+	share(team, n, &lo, &hi);
+	for (shift = 0; shift < key_bits; shift += RADIX_BITS)
+	{
+		const uint64_t *key_in = keys[src];
+		const int *order_in = order[src];
+		int base = 0;
+
+		memset(count, 0, sizeof(int) * RADIX_SIZE);
+		for (i = lo; i < hi; i++)
+		{
+			count[(key_in[i] >> shift) & (RADIX_SIZE - 1)]++;
+		}
+		team_barrier(team);
+
+		for (d = 0; d < RADIX_SIZE; d++)
+		{
+			int total = 0;
+
+			offset[d] = base;
+			for (t = 0; t < team->size; t++)
+			{
+				offset[d] += t < team->id ? counts[t][d] : 0;
+				total += counts[t][d];
+			}
+			// Every key has this digit: the pass would leave the order as is
+			if (total == n)
+			{
+				break;
+			}
+			base += total;
+		}
+		if (d < RADIX_SIZE)
+		{
+			// All threads see the same counts and skip together
+			team_barrier(team);
+			continue;
+		}
+
+		for (i = lo; i < hi; i++)
+		{
+			int k = offset[(key_in[i] >> shift) & (RADIX_SIZE - 1)]++;
+
+			keys[1 - src][k] = key_in[i];
+			order[1 - src][k] = order_in[i];
+		}
+		src = 1 - src;
+		team_barrier(team);
+	}
+
+	return src;
+}
@@ -0,0 +1,17 @@
+// nbody_radix.h: Parallel radix sort of key and body pairs
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_RADIX_H
+#define NBODY_RADIX_H
+
+#include <stdint.h>
+
+#include "nbody_accel.h"
+
+#define RADIX_BITS 8		// Key bits sorted per pass
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+int radix_sort(Team *team, int n, int key_bits, uint64_t **keys, int **order, int **counts);
+
+#endif
@@ -0,0 +1,339 @@
+// nbody_reorder.c: Space-filling curve reordering of the bodies
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// The bodies stay in config file order, so bodies that are close in space are
+// scattered over the arrays: the tiles of the tiled solver, the cells and
+// Verlet lists of the cell solver and the tree walks all jump around memory,
+// and the block of bodies each thread owns covers the whole universe. With
+// --sort=morton|hilbert the arrays are sorted along that curve over the
+// universe bounds every --sort-every steps, so neighbours in space are mostly
+// neighbours in memory and every thread's block is a compact region. Hilbert
+// keeps more of the neighbours together; Morton is cheaper to compute.
+//
+// Every version calls reorder_step() with its whole team at the start of a
+// step, before the forces. On a sorting step the team:
+//   1. computes the 32 bit key of its share of the bodies: the position
+//      quantized to 16 bits per axis, on the chosen curve
+//   2. sorts the (key, body) pairs with the team's radix sort (nbody_radix.c)
+//   3. gathers its share of the sorted bodies into bodies_new and spare info
+//      arrays, which are then swapped in, and tells the solver and the
+//      integrator the bodies were renumbered
+// The sort is stable, so the order is the same for any team size.
+//
+// Each slot remembers which body of the config file it holds, and body_slot
+// maps back: the frames are drawn and the --reproducible checksum is taken in
+// file order, so output does not depend on the sorting. The forces are summed
+// in another order, so the last bits differ from a run without --sort.
+//
+// The time of the sorts is part of the step time, and is printed per thread
+// at the end with the step timings.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nbody_common.h"
+#include "nbody_balance.h"
+#include "nbody_compact.h"
+#include "nbody_integrate.h"
+#include "nbody_radix.h"
+#include "nbody_reorder.h"
+
+#define KEY_BITS 16		// Quantization of each axis
+
+int *body_slot;
+
+static int active;				/* 1 with --sort */
+static int hilbert;				/* 1 for the Hilbert curve, 0 for Morton */
+static int team_size;			/* number of threads reorder_init() was set up for */
+
+static uint64_t *keys[2];		/* curve keys, sorted and scratch */
+static int *order[2];			/* body of each key, sorted and scratch */
+static int **digit_count;		/* per thread: its keys with each digit this pass */
+
+static int *body_id;			/* body of the config file in each slot */
+static int *spare_id;			/* body_id and body_info arrays the sorted bodies are written to */
+static double *spare_mass;
+static int *spare_color, *spare_size;
+
+static int sorts;				/* sorts done */
+static double *time_sums;		/* per thread: time spent sorting */
+
+void reorder_init(int num_threads)
+{
+	int t, i;
+
+	body_slot = NULL;
+	active = 0;
+	if (strcmp(opt_sort, "none") == 0)
+	{
+		return;
+	}
+	else if (strcmp(opt_sort, "morton") == 0)
+	{
+		hilbert = 0;
+	}
+	else if (strcmp(opt_sort, "hilbert") == 0)
+	{
+		hilbert = 1;
+	}
+	else
+	{
+		printf("Unknown sort: %s\n", opt_sort);
+		exit(1);
+	}
+
+	// These keep per body state that is not moved with the bodies
+	if (compact_storage || opt_merge || opt_block_levels >= 0)
+	{
+		printf("--sort is not supported with --storage=compact, --merge or --block-levels\n");
+		exit(1);
+	}
+
+	active = 1;
+	team_size = num_threads;
+	for (i = 0; i < 2; i++)
+	{
+		keys[i] = (uint64_t*)my_malloc(sizeof(uint64_t) * numBodies);
+		order[i] = (int*)my_malloc(sizeof(int) * numBodies);
+	}
+	digit_count = (int**)my_malloc(sizeof(int*) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		digit_count[t] = (int*)my_malloc(sizeof(int) * RADIX_SIZE);
+	}
+
+	body_id = (int*)my_malloc(sizeof(int) * numBodies);
+	body_slot = (int*)my_malloc(sizeof(int) * numBodies);
+	spare_id = (int*)my_malloc(sizeof(int) * numBodies);
+	for (i = 0; i < numBodies; i++)
+	{
+		body_id[i] = i;
+		body_slot[i] = i;
+	}
+	spare_mass = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	spare_color = (int*)my_aligned_malloc(numPadded * sizeof(int));
+	spare_size = (int*)my_aligned_malloc(numPadded * sizeof(int));
+	// The padding past numBodies is never gathered; keep it massless
+	memset(spare_mass, 0, numPadded * sizeof(double));
+
+	sorts = 0;
+	time_sums = (double*)my_malloc(sizeof(double) * num_threads);
+	for (t = 0; t < num_threads; t++)
+	{
+		time_sums[t] = 0.0;
+	}
+
+	#ifndef NO_OUT
+	printf("Sort: %s curve every %d steps\n", opt_sort, opt_sort_every);
+	#endif
+
+	return;
+}
+
+/* Items [*lo, *hi) of n are done by this thread */
+static void share(Team *team, int n, int *lo, int *hi)
+{
+	*lo = (int)(((long)team->id * n) / team->size);
+	*hi = (int)(((long)(team->id + 1) * n) / team->size);
+}
+
+/* A coordinate as a KEY_BITS integer over [low, low + size) */
+static unsigned quantize(double x, double low, double size)
+{
+	double q = (x - low) / size * (1 << KEY_BITS);
+
+	// The wrap in update() can round a very fast body just outside the universe
+	return q < 0 ? 0 : (q < (1 << KEY_BITS) ? (unsigned)q : (1 << KEY_BITS) - 1);
+}
+
+/* The low 16 bits of v, spread to the even bits */
+static unsigned spread_bits(unsigned v)
+{
+	v = (v | (v << 8)) & 0x00ff00ffu;
+	v = (v | (v << 4)) & 0x0f0f0f0fu;
+	v = (v | (v << 2)) & 0x33333333u;
+	v = (v | (v << 1)) & 0x55555555u;
+
+	return v;
+}
+
+/* Distance along the Hilbert curve through the 2^KEY_BITS square grid */
+static unsigned hilbert_key(unsigned x, unsigned y)
+{
+	unsigned n = 1u << KEY_BITS;
+	unsigned s, d = 0;
+
+	for (s = n / 2; s > 0; s /= 2)
+	{
+		unsigned rx = (x & s) != 0;
+		unsigned ry = (y & s) != 0;
+
+		d += s * s * ((3 * rx) ^ ry);
+
+		// Rotate the quadrant so the curve inside it starts at its corner
+		if (ry == 0)
+		{
+			unsigned t;
+
+			if (rx == 1)
+			{
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			t = x;
+			x = y;
+			y = t;
+		}
+	}
+
+	return d;
+}
+
+static unsigned key_of(int i)
+{
+	unsigned x = quantize(bodies->x[i], x_min, univ_x);
+	unsigned y = quantize(bodies->y[i], y_min, univ_y);
+
+	return hilbert ? hilbert_key(x, y) : spread_bits(x) | (spread_bits(y) << 1);
+}
+
+/* Sort the bodies along the curve if this step is due, see the top of the
+ * file. Every thread of the team must call it at the start of a step, before
+ * accel_prepare(). */
+void reorder_step(Team *team, int step)
+{
+	struct timespec sort_s, sort_e;
+	const int *from;
+	int lo, hi, k;
+
+	if (!active || (step - 1) % opt_sort_every != 0)
+	{
+		return;
+	}
+	assert(team->size == team_size);
+	clock_gettime(CLOCK_MONOTONIC, &sort_s);
+
+	share(team, numBodies, &lo, &hi);
+	for (k = lo; k < hi; k++)
+	{
+		keys[0][k] = key_of(k);
+		order[0][k] = k;
+	}
+	team_barrier(team);
+
+	from = order[radix_sort(team, numBodies, 2 * KEY_BITS, keys, order, digit_count)];
+
+	for (k = lo; k < hi; k++)
+	{
+		int i = from[k];
+
+		bodies_new->x[k] = bodies->x[i];
+		bodies_new->y[k] = bodies->y[i];
+		bodies_new->vx[k] = bodies->vx[i];
+		bodies_new->vy[k] = bodies->vy[i];
+		spare_mass[k] = body_info.mass[i];
+		spare_color[k] = body_info.color[i];
+		spare_size[k] = body_info.size[i];
+		spare_id[k] = body_id[i];
+		if (balancing)
+		{
+			balance_move(i, k);
+		}
+	}
+	team_barrier(team);
+
+	if (team->id == 0)
+	{
+		BodyState *tmp_state = bodies;
+		double *tmp_mass = body_info.mass;
+		int *tmp_color = body_info.color;
+		int *tmp_size = body_info.size;
+		int *tmp_id = body_id;
+
+		bodies = bodies_new;
+		bodies_new = tmp_state;
+		body_info.mass = spare_mass;
+		body_info.color = spare_color;
+		body_info.size = spare_size;
+		body_id = spare_id;
+		spare_mass = tmp_mass;
+		spare_color = tmp_color;
+		spare_size = tmp_size;
+		spare_id = tmp_id;
+
+		sorts++;
+		if (balancing)
+		{
+			balance_renumbered();
+		}
+		accel_bodies_changed();
+	}
+	team_barrier(team);
+
+	for (k = lo; k < hi; k++)
+	{
+		body_slot[body_id[k]] = k;
+	}
+	if (symplectic)
+	{
+		integrate_permute(team, from);
+	}
+	team_barrier(team);
+
+	clock_gettime(CLOCK_MONOTONIC, &sort_e);
+	time_sums[team->id] += sort_e.tv_sec - sort_s.tv_sec;
+	time_sums[team->id] += (sort_e.tv_nsec - sort_s.tv_nsec) / 1000000000.0;
+
+	return;
+}
+
+/* Print the time each thread spent sorting, with the step timings */
+void reorder_report(int nsteps)
+{
+	int t;
+
+	if (!active)
+	{
+		return;
+	}
+
+	printf("Sorts along the %s curve: %d\n", opt_sort, sorts);
+	for (t = 0; t < team_size; t++)
+	{
+		printf("Thread %d avg sort time: %f, Total sort time %f (part of the step time)\n", t, time_sums[t] / (nsteps * 1.0), time_sums[t]);
+	}
+	fflush(stdout);
+}
+
+void reorder_free()
+{
+	int t;
+
+	if (!active)
+	{
+		return;
+	}
+
+	for (t = 0; t < 2; t++)
+	{
+		free(keys[t]);
+		free(order[t]);
+	}
+	for (t = 0; t < team_size; t++)
+	{
+		free(digit_count[t]);
+	}
+	free(digit_count);
+	free(body_id);
+	free(body_slot);
+	free(spare_id);
+	free(spare_mass);
+	free(spare_color);
+	free(spare_size);
+	free(time_sums);
+	body_slot = NULL;
+}
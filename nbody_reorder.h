@@ -0,0 +1,17 @@
+// nbody_reorder.h: Space-filling curve reordering of the bodies
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_REORDER_H
+#define NBODY_REORDER_H
+
+#include "nbody_accel.h"
+
+extern int *body_slot;		/* where each body of the config file is in the arrays (NULL = in file order) */
+
+void reorder_init(int num_threads);
+void reorder_step(Team *team, int step);
+void reorder_report(int nsteps);
+void reorder_free();
+
+#endif
@@ -26,292 +26,126 @@
 // CPEG 652 Semester Project
 
 #include <assert.h>
-#include <gd.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 
-#define MAXCOLORS 254
-#define PWIDTH 1
-
-/* There is one structure of this type for each "body" in the
- * simulation.	All of the attributes and the current state of the
- * body are recorded in this structure. */
-typedef struct BodyStruct {
-	double mass;	/* mass of body */
-	int color;	   	/* color used to draw this body */
-	int size;		/* diameter of body in pixels */
-	double x;		/* x position */
-	double y;		/* y position */
-	double vx;		/* velocity, x-direction */
-	double vy;		/* velocity, y-direction */
-} Body;
-
-/* Global variables */
-double x_min;				/* coord of left edge of universe */
-double x_max;				/* coord of right edge of universe */
-double y_min;				/* coord of bottom edge of universe */
-double y_max;				/* coord of top edge of universe */
-double univ_x;				/* x_max-x_min */
-double univ_y;				/* y_max-y_min */
-int nx;						/* width of movie window (pixels) */
-int ny;						/* height of movie window (pixels) */
-int numBodies;				/* number of bodies */
-double K;					/* single constant encoding G, grid spacing, etc. */
-int nsteps;					/* number of time steps */
-int period;			 		/* number of times steps beween movie frames */
-FILE *gif;			 		/* file containing animated GIF */
-gdImagePtr im,  previm;		/* pointers to consecutive GIF images */
-int *colors;		 		/* colors we will use */
-Body *bodies, *bodies_new;	/* two copies of main data structure: list of bodies */
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_accel.h"
+#include "nbody_small.h"
+#include "nbody_compact.h"
+#include "nbody_diag.h"
+#include "nbody_merge.h"
+#include "nbody_block.h"
+#include "nbody_integrate.h"
+#include "nbody_reorder.h"
+#include "nbody_groups.h"
 
 double step_time_sum = 0.0;
 
-void* my_malloc(int numBytes)
-{
-  void *result = malloc(numBytes);
-  assert(result);
-  
-  return result;
-}
-
-/* Prepare for GIF creation: open file, allocate color array */
-void prepgif(char *outfilename)
-{
-	gif = fopen(outfilename, "wb");
-	assert(gif);
-	colors = (int*)my_malloc(sizeof(int) * MAXCOLORS);
+/* Move forward one time step.	This is the "integration step".	 For
+ * each body b, compute the total force acting on that body.  If you
+ * divide this by the mass of b, you get b's acceleration.	So you
+ * actually just calculate the b's acceleration directly, since this
+ * is what you want to know.  Once you have the acceleration, proceed
+ * as follows: update the position by adding the current velocity,
+ * then update the velocity by adding to it the current acceleration.
+ */
+void update(int step) {
 	
-	return;
-}
-
-/* init: reads init file and initializes variables */
-void init(char *infilename, char *outfilename)
-{
-	FILE *infile = fopen(infilename, "r");
 	int i;
+	Team team = {0, 1, NULL};
+	int diag = diag_due(step);
+	DiagSums sums;
 
-	assert(infile);
-	fscanf(infile, "%lf", &x_min);
-	fscanf(infile, "%lf", &x_max);
-	assert(x_max > x_min);
-	univ_x = x_max-x_min;
-	fscanf(infile, "%lf", &y_min);
-	fscanf(infile, "%lf", &y_max);
-	assert(y_max > y_min);
-	univ_y = y_max-y_min;
-	fscanf(infile, "%d", &nx);
-	assert(nx>=10);
-	fscanf(infile, "%d", &ny);
-	assert(ny>=10);
-	fscanf(infile, "%lf", &K);
-	assert(K>0);
-	fscanf(infile, "%d", &nsteps);
-	assert(nsteps>=1);
-	fscanf(infile, "%d", &period);
-	assert(period>0);
-	fscanf(infile, "%d", &numBodies);
-	assert(numBodies>0);
-	
-	#ifndef NO_OUT
-	printf("x_min = %lf\n", x_min);
-	printf("x_max = %lf\n", x_max);
-	printf("y_min = %lf\n", y_min);
-	printf("y_max = %lf\n", y_max);
-	printf("nx = %d\n", nx);
-	printf("ny = %d\n", ny);
-	printf("K = %f\n", K);
-	printf("nsteps = %d\n", nsteps);
-	printf("period = %d\n", period);
-	printf("numBodies = %d\n", numBodies);
-	fflush(stdout);
-	#endif
-	
-	bodies = (Body*)my_malloc(numBodies*sizeof(Body));
-	bodies_new = (Body*)my_malloc(numBodies*sizeof(Body));
-
-	for (i=0; i<numBodies; i++)
-	{
-		fscanf(infile, "%lf", &bodies[i].mass);
-		assert(bodies[i].mass > 0);
-		fscanf(infile, "%d", &bodies[i].color);
-		assert(bodies[i].color >=0 && bodies[i].color<MAXCOLORS);
-		fscanf(infile, "%d", &bodies[i].size);
-		assert(bodies[i].size > 0);
-		fscanf(infile, "%lf", &bodies[i].x);
-		assert(bodies[i].x >=x_min && bodies[i].x < x_max);
-		fscanf(infile, "%lf", &bodies[i].y);
-		assert(bodies[i].y >=y_min && bodies[i].y < y_max);
-		fscanf(infile, "%lf", &bodies[i].vx);
-		fscanf(infile, "%lf", &bodies[i].vy);
-	}
-
-	// Combining this loop with the above loop didn't make a significant difference in 
-	// execution time. Leaving them as they are
-	for (i=0; i<numBodies; i++)
-	{
-		bodies_new[i].mass = bodies[i].mass;
-		bodies_new[i].color = bodies[i].color;
-		bodies_new[i].size = bodies[i].size;
-	}
+	diag_clear(&sums);
 
-	fclose(infile);
-	
-	#ifndef NO_OUT
-	prepgif(outfilename);
-	#endif
-	
-	return;
-}
+	// Overlapping bodies merge first (--merge)
+	merge_step(&team);
 
-/* Write one frame of the GIF for given time */
-void write_frame(int time)
-{
-	int i;
+	// Then every --sort-every steps the bodies are sorted along a curve (--sort)
+	reorder_step(&team, step);
 
-	im = gdImageCreate(nx,ny);
-	if (time == 0)
-	{
-		gdImageColorAllocate(im, 0, 0, 0);	/* black background */
-		for (i=0; i<MAXCOLORS; i++)
-		{
-			colors[i] = gdImageColorAllocate (im, i, 0, MAXCOLORS-i-1);		/* (im, i,i,i); gives gray-scale image */
-		}
-		gdImageGifAnimBegin(im, gif, 1, -1);
-	}
-	else
-	{
-		gdImagePaletteCopy(im, previm);
-	}
+	// Every period steps the groups of the bodies are logged (--fof)
+	groups_step(&team, step);
 
-	for (i=0; i<numBodies; i++)
+	// Bodies on their own power of 2 steps are moved by the block module, and
+	// the symplectic integrators by the integrator module
+	if (block_steps)
 	{
-		Body *body = bodies + i;
-		double x = body->x;
-
-		if (x>=0 && x<nx)
-		{
-			double y = body->y;
-			if (y>=0 && y<ny)
-			{
-				int size = bodies[i].size;
-				int color = bodies[i].color;
-
-				gdImageFilledEllipse(im, (int)x, ny-(int)y, size, size, colors[color]);
-			 }
-		}
+		block_step(&team, step, &sums);
 	}
-
-	if (time == 0)
+	else if (symplectic)
 	{
-		gdImageGifAnimAdd(im, gif, 0, 0, 0, 0, gdDisposalNone, NULL);
+		integrate_step(&team, step, &sums);
 	}
 	else
 	{
-		gdImageGifAnimAdd(im, gif, 0, 0, 0, 5, gdDisposalNone, /* previm */ NULL);
-		gdImageDestroy(previm);
-	}
-
-	previm=im;
-	im=NULL;
-	
-	return;
-}
+		// Force work that needs the whole team (only some solvers have any)
+		accel_prepare(&team);
 
-/* Move forward one time step.	This is the "integration step".	 For
- * each body b, compute the total force acting on that body.  If you
- * divide this by the mass of b, you get b's acceleration.	So you
- * actually just calculate the b's acceleration directly, since this
- * is what you want to know.  Once you have the acceleration, proceed
- * as follows: update the position by adding the current velocity,
- * then update the velocity by adding to it the current acceleration.
- */
-void update() {
-	
-	int i;
-	// Loop though all the bodies
-	for (i=0; i<numBodies; i++)
-	{
-		double x = bodies[i].x;
-		double y = bodies[i].y;
-		double vx = bodies[i].vx;
-		double vy = bodies[i].vy;
-		double ax = 0;
-		double ay = 0;
-		int j;
-		
-		// Apply effects of all other bodies onto this current body
-		for (j=0; j<numBodies; j++)
+		// Loop though all the bodies
+		for (i=0; i<numBodies; i++)
 		{
-			double r, mass, dx, dy, r_squared, acceleration;
-
-			if (j==i)
+			// Packed state is stepped by the compact storage module
+			if (compact_storage)
 			{
+				compact_body(i);
 				continue;
 			}
 
-			dx = bodies[j].x - x;
-			dy = bodies[j].y - y;
-			mass = bodies[j].mass;
-			r_squared = dx*dx + dy*dy;
+			double x = bodies->x[i];
+			double y = bodies->y[i];
+			double vx = bodies->vx[i];
+			double vy = bodies->vy[i];
+			double ax = 0;
+			double ay = 0;
+		
+			// Apply effects of all other bodies onto this current body
+			if (diag)
+			{
+				// Diagnostics step: the same pass sums this body's energy terms
+				diag_accel_body(i, &ax, &ay, &sums);
+			}
+			else
+			{
+				accel_body(i, &ax, &ay);
+			}
 
-			if (r_squared != 0)
+			x += vx * opt_dt;
+			y += vy * opt_dt;
+			if (x>=x_max || x<x_min)
 			{
-				r = sqrt(r_squared);
-				if (r != 0)
-				{
-					acceleration = K*mass/(r_squared);
-					ax += acceleration*dx/r;
-					ay += acceleration*dy/r;
-				}
-		  }
-		}
+				x=x+(ceil((x_max-x)/univ_x)-1)*univ_x;
+			}
+			if (y>=y_max || y<y_min)
+			{
+				y=y+(ceil((y_max-y)/univ_y)-1)*univ_y;
+			}
 
-		x += vx;
-		y += vy;
-		if (x>=x_max || x<x_min)
-		{
-			x=x+(ceil((x_max-x)/univ_x)-1)*univ_x;
-		}
-		if (y>=y_max || y<y_min)
-		{
-			y=y+(ceil((y_max-y)/univ_y)-1)*univ_y;
+			vx += ax * opt_dt;
+			vy += ay * opt_dt;
+			assert(!(isnan(x) || isnan(y)));
+			assert(!(isnan(vx) || isnan(vy)));
+			bodies_new->x[i] = x;
+			bodies_new->y[i] = y;
+			bodies_new->vx[i] = vx;
+			bodies_new->vy[i] = vy;
 		}
+	}
 
-		vx += ax;
-		vy += ay;
-		assert(!(isnan(x) || isnan(y)));
-		assert(!(isnan(vx) || isnan(vy)));
-		bodies_new[i].x = x;
-		bodies_new[i].y = y;
-		bodies_new[i].vx = vx;
-		bodies_new[i].vy = vy;
+	if (diag)
+	{
+		diag_write(step - 1, &sums);
 	}
 
-	Body *tmp = bodies;
+	BodyState *tmp = bodies;
 	bodies = bodies_new;
 	bodies_new = tmp;
 }
 
-/* Close GIF file, free all allocated data structures */
-void wrapup()
-{
-	#ifndef NO_OUT
-	if (previm)
-	{
-		gdImageDestroy(previm);
-	}
-	
-	gdImageGifAnimEnd(gif);
-	fclose(gif);
-	#endif
-	
-	free(colors);
-	free(bodies);
-	free(bodies_new);
-}
-
 /* Perform an n-body simulation and create a GIF movie.	 Usage: you
  * can either specify two arguments: the name of the configuration
  * file and the name of the GIF file you are going to create, or you
@@ -322,12 +156,28 @@ int main(int argc, char* argv[])
 	struct timespec begin_time, end_time; 	// Used for timing
 	double elapsed_time; 					// Used for timing
 	
-	if (argc != 3)
+	if (argc < 3)
 	{
-		printf("Usage: nbody_seq <infilename> <outfilename>\n");
+		printf("Usage: nbody_seq <infilename> <outfilename> [options]\n");
 		fflush(stdout);
 		exit(1);
 	}
+
+	parse_options(argc, argv, 3);
+
+	// --stale replaces the step loops of the v2 versions
+	if (opt_stale >= 0)
+	{
+		printf("--stale is only supported by nbody_pthread_v2 and nbody_omp_v2\n");
+		exit(1);
+	}
+
+	// --balance moves the blocks of the pthread versions
+	if (opt_balance > 0 || opt_balance_log != NULL)
+	{
+		printf("--balance and --balance-log are only supported by the pthread versions\n");
+		exit(1);
+	}
 	
 	clock_gettime(CLOCK_MONOTONIC, &begin_time); // Start main program timer
 	
@@ -337,6 +187,13 @@ int main(int argc, char* argv[])
 	#endif
 	
 	init(argv[1], argv[2]);
+	kernel_select(opt_isa);
+	accel_init(1);
+	block_init(1);
+	integrate_init(1);
+	merge_init(1);
+	reorder_init(1);
+	groups_init(1);
 	
 	#ifndef NO_OUT
 	write_frame(0);
@@ -346,36 +203,48 @@ int main(int argc, char* argv[])
 	struct timespec step_start, step_end; 	// Used for timing
 	double step_elapse; 					// Used for timing
 	
-	// N-body Simulation Loop
-	int step;
-	for (step = 1; step <= nsteps; step++)
+	// Tiny systems skip the per step timing below
+	if (!small_run(&step_time_sum))
 	{
-		clock_gettime(CLOCK_MONOTONIC, &step_start);
+		// N-body Simulation Loop
+		int step;
+		for (step = 1; step <= nsteps; step++)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &step_start);
 		
-		update();
+			update(step);
 
-		#ifndef NO_OUT
-		if (step % period == 0)
-		{
-			write_frame(step);
-		}
-		#endif
+			#ifndef NO_OUT
+			if (step % period == 0)
+			{
+				write_frame(step);
+			}
+			#endif
 		
-		clock_gettime(CLOCK_MONOTONIC, &step_end);
-		step_elapse = step_end.tv_sec - step_start.tv_sec;
-		step_elapse += (step_end.tv_nsec - step_start.tv_nsec) / 1000000000.0;
-		step_time_sum += step_elapse;
+			clock_gettime(CLOCK_MONOTONIC, &step_end);
+			step_elapse = step_end.tv_sec - step_start.tv_sec;
+			step_elapse += (step_end.tv_nsec - step_start.tv_nsec) / 1000000000.0;
+			step_time_sum += step_elapse;
+		}
 	}
 
 	wrapup();
+	accel_free();
+	merge_free();
+	groups_free();
+	block_free();
+	integrate_free();
 	
 	clock_gettime(CLOCK_MONOTONIC, &end_time);	// End timer
 	elapsed_time = end_time.tv_sec - begin_time.tv_sec;
 	elapsed_time += (end_time.tv_nsec - begin_time.tv_nsec) / 1000000000.0;
 	
 	printf("\nTotal time (seconds): %f\n", elapsed_time);
+	printf("Force kernel: %s, %s precision\n", kernel_isa, opt_precision);
 	printf("Thread 0 avg step time: %f, Total step time %f\n", step_time_sum / (nsteps * 1.0), step_time_sum);
 	fflush(stdout);
+	reorder_report(nsteps);
+	reorder_free();
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,142 @@
+// nbody_small.c: Single thread path for small systems
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+//
+// A step of a tiny system is only a few hundred pairs, less work than starting
+// the threads (pthread_v1), opening a parallel region (omp_v1) or waiting at
+// the barriers (the v2 versions) every step, so configs like Tests/config3.txt
+// got slower as threads were added. Systems of up to --small-n bodies are
+// simulated here instead, whatever thread count was asked for: one thread, the
+// state updated in place, the accelerations of a step in a small array that
+// stays in L1, and the steps between two frames done as one block with no
+// clock_gettime between them.
+//
+// Default threshold: a step costs about 2 ns per pair with the AVX-512 kernel,
+// and forking and joining the threads costs 7 us (omp_v1) to 36 us (pthread_v1)
+// per step with 2 to 4 threads. The threads only win once the pair work of a
+// step is several times that, at around 100 to 150 bodies.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nbody_common.h"
+#include "nbody_kernel.h"
+#include "nbody_small.h"
+#include "nbody_compact.h"
+#include "nbody_diag.h"
+
+/* Run the whole simulation on this thread if the system is small enough and
+ * uses the plain direct solver. Adds the time spent stepping to *step_time.
+ * Returns 1 if it did, 0 if the caller has to run it. */
+int small_run(double *step_time)
+{
+	double *x = bodies->x;
+	double *y = bodies->y;
+	double *vx = bodies->vx;
+	double *vy = bodies->vy;
+	double *ax, *ay;
+	struct timespec start, end;
+	int step, last, i;
+
+	// Massless tracers add nothing to the kernel sums, heavier ones have to be left out.
+	// Compact storage has its own step, compact_body(), and merging, block timesteps,
+	// the symplectic integrators, sorting, the group finder, the load balancer and
+	// the stale steps need a team step.
+	if (numBodies > opt_small_n || strcmp(opt_solver, "direct") != 0 || strcmp(opt_precision, "double") != 0
+		|| opt_tracer_mass > 0 || compact_storage || opt_merge || opt_block_levels >= 0
+		|| strcmp(opt_integrator, "euler") != 0 || strcmp(opt_sort, "none") != 0
+		|| opt_fof != NULL || opt_balance > 0 || opt_balance_log != NULL || opt_stale >= 0)
+	{
+		return 0;
+	}
+
+	#ifndef NO_OUT
+	printf("Small system: %d bodies stepped on one thread\n", numBodies);
+	fflush(stdout);
+	#endif
+
+	ax = (double*)my_aligned_malloc(numPadded * sizeof(double));
+	ay = (double*)my_aligned_malloc(numPadded * sizeof(double));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (step = 1; step <= nsteps; step = last + 1)
+	{
+		// Block of steps up to the next frame
+		last = (step + period - 1) / period * period;
+		if (last > nsteps)
+		{
+			last = nsteps;
+		}
+
+		for (; step <= last; step++)
+		{
+			// All accelerations first: the positions are updated in place
+			if (diag_due(step))
+			{
+				DiagSums sums;
+				double pot;
+
+				// The body arrays, like the other steps: the source copies of massless
+				// tracers are only gathered by accel_prepare()
+				diag_clear(&sums);
+				for (i = 0; i < numBodies; i++)
+				{
+					ax[i] = 0;
+					ay[i] = 0;
+					pot = 0;
+					accel_kernel_pot(x[i], y[i], x, y, body_info.mass, numBodies, ax + i, ay + i, &pot);
+					diag_add_body(i, vx[i], vy[i], pot, &sums);
+				}
+				diag_write(step - 1, &sums);
+			}
+			else
+			{
+				for (i = 0; i < numBodies; i++)
+				{
+					ax[i] = 0;
+					ay[i] = 0;
+					accel_kernel(x[i], y[i], x, y, body_info.mass, numBodies, ax + i, ay + i);
+				}
+			}
+
+			for (i = 0; i < numBodies; i++)
+			{
+				x[i] += vx[i] * opt_dt;
+				y[i] += vy[i] * opt_dt;
+				if (x[i]>=x_max || x[i]<x_min)
+				{
+					x[i]=x[i]+(ceil((x_max-x[i])/univ_x)-1)*univ_x;
+				}
+				if (y[i]>=y_max || y[i]<y_min)
+				{
+					y[i]=y[i]+(ceil((y_max-y[i])/univ_y)-1)*univ_y;
+				}
+
+				vx[i] += ax[i] * opt_dt;
+				vy[i] += ay[i] * opt_dt;
+				assert(!(isnan(x[i]) || isnan(y[i])));
+				assert(!(isnan(vx[i]) || isnan(vy[i])));
+			}
+		}
+
+		#ifndef NO_OUT
+		if (last % period == 0)
+		{
+			write_frame(last);
+		}
+		#endif
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*step_time += end.tv_sec - start.tv_sec;
+	*step_time += (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	free(ax);
+	free(ay);
+
+	return 1;
+}
@@ -0,0 +1,12 @@
+// nbody_small.h: Single thread path for small systems
+// Benjamin Steenkamer, 2019
+// CPEG 652 Semester Project
+
+#ifndef NBODY_SMALL_H
+#define NBODY_SMALL_H
+
+#define SMALL_N_DEFAULT 128	// Default --small-n, see nbody_small.c
+
+int small_run(double *step_time);
+
+#endif